@@ -0,0 +1,54 @@
+--
+-- Summary of the last benchmark run, from migrate.history, the samples of
+-- migrate.progress and the pgbench transaction logs. :started and
+-- :finished bound the migration, in seconds since the epoch.
+--
+\pset footer off
+
+WITH h AS (SELECT * FROM migrate.history ORDER BY id DESC LIMIT 1),
+ph AS (
+  SELECT p->>'phase' AS phase,
+         (p->>'start_s')::float8 AS start_s,
+         (p->>'end_s')::float8 AS end_s,
+         (p->>'lock_hold_s')::float8 AS hold_s
+    FROM h, jsonb_array_elements(h.report->'phases') p
+),
+logged AS (
+  SELECT (max(rows_applied + log_backlog) - min(rows_applied + log_backlog)) /
+         nullif(max(at) - min(at), 0) AS rate
+    FROM bench_progress
+),
+load AS (
+  SELECT run,
+         count(*)::float8 / CASE run WHEN 'baseline' THEN :baseline_secs
+                             ELSE :finished - :started END AS tps,
+         percentile_cont(0.5) WITHIN GROUP (ORDER BY latency_us) / 1000 AS p50_ms,
+         percentile_cont(0.99) WITHIN GROUP (ORDER BY latency_us) / 1000 AS p99_ms
+    FROM bench_latency
+   WHERE run = 'baseline'
+      OR epoch + epoch_us / 1000000.0 BETWEEN :started AND :finished
+   GROUP BY run
+),
+b AS (SELECT * FROM load WHERE run = 'baseline'),
+m AS (SELECT * FROM load WHERE run = 'migration')
+SELECT metric, coalesce(round(value::numeric, 3)::text, '-') AS value
+  FROM h, b, m, logged,
+       LATERAL (VALUES
+         ('table MB', h.size_before / 1048576.0),
+         ('migration s', :finished - :started),
+         ('copy MB/s', h.size_before / 1048576.0 / nullif(h.copy_s, 0)),
+         ('index builds s', h.index_s),
+         ('log arrival rows/s', logged.rate),
+         ('log apply rows/s', h.rows_applied / nullif(h.apply_s, 0)),
+         ('convergence s', (SELECT max(start_s) FROM ph WHERE phase = 'swap lock') -
+                           (SELECT end_s FROM ph WHERE phase = 'index builds')),
+         ('setup lock hold ms', 1000 * h.setup_hold_s),
+         ('swap lock hold ms', 1000 * h.swap_hold_s),
+         ('drop lock hold ms', 1000 * (SELECT hold_s FROM ph WHERE phase = 'drop lock')),
+         ('baseline TPS', b.tps),
+         ('migration TPS', m.tps),
+         ('TPS drop %', 100 * (1 - m.tps / nullif(b.tps, 0))),
+         ('baseline p50 ms', b.p50_ms),
+         ('migration p50 ms', m.p50_ms),
+         ('baseline p99 ms', b.p99_ms),
+         ('migration p99 ms', m.p99_ms)) AS x(metric, value);
@@ -0,0 +1,89 @@
+#!/bin/bash
+#
+# halo_migrate: bench/run_bench.sh
+#
+# Driver of `make benchcheck`, configured by the BENCH_* variables of the
+# Makefile. It measures a baseline of the pgbench load first, then runs
+# halo_migrate --execute on bench_t under the same load, sampling
+# migrate.progress, and reports with report.sql.
+#
+
+set -e
+
+OUT=${BENCH_OUT:-results}
+DB=${BENCH_DB:-halo_migrate_bench}
+IFS=, read -r UPDATE_PCT INSERT_PCT DELETE_PCT <<< "${BENCH_MIX:-60,20,20}"
+
+rm -rf "$OUT"
+mkdir -p "$OUT"
+
+psql_bench() {
+	"$PSQL" -X -q -v ON_ERROR_STOP=1 -d "$DB" "$@"
+}
+
+# Run the load for $2 seconds, logging every transaction under $1
+pgbench_load() {
+	"$PGBENCH" -n -f write.sql -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" \
+		${BENCH_RATE:+-R "$BENCH_RATE"} -T "$2" -l --log-prefix="$1" \
+		-D rows="$BENCH_ROWS" -D width="$BENCH_WIDTH" \
+		-D update_pct="$UPDATE_PCT" -D insert_pct="$INSERT_PCT" \
+		"$DB" >> "$OUT/pgbench.log" 2>&1
+}
+
+echo "setting up $BENCH_ROWS rows of $BENCH_WIDTH bytes with $BENCH_INDEXES indexes in $DB"
+"$PSQL" -X -q -d postgres -c "DROP DATABASE IF EXISTS $DB" -c "CREATE DATABASE $DB"
+psql_bench -c "CREATE EXTENSION halo_migrate"
+psql_bench -v rows="$BENCH_ROWS" -v width="$BENCH_WIDTH" -v indexes="$BENCH_INDEXES" -f setup.sql
+
+echo "baseline load for $BENCH_BASELINE_SECS s"
+pgbench_load "$OUT/baseline" "$BENCH_BASELINE_SECS"
+
+# The load runs in 5 s rounds until the migration is over, and
+# migrate.progress is sampled twice a second meanwhile.
+echo "migrating under load: $BENCH_ALTER"
+touch "$OUT/running"
+(
+	n=0
+	while [ -e "$OUT/running" ]; do
+		n=$((n + 1))
+		pgbench_load "$OUT/migration$n" 5 || true
+	done
+) &
+load=$!
+(
+	while [ -e "$OUT/running" ]; do
+		psql_bench -At -c "COPY (SELECT extract(epoch FROM clock_timestamp()), phase, rows_applied, log_backlog FROM migrate.progress) TO STDOUT" \
+			>> "$OUT/progress.txt" || true
+		sleep 0.5
+	done
+) &
+sampler=$!
+sleep 2
+
+started=$(date +%s.%N)
+status=0
+"$HALO_MIGRATE" --dbname="$DB" --table=bench_t --alter="$BENCH_ALTER" --execute \
+	--report="$OUT/report.json" $BENCH_OPTS > "$OUT/halo_migrate.log" 2>&1 || status=$?
+finished=$(date +%s.%N)
+rm -f "$OUT/running"
+wait $load $sampler || true
+
+if [ $status -ne 0 ]; then
+	cat "$OUT/halo_migrate.log"
+	echo "halo_migrate failed with status $status" >&2
+	exit 1
+fi
+
+touch "$OUT/progress.txt"
+psql_bench -c "COPY bench_progress FROM STDIN" < "$OUT/progress.txt"
+for f in "$OUT"/baseline.* "$OUT"/migration*.*; do
+	case $f in
+		*/baseline.*) run=baseline ;;
+		*) run=migration ;;
+	esac
+	# with --rate, pgbench adds the schedule lag as a 7th column
+	cut -d' ' -f1-6 "$f" | sed "s/^/$run /"
+done | psql_bench -c "COPY bench_latency FROM STDIN (DELIMITER ' ')"
+
+psql_bench -v started="$started" -v finished="$finished" \
+	-v baseline_secs="$BENCH_BASELINE_SECS" -f report.sql | tee "$OUT/summary.txt"
@@ -0,0 +1,28 @@
+--
+-- Synthetic table of :rows rows, with a :width bytes wide padding column
+-- and :indexes secondary indexes on integer columns of random values.
+--
+DROP TABLE IF EXISTS bench_t;
+
+SELECT format('CREATE TABLE bench_t (id bigserial PRIMARY KEY, n integer NOT NULL, pad text NOT NULL%s)',
+              string_agg(format(', k%s integer NOT NULL DEFAULT (random() * %s)::integer', i, :rows),
+                         '' ORDER BY i))
+  FROM generate_series(1, :indexes) i
+\gexec
+
+INSERT INTO bench_t (n, pad)
+  SELECT g, left(repeat(md5(g::text), (:width + 31) / 32), :width)
+    FROM generate_series(1, :rows) g;
+
+SELECT format('CREATE INDEX ON bench_t (k%s)', i)
+  FROM generate_series(1, :indexes) i
+\gexec
+
+VACUUM ANALYZE bench_t;
+
+-- Samples of migrate.progress and the pgbench transaction logs, loaded by
+-- run_bench.sh for report.sql
+DROP TABLE IF EXISTS bench_progress, bench_latency;
+CREATE TABLE bench_progress (at double precision, phase text, rows_applied bigint, log_backlog bigint);
+CREATE TABLE bench_latency (run text, client integer, tx bigint, latency_us bigint,
+                            script integer, epoch bigint, epoch_us bigint);
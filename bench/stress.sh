@@ -0,0 +1,81 @@
+#!/bin/bash
+#
+# halo_migrate: bench/stress.sh
+#
+# Driver of `make stresscheck`, configured by the BENCH_* and STRESS_*
+# variables of the Makefile. It keeps a reference copy of bench_t,
+# bench_ref, which the load changes in the same transactions as bench_t,
+# migrates bench_t STRESS_RUNS times under that load and long
+# transactions, and after each run compares the two tables row by row.
+#
+
+set -e
+
+OUT=${BENCH_OUT:-results}/stress
+DB=${BENCH_DB:-halo_migrate_bench}
+IFS=, read -r UPDATE_PCT INSERT_PCT DELETE_PCT <<< "${STRESS_MIX:-40,20,20}"
+
+rm -rf "$OUT"
+mkdir -p "$OUT"
+
+psql_bench() {
+	"$PSQL" -X -q -v ON_ERROR_STOP=1 -d "$DB" "$@"
+}
+
+echo "setting up $BENCH_ROWS rows of $BENCH_WIDTH bytes with $BENCH_INDEXES indexes in $DB"
+"$PSQL" -X -q -d postgres -c "DROP DATABASE IF EXISTS $DB" -c "CREATE DATABASE $DB"
+psql_bench -c "CREATE EXTENSION halo_migrate"
+psql_bench -v rows="$BENCH_ROWS" -v width="$BENCH_WIDTH" -v indexes="$BENCH_INDEXES" -f setup.sql
+psql_bench -c "CREATE TABLE bench_ref AS SELECT id, n, pad FROM bench_t" \
+	-c "ALTER TABLE bench_ref ADD PRIMARY KEY (id)" \
+	-c "CREATE SEQUENCE bench_stress_id" \
+	-c "SELECT setval('bench_stress_id', max(id)) FROM bench_t"
+
+run=0
+while [ $run -lt "${STRESS_RUNS:-3}" ]; do
+	run=$((run + 1))
+	# Go back and forth between the two types, so that every run copies
+	if [ $((run % 2)) -eq 1 ]; then
+		alter="ALTER COLUMN n TYPE bigint"
+	else
+		alter="ALTER COLUMN n TYPE integer"
+	fi
+	echo "run $run under load: $alter"
+
+	touch "$OUT/running"
+	(
+		while [ -e "$OUT/running" ]; do
+			"$PGBENCH" -n -f stress.sql -c "$BENCH_CLIENTS" -j "$BENCH_CLIENTS" -T 5 \
+				-D rows="$BENCH_ROWS" -D width="$BENCH_WIDTH" \
+				-D update_pct="$UPDATE_PCT" -D insert_pct="$INSERT_PCT" \
+				-D delete_pct="$DELETE_PCT" \
+				"$DB" >> "$OUT/pgbench.log" 2>&1 || true
+		done
+	) &
+	load=$!
+	(
+		while [ -e "$OUT/running" ]; do
+			"$PGBENCH" -n -f stress_old.sql -c 1 -T 5 \
+				-D rows="$BENCH_ROWS" -D hold_ms="${STRESS_HOLD_MS:-2000}" \
+				"$DB" >> "$OUT/pgbench_old.log" 2>&1 || true
+		done
+	) &
+	old=$!
+	sleep 2
+
+	status=0
+	"$HALO_MIGRATE" --dbname="$DB" --table=bench_t --alter="$alter" --execute \
+		$BENCH_OPTS > "$OUT/halo_migrate$run.log" 2>&1 || status=$?
+	rm -f "$OUT/running"
+	wait $load $old || true
+
+	if [ $status -ne 0 ]; then
+		cat "$OUT/halo_migrate$run.log"
+		echo "halo_migrate failed with status $status in run $run" >&2
+		exit 1
+	fi
+	if ! psql_bench -f stress_check.sql; then
+		echo "run $run lost or corrupted rows" >&2
+		exit 1
+	fi
+done
@@ -0,0 +1,25 @@
+--
+-- Write load of the stress check: each transaction applies one change,
+-- :update_pct % updates, :insert_pct % inserts, :delete_pct % deletes and
+-- the rest primary key changes, to the same row of bench_t and of its
+-- reference copy bench_ref. Both are locked in the same order, so that
+-- the clients cannot deadlock.
+--
+\set id random(1, :rows)
+\set op random(1, 100)
+SELECT nextval('bench_stress_id') AS newid \gset
+BEGIN;
+\if :op <= :update_pct
+UPDATE bench_t SET n = n + 1, pad = md5(pad) WHERE id = :id;
+UPDATE bench_ref SET n = n + 1, pad = md5(pad) WHERE id = :id;
+\elif :op <= :update_pct + :insert_pct
+INSERT INTO bench_t (id, n, pad) VALUES (:newid, :id, repeat('i', :width));
+INSERT INTO bench_ref (id, n, pad) VALUES (:newid, :id, repeat('i', :width));
+\elif :op <= :update_pct + :insert_pct + :delete_pct
+DELETE FROM bench_t WHERE id = :id;
+DELETE FROM bench_ref WHERE id = :id;
+\else
+UPDATE bench_t SET id = :newid WHERE id = :id;
+UPDATE bench_ref SET id = :newid WHERE id = :id;
+\endif
+COMMIT;
@@ -0,0 +1,24 @@
+--
+-- Compare bench_t with bench_ref once the load is over; any row missing
+-- from one side or differing fails the check.
+--
+DO $$
+DECLARE
+    missing bigint;
+    extra bigint;
+BEGIN
+    SELECT count(*) INTO missing FROM (
+        SELECT id, n::bigint, pad FROM bench_ref
+        EXCEPT ALL
+        SELECT id, n::bigint, pad FROM bench_t) d;
+    SELECT count(*) INTO extra FROM (
+        SELECT id, n::bigint, pad FROM bench_t
+        EXCEPT ALL
+        SELECT id, n::bigint, pad FROM bench_ref) d;
+    IF missing + extra > 0 THEN
+        RAISE EXCEPTION 'bench_t does not match bench_ref: % rows missing, % rows extra',
+            missing, extra;
+    END IF;
+    RAISE NOTICE 'bench_t matches bench_ref: % rows', (SELECT count(*) FROM bench_t);
+END
+$$;
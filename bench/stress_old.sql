@@ -0,0 +1,12 @@
+--
+-- Long transactions of the stress check: a change held uncommitted for
+-- :hold_ms milliseconds, so that the migration has old transactions to
+-- wait for and changes that commit after its copy and between its log
+-- batches.
+--
+\set id random(1, :rows)
+BEGIN;
+UPDATE bench_t SET n = n - 1 WHERE id = :id;
+UPDATE bench_ref SET n = n - 1 WHERE id = :id;
+\sleep :hold_ms ms
+COMMIT;
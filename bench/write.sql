@@ -0,0 +1,13 @@
+--
+-- Foreground load of the benchmark: :update_pct % updates, :insert_pct %
+-- inserts and the rest deletes of random rows of bench_t.
+--
+\set id random(1, :rows)
+\set op random(1, 100)
+\if :op <= :update_pct
+UPDATE bench_t SET n = n + 1 WHERE id = :id;
+\elif :op <= :update_pct + :insert_pct
+INSERT INTO bench_t (n, pad) VALUES (:id, repeat('x', :width));
+\else
+DELETE FROM bench_t WHERE id = :id;
+\endif
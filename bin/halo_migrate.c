@@ -26,10 +26,13 @@ const char *PROGRAM_VERSION = "unknown";
 #include "pgut/pgut-fe.h"
 
 #include <errno.h>
+#include <limits.h>
 #include <string.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <time.h>
+#include <pthread.h>
+#include <signal.h>
 
 
 #ifdef HAVE_POLL_H
@@ -67,106 +70,153 @@ const char *PROGRAM_VERSION = "unknown";
 /* poll() or select() timeout, in seconds */
 #define POLL_TIMEOUT    3
 
+/* Relative cost of the heap scan every index build performs, per byte of
+ * heap, compared to sorting and writing one byte of btree index.
+ */
+#define HEAP_SCAN_COST	0.25
+
+/* The smallest maintenance_work_mem the server accepts, in kB */
+#define MIN_MAINTENANCE_WORK_MEM	1024
+
+/* Btree builds smaller than this do not get parallel workers; each further
+ * worker needs three times as much index.
+ */
+#define PARALLEL_INDEX_MIN_SIZE		(INT64CONST(64) * 1024 * 1024)
+
+/* Throughput the dry run estimate assumes unless --estimate-sample
+ * calibrates it, in MB/s of table and of index respectively.
+ */
+#define ESTIMATE_COPY_MBPS		100.0
+#define ESTIMATE_INDEX_MBPS		50.0
+
+/* Bytes a log row takes besides the copy of the row: id, key, tuple header */
+#define LOG_ROW_OVERHEAD		64
+
+/* Shortest interval over which the dry run samples the write rate */
+#define ESTIMATE_RATE_USEC		INT64CONST(1000000)
+
+/* Sizes, live ratio and row changes of a table, for the dry run estimate */
+#define SQL_ESTIMATE \
+	"SELECT CASE WHEN c.reltuples < 0 THEN coalesce(s.n_live_tup, 0)" \
+	"            ELSE c.reltuples::bigint END," \
+	"       pg_relation_size(c.oid)," \
+	"       coalesce(pg_total_relation_size(nullif(c.reltoastrelid, 0)), 0)," \
+	"       coalesce(s.n_live_tup, 0), coalesce(s.n_dead_tup, 0)," \
+	"       coalesce(s.n_tup_ins + s.n_tup_upd + s.n_tup_del, 0)" \
+	"  FROM pg_class c LEFT JOIN pg_stat_user_tables s ON s.relid = c.oid" \
+	" WHERE c.oid = $1"
+
+/* Shortest interval between two reports of a table in the same phase */
+#define PROGRESS_INTERVAL_USEC	INT64CONST(1000000)
+
+/* Publish the state of a table in flight, see the migrate.progress view */
+#define SQL_REPORT_PROGRESS \
+	"INSERT INTO migrate.progress_state VALUES ($1, $2, $3," \
+	"  now() - $4::float8 * interval '1 microsecond'," \
+	"  now() - $5::float8 * interval '1 microsecond', $6, $7, $8, $9, $10, $11," \
+	"  $12::float8 * interval '1 microsecond', now())" \
+	" ON CONFLICT (relid) DO UPDATE SET" \
+	"  (pid, phase, started, phase_started, copy_path, rows_copied, indexes_done," \
+	"   indexes_total, rows_applied, apply_rate, lock_wait, updated) =" \
+	"  (excluded.pid, excluded.phase, excluded.started, excluded.phase_started," \
+	"   excluded.copy_path, excluded.rows_copied, excluded.indexes_done," \
+	"   excluded.indexes_total, excluded.rows_applied, excluded.apply_rate," \
+	"   excluded.lock_wait, excluded.updated)"
+
 /* Compile an array of existing transactions which are active during
- * halo_migrate's setup. Some transactions we can safely ignore:
- *  a. The '1/1, -1/0' lock skipped is from the bgwriter on newly promoted
- *     servers. See https://github.com/reorg/pg_reorg/issues/1
- *  b. Our own database connections
- *  c. Other halo_migrate clients, as distinguished by application_name, which
+ * halo_migrate's setup. migrate.vxid_snapshot() reads the proc array rather
+ * than pg_locks, and already skips VACUUM processes, our own backend and
+ * transactions in other databases. The backends listed here are skipped too,
+ * by PID, whatever transaction they are in by then:
+ *  a. Our other connections and the index workers, see own_backend_pids()
+ *  b. Other halo_migrate clients, as distinguished by application_name, which
  *     may be operating on other tables at the same time. See
  *     https://github.com/reorg/pg_repack/issues/1
- *  d. open transactions/locks existing on other databases than the actual
- *     processing relation (except for locks on shared objects)
- *  e. VACUUMs which are always executed outside transaction blocks.
+ *  c. VACUUMs which are always executed outside transaction blocks.
  *
- * Note, there is some redundancy in how the filtering is done (e.g. excluding
- * based on pg_backend_pid() and application_name), but that shouldn't hurt
- * anything. Also, the test of application_name is not bulletproof -- for
- * instance, the application name when running installcheck will be
- * pg_regress.
- */
-#define SQL_XID_SNAPSHOT_90200 \
-	"SELECT coalesce(array_agg(l.virtualtransaction), '{}') " \
-	"  FROM pg_locks AS l " \
-	"  LEFT JOIN pg_stat_activity AS a " \
-	"    ON l.pid = a.pid " \
-	"  LEFT JOIN pg_database AS d " \
-	"    ON a.datid = d.oid " \
-	"  WHERE l.locktype = 'virtualxid' " \
-	"  AND l.pid NOT IN (pg_backend_pid(), $1) " \
-	"  AND (l.virtualxid, l.virtualtransaction) <> ('1/1', '-1/0') " \
-	"  AND (a.application_name IS NULL OR a.application_name <> $2)" \
-	"  AND a.query !~* E'^\\\\s*vacuum\\\\s+' " \
-	"  AND a.query !~ E'^autovacuum: ' " \
-	"  AND ((d.datname IS NULL OR d.datname = current_database()) OR l.database = 0)"
-
-#define SQL_XID_SNAPSHOT_90000 \
-	"SELECT coalesce(array_agg(l.virtualtransaction), '{}') " \
-	"  FROM pg_locks AS l " \
-	"  LEFT JOIN pg_stat_activity AS a " \
-	"    ON l.pid = a.procpid " \
-	"  LEFT JOIN pg_database AS d " \
-	"    ON a.datid = d.oid " \
-	"  WHERE l.locktype = 'virtualxid' " \
-	"  AND l.pid NOT IN (pg_backend_pid(), $1) " \
-	"  AND (l.virtualxid, l.virtualtransaction) <> ('1/1', '-1/0') " \
-	"  AND (a.application_name IS NULL OR a.application_name <> $2)" \
-	"  AND a.current_query !~* E'^\\\\s*vacuum\\\\s+' " \
-	"  AND a.current_query !~ E'^autovacuum: ' " \
-	"  AND ((d.datname IS NULL OR d.datname = current_database()) OR l.database = 0)"
-
-/* application_name is not available before 9.0. The last clause of
- * the WHERE clause is just to eat the $2 parameter (application name).
- */
-#define SQL_XID_SNAPSHOT_80300 \
-	"SELECT coalesce(array_agg(l.virtualtransaction), '{}') " \
-	"  FROM pg_locks AS l" \
-	"  LEFT JOIN pg_stat_activity AS a " \
-	"    ON l.pid = a.procpid " \
-	"  LEFT JOIN pg_database AS d " \
-	"    ON a.datid = d.oid " \
-	" WHERE l.locktype = 'virtualxid' AND l.pid NOT IN (pg_backend_pid(), $1)" \
-	" AND (l.virtualxid, l.virtualtransaction) <> ('1/1', '-1/0') " \
-	" AND a.current_query !~* E'^\\\\s*vacuum\\\\s+' " \
-	" AND a.current_query !~ E'^autovacuum: ' " \
-	" AND ((d.datname IS NULL OR d.datname = current_database()) OR l.database = 0)" \
-	" AND ($2::text IS NOT NULL)"
-
+ * The test of application_name is not bulletproof -- for instance, the
+ * application name when running installcheck will be pg_regress.
+ */
 #define SQL_XID_SNAPSHOT \
-	(PQserverVersion(connection) >= 90200 ? SQL_XID_SNAPSHOT_90200 : \
-	 (PQserverVersion(connection) >= 90000 ? SQL_XID_SNAPSHOT_90000 : \
-	  SQL_XID_SNAPSHOT_80300))
-
-
-/* Later, check whether any of the transactions we saw before are still
- * alive, and wait for them to go away.
+	"SELECT migrate.vxid_snapshot($1::integer[] || array_agg(pid))" \
+	"  FROM pg_stat_activity" \
+	" WHERE application_name = $2" \
+	"    OR query ~* E'^\\\\s*vacuum\\\\s+'"
+
+/* Later, wait up to $2 milliseconds for the transactions we saw before to
+ * go away, and report the PIDs of those still alive. The wait sleeps on
+ * their virtual transaction locks, so it ends as soon as the last one does.
  */
 #define SQL_XID_ALIVE \
-	"SELECT pid FROM pg_locks WHERE locktype = 'virtualxid'"\
-	" AND pid <> pg_backend_pid() AND virtualtransaction = ANY($1)"
+	"SELECT coalesce(array_length(p, 1), 0), p[1]" \
+	"  FROM migrate.wait_vxids($1, $2) AS p"
+
+/* A column on which migrate.table_%u and the partitioned parent %u differ */
+#define SQL_PARTITION_MISMATCH \
+	"SELECT coalesce(n.attname, o.attname) FROM" \
+	" (SELECT * FROM pg_attribute WHERE attrelid = 'migrate.table_%u'::regclass" \
+	"    AND attnum > 0 AND NOT attisdropped) n" \
+	" FULL JOIN" \
+	" (SELECT * FROM pg_attribute WHERE attrelid = %u" \
+	"    AND attnum > 0 AND NOT attisdropped) o" \
+	" ON n.attname = o.attname" \
+	" WHERE (n.atttypid, n.atttypmod, n.attcollation) IS DISTINCT FROM" \
+	"       (o.atttypid, o.atttypmod, o.attcollation)" \
+	" LIMIT 1"
 
 /* To be run while our main connection holds an AccessExclusive lock on the
  * target table, and our secondary conn is attempting to grab an AccessShare
  * lock. We know that "granted" must be false for these queries because
  * we already hold the AccessExclusive lock. Also, we only care about other
  * transactions trying to grab an ACCESS EXCLUSIVE lock, because we are only
- * trying to kill off disallowed DDL commands, e.g. ALTER TABLE or TRUNCATE.
+ * trying to kill off disallowed DDL commands, e.g. ALTER TABLE or TRUNCATE,
+ * and only those which pg_blocking_pids() shows queued behind one of our
+ * own backends (the second %s, an array literal of their PIDs).
  */
+#define COMPETING_LOCKS_WHERE \
+	" FROM pg_locks WHERE locktype = 'relation'" \
+	" AND granted = false AND relation = %u" \
+	" AND mode = 'AccessExclusiveLock' AND pid <> pg_backend_pid()" \
+	" AND pg_blocking_pids(pid) && '%s'::integer[]"
+
 #define CANCEL_COMPETING_LOCKS \
-	"SELECT pg_cancel_backend(pid) FROM pg_locks WHERE locktype = 'relation'"\
-	" AND granted = false AND relation = %u"\
-	" AND mode = 'AccessExclusiveLock' AND pid <> pg_backend_pid()"
+	"SELECT pg_cancel_backend(pid)" COMPETING_LOCKS_WHERE
 
 #define KILL_COMPETING_LOCKS \
-	"SELECT pg_terminate_backend(pid) "\
-	"FROM pg_locks WHERE locktype = 'relation'"\
-	" AND granted = false AND relation = %u"\
-	" AND mode = 'AccessExclusiveLock' AND pid <> pg_backend_pid()"
+	"SELECT pg_terminate_backend(pid)" COMPETING_LOCKS_WHERE
 
 #define COUNT_COMPETING_LOCKS \
-	"SELECT pid FROM pg_locks WHERE locktype = 'relation'" \
-	" AND granted = false AND relation = %u" \
-	" AND mode = 'AccessExclusiveLock' AND pid <> pg_backend_pid()"
+	"SELECT pid" COMPETING_LOCKS_WHERE
+
+/* The session blocking backend $1 whose cancellation costs least: sessions
+ * idle in transaction first, since they are doing no work at all, then the
+ * youngest transactions, which have the least work to lose. Our own
+ * backends ($2, an array of PIDs), such as those of a sibling partition in
+ * flight, are never picked.
+ */
+#define SQL_LOCK_BLOCKERS \
+	"SELECT a.pid, coalesce(a.state, 'unknown')," \
+	" coalesce(date_trunc('second', now() - a.xact_start)::text, 'none')" \
+	" FROM unnest(pg_blocking_pids($1)) AS b(pid)" \
+	" JOIN pg_stat_activity a ON a.pid = b.pid" \
+	" WHERE a.pid <> pg_backend_pid() AND a.pid <> ALL ($2::integer[])" \
+	" ORDER BY a.state LIKE 'idle in transaction%' DESC," \
+	" a.xact_start DESC NULLS LAST LIMIT 1"
+
+/* Catalog state of the valid indexes of table $1; changes with any DDL on them */
+#define SQL_INDEX_OIDS \
+	"SELECT coalesce(string_agg(i.indexrelid || ':' || i.xmin || ':' || c.xmin," \
+	"                           ',' ORDER BY i.indexrelid), '')" \
+	"  FROM pg_index i JOIN pg_class c ON c.oid = i.indexrelid" \
+	" WHERE i.indrelid = $1 AND i.indisvalid"
+
+/* Times we roll back a lock window which overran --lock-budget and retry */
+#define LOCK_BUDGET_ATTEMPTS	5
+
+/* Longest an ALTER applied in place may run under its lock, unless
+ * --lock-budget sets the limit; a longer one is scanning the table.
+ */
+#define ALTER_IN_PLACE_TIMEOUT_MS	1000
 
 /* Will be used as a unique prefix for advisory locks. */
 #define MIGRATE_LOCK_PREFIX_STR "16185446"
@@ -178,6 +228,19 @@ typedef enum
 	FINISHED
 } index_status_t;
 
+/*
+ * Where a table is in the pipeline, see migrate_tables()
+ */
+typedef enum
+{
+	TABLE_PENDING,		/* not started yet */
+	TABLE_COPYING,		/* initial copy running on its connection */
+	TABLE_INDEXING,		/* index builds queued or running */
+	TABLE_APPLYING,		/* replaying the log until old transactions end */
+	TABLE_FAILED,		/* to be cleaned up */
+	TABLE_DONE			/* swapped, skipped or cleaned up */
+} table_phase_t;
+
 /*
  * per-index information
  */
@@ -186,10 +249,61 @@ typedef struct migrate_index
 	Oid				target_oid;		/* target: OID */
 	const char	   *create_index;	/* CREATE INDEX */
 	const char	   *hash;	/* CREATE INDEX */
+	const char	   *amname;			/* access method of the original index */
+	int64			size;			/* pg_relation_size of the original index */
+	double			cost;			/* estimated build cost, for scheduling */
 	index_status_t  status; 		/* Track parallel build statuses. */
 	int             worker_idx;		/* which worker conn is handling */
+	PGconn		   *conn;			/* connection building the index */
+	int64			start_usec;		/* build start, monotonic clock */
+	int64			duration_usec;	/* build duration once FINISHED */
+	int				mem_kb;			/* maintenance_work_mem granted, or 0 */
+	int				parallel_workers;	/* max_parallel_maintenance_workers granted */
 } migrate_index;
 
+/*
+ * Server-wide counters sampled at the boundaries of the phases in the
+ * --report timeline. pg_stat_io exists from PostgreSQL 16 on.
+ */
+typedef struct server_sample
+{
+	bool			valid;			/* sampled without error */
+	bool			has_io;			/* the io_* counters are set */
+	int64			wal_lsn;		/* pg_current_wal_lsn() in bytes */
+	int64			wal_records;
+	int64			wal_fpi;
+	int64			wal_bytes;
+	int64			wal_buffers_full;
+	int64			io_reads;		/* sums over pg_stat_io */
+	int64			io_writes;
+	int64			io_extends;
+	int64			io_hits;
+} server_sample;
+
+/*
+ * One phase of the migration of a table in the --report timeline. Phases
+ * which repeat, such as the catch-up rounds or the attempts at a lock,
+ * accumulate in a single entry.
+ */
+typedef struct timeline_phase
+{
+	char		   *name;			/* "copy", "swap lock", ... */
+	bool			aggregate;		/* later rounds add to this entry */
+	bool			open;			/* begun and not ended yet */
+	int				iterations;		/* rounds begun */
+	int64			start_usec;		/* when the first round began */
+	int64			end_usec;		/* when the last round ended */
+	int64			round_usec;		/* when the current round began */
+	int64			active_usec;	/* sum of the rounds */
+	int64			rows;			/* rows processed, or -1 */
+	int64			bytes;			/* bytes processed, or -1 */
+	int64			wait_begin;		/* lock_wait_usec of the table at begin */
+	int64			wait_usec;		/* time spent waiting for locks */
+	int64			hold_usec;		/* time the AccessExclusive lock was held */
+	server_sample	begin;			/* counters when the current round began */
+	server_sample	delta;			/* counter deltas over all rounds */
+} timeline_phase;
+
 /*
  * per-table information
  */
@@ -219,8 +333,68 @@ typedef struct migrate_table
 	const char	   *sql_pop;		/* SQL used in flush */
 	int             n_indexes;      /* number of indexes */
 	migrate_index   *indexes;        /* info on each index */
+
+	/* state while the table is in flight */
+	table_phase_t	phase;
+	int				slot;			/* connection pair in use */
+	PGconn		   *conn;			/* primary connection of this table */
+	PGconn		   *conn2;			/* secondary connection, holds AccessShare */
+	char		   *schema;			/* schema part of target_name */
+	char		   *table_without_namespace;	/* the rest of target_name */
+	char		   *vxid;			/* transactions older than the copy */
+	unsigned int	temp_obj_num;	/* temporary objects counter */
+	bool			table_init;		/* trigger and log table installed */
+	PGresult	   *indexres;		/* backs the strings in indexes */
+	int				next_index;		/* next index to build */
+	int				running_indexes;	/* index builds in progress */
+	int				max_running_indexes;	/* most builds at a time */
+	int64			index_start_usec;	/* when the index builds began */
+	int64			next_apply_usec;	/* when to check old transactions again */
+	int				swap_hold;		/* why the swap is held back, see swap_allowed() */
+	int64			load_changes;	/* row changes at the last load sample */
+	int64			load_usec;		/* when the last load sample was taken */
+	char		   *index_oids;		/* catalog state of the fetched indexes */
+	int				dependent_views;	/* views on the table, with --keep-oid */
+	int64			relsize;		/* heap and toast size, in bytes */
+	int64			index_size;		/* size of the indexes fetched, in bytes */
+	int64			changes;		/* row changes since the last analyze */
+	Oid				part_parent;	/* parent, if the table is a partition */
+	const char	   *part_check;		/* the partition constraint */
+	const char	   *copy_sample;	/* copy_data limited to --estimate-sample rows */
+	const char	   *create_table_def;	/* CREATE TABLE with defaults and NOT NULLs, up to TABLESPACE */
+	const char	   *alter_col_options;	/* ALTER TABLE ALTER COLUMN SET (options) */
+
+	/* published in migrate.progress, see report_progress() */
+	const char	   *reported_phase;	/* phase last reported, or NULL */
+	int64			start_usec;		/* when the migration of the table began */
+	int64			phase_usec;		/* when the reported phase began */
+	int64			reported_usec;	/* when the table was last reported */
+	char		   *copy_path;		/* file of migrate.table_<oid>, while copied */
+	int64			rows_copied;	/* rows the copy inserted, or -1 */
+	int64			rows_applied;	/* log rows applied by the catch-up */
+	int64			apply_usec;		/* time spent applying them */
+	int64			lock_wait_usec;	/* time spent waiting for table locks */
+	int64			listed_changes;	/* n_tup_ins + n_tup_upd + n_tup_del when listed */
+
+	/* recorded in migrate.history and --report, see timeline_begin() */
+	time_t			start_time;		/* wall clock time of start_usec */
+	timeline_phase *timeline;
+	int				n_timeline;
+	int				max_timeline;
 } migrate_table;
 
+/*
+ * Timing of one window during which we hold an AccessExclusive lock on the
+ * target table, broken down per statement.
+ */
+typedef struct lock_window
+{
+	const char	   *what;			/* "setup", "swap" or "drop" */
+	int64			start_usec;		/* when the lock was granted */
+	int64			step_usec;		/* when the last step ended */
+	char			steps[512];		/* "step 1.234 ms, ..." */
+} lock_window;
+
 /*
  * per-table information
  */
@@ -256,30 +430,80 @@ static char *skip_until(const char *original_sql, char *sql, char end);
 
 static bool is_superuser(void);
 static void check_tablespace(void);
+static void check_swap_window(void);
+static void check_alter_statements(void);
 static bool preliminary_checks(char *errbuf, size_t errsize);
 static bool is_requested_relation_exists(char *errbuf, size_t errsize);
 static void repack_all_databases(const char *order_by);
 static bool repack_one_database(const char *order_by, char *errbuf, size_t errsize);
-static void migrate_one_table(migrate_table *table, const char *order_by, char *errbuf, size_t errsize);
+static void migrate_tables(migrate_table *tables, int num_tables, const char *order_by, char *errbuf, size_t errsize);
+static bool migrate_table_start(migrate_table *table, const char *order_by);
+static bool migrate_table_copied(migrate_table *table);
+static bool migrate_table_catch_up(migrate_table *table, int wait_ms);
+static bool swap_allowed(migrate_table *table);
+static bool migrate_table_swap(migrate_table *table, char *errbuf, size_t errsize);
+static void migrate_table_finish(migrate_table *table, bool success);
+static void report_progress(migrate_table *table, const char *phase);
+static void check_report(void);
+static void sample_server(server_sample *sample);
+static timeline_phase *timeline_new(migrate_table *table, const char *name);
+static void timeline_begin(migrate_table *table, const char *name, bool aggregate);
+static void timeline_end(migrate_table *table, const char *name, int64 rows, int64 bytes);
+static void timeline_add(migrate_table *table, const char *name, int64 start_usec, int64 end_usec, int64 bytes);
+static void append_json_string(StringInfo buf, const char *str);
+static void append_phase_json(StringInfo buf, const migrate_table *table, const timeline_phase *phase);
+static timeline_phase *timeline_find(migrate_table *table, const char *name, bool open);
+static void append_table_json(StringInfo buf, migrate_table *table, bool success);
+static void record_history(migrate_table *table, bool success, const char *report);
+static void wait_profile_start(void);
+static void wait_profile_set(PGconn *conn, const char *phase, bool count_idle);
+static void wait_profile_stop(void);
+static void wait_profile_finish(bool fatal, void *userdata);
 static bool repack_table_indexes(PGresult *index_details);
 static bool repack_all_indexes(char *errbuf, size_t errsize);
-static void migrate_cleanup(bool fatal, const migrate_table *table);
+static void migrate_cleanup(bool fatal, migrate_table *table);
 static void migrate_cleanup_callback(bool fatal, void *userdata);
-static bool rebuild_indexes(const migrate_table *table);
+static bool start_index_builds(migrate_table *tables, int num_tables, bool *worker_busy);
+static bool collect_index_builds(migrate_table *table, bool *worker_busy);
+static void abort_index_builds(migrate_table *table, bool *worker_busy);
+static void index_builds_done(migrate_table *table);
+static void wait_for_tables(migrate_table *tables, int num_tables, int64 wake_usec);
+static double index_build_cost(const char *amname, int64 size, int64 heap_size);
+static int index_cost_cmp(const void *a, const void *b);
+static int table_size_cmp(const void *a, const void *b);
+static void fetch_indexes(migrate_table *table, const char **indexparams);
+static void estimate_table(migrate_table *table, const char *create_table);
+static void lock_window_begin(lock_window *lw, const char *what);
+static void lock_window_step(lock_window *lw, const char *step);
+static void lock_window_add(lock_window *lw, const char *step, double elapsed_ms);
+static bool lock_window_over(const lock_window *lw);
+static void lock_window_end(lock_window *lw, migrate_table *table, bool committed);
+static bool under_regress(void);
+static bool assign_index_job(migrate_index *index_jobs, int job, PGconn *conn, int worker);
+static void budget_index_jobs(migrate_index *index_jobs, int first, int count);
+static void release_index_job(migrate_index *job);
+static void index_job_settings(StringInfo sql, const migrate_index *job);
 
 static char *getstr(PGresult *res, int row, int col);
+static char *own_backend_pids(void);
 static Oid getoid(PGresult *res, int row, int col);
 static bool advisory_lock(PGconn *conn, const char *relid);
-static bool lock_exclusive(PGconn *conn, const char *relid, const char *lock_query, bool start_xact);
-static bool kill_ddl(PGconn *conn, Oid relid, bool terminate);
-static bool lock_access_share(PGconn *conn, Oid relid, const char *target_name);
+static bool lock_exclusive(PGconn *conn, PGconn *observer, const char *relid, bool start_xact);
+static int lock_cancel_blockers(PGconn *conn, PGconn *observer, const char *relid, int wait_msec, bool terminate);
+static PGresult *try_lock_table(PGconn *conn, Oid relid, const char *lockmode, int budget_ms);
+static bool kill_ddl(PGconn *conn, PGconn *partner, Oid relid, bool terminate);
+static bool lock_access_share(PGconn *conn, PGconn *partner, Oid relid, const char *target_name);
 static bool apply_alter_statement(PGconn *conn, Oid relid, const char *alter_sql);
+static bool alter_may_scan(const char *actions);
+static int alter_in_place(migrate_table *table);
 static int strpos(const char *hay, const char *needle);
 static void parse_indexdef(IndexDef *stmt, char *sql, const char *idxname, const char *tblname);
 
 #define SQLSTATE_INVALID_SCHEMA_NAME	"3F000"
 #define SQLSTATE_UNDEFINED_FUNCTION		"42883"
 #define SQLSTATE_QUERY_CANCELED			"57014"
+#define SQLSTATE_LOCK_NOT_AVAILABLE		"55P03"
+#define SQLSTATE_OBJECT_NOT_IN_PREREQUISITE_STATE	"55000"
 
 static bool sqlstate_equals(PGresult *res, const char *state)
 {
@@ -289,6 +513,7 @@ static bool sqlstate_equals(PGresult *res, const char *state)
 static bool				analyze = true;
 static SimpleStringList	parent_table_list = {NULL, NULL};
 static SimpleStringList	alter_list = {NULL, NULL};
+static char			   *alter_actions = NULL;	/* all --alter clauses, comma separated */
 static SimpleStringList	table_list = {NULL, NULL};
 static SimpleStringList	schema_list = {NULL, NULL};
 static char				*orderby = NULL;
@@ -297,11 +522,68 @@ static SimpleStringList	r_index = {NULL, NULL};
 static int				wait_timeout = 60;	/* in seconds */
 static int				jobs = 0;	/* number of concurrent worker conns. */
 static bool				execute_allowed = false;
-static unsigned int		temp_obj_num = 0; /* temporary objects counter */
 static bool				no_kill_backend = false; /* abandon when timed-out */
 static bool				no_superuser_check = false;
+static int				index_memory = 0;	/* total maintenance_work_mem for index builds, in MB */
+static int				index_parallel_workers = -1;	/* total max_parallel_maintenance_workers */
+static int				tables_in_flight = 1;	/* tables being migrated at a time */
+static char			   *swap_window = NULL;	/* HH:MM-HH:MM when swaps may happen */
+static int				swap_window_start;	/* minutes after midnight */
+static int				swap_window_end;
+static int				swap_max_sessions = -1;	/* sessions on the table allowed at swap */
+static int				swap_max_tps = -1;	/* row changes per second allowed at swap */
+static int				lock_budget = 0;	/* longest AccessExclusive window, in ms */
+static bool				keep_oid = false;	/* swap storage instead of renaming */
+static int				max_connections = 0;	/* server connections of all tables */
+static int				max_copies = 0;	/* table copies running at a time */
+static int				copy_rate = 0;	/* MB/s at which copy starts are spaced by table size */
+static int				estimate_sample = 0;	/* rows copied to calibrate the dry run */
+static bool				always_copy = false;	/* no in-place ALTER fast path */
+
+/* Totals of the dry run estimates, and when the tables were listed */
+static int64			estimate_bytes = 0;
+static int64			estimate_wal = 0;
+static int64			estimate_usec = 0;
+static int64			listed_usec = 0;
+
+/* Time the last lock_exclusive() spent getting its lock */
+static int64			lock_waited_usec = 0;
+
+/* Autocommit connection publishing migrate.progress, or NULL */
+static PGconn		   *progress_conn = NULL;
+
+/* --report: one JSON line per table, and per phase with --report-events */
+static char			   *report_path = NULL;
+static bool				report_events = false;
+static FILE			   *report_file = NULL;
+static bool				compare_history = false;	/* flag regressions against migrate.history */
+static bool				wait_profile = false;	/* sample the wait events of our backends */
 static SimpleStringList	exclude_extension_list = {NULL, NULL}; /* don't migrate tables of these extensions */
 
+/*
+ * "{pid,...}" of all our backends: the connections pgut keeps, which are
+ * those of every table in flight and the ones publishing progress, and the
+ * index workers. Free it with free().
+ */
+static char *
+own_backend_pids(void)
+{
+	StringInfoData	buf;
+	char		   *pids;
+	int				i;
+
+	initStringInfo(&buf);
+	pgut_append_backend_pids(&buf);
+	for (i = 0; i < workers.num_workers; i++)
+		if (PQstatus(workers.conns[i]) == CONNECTION_OK)
+			appendStringInfo(&buf, "%s%d", buf.len > 0 ? "," : "",
+							 PQbackendPID(workers.conns[i]));
+	pids = pgut_malloc(buf.len + 3);
+	sprintf(pids, "{%s}", buf.data);
+	termStringInfo(&buf);
+	return pids;
+}
+
 /* buffer should have at least 11 bytes */
 static char *
 utoa(unsigned int value, char *buffer)
@@ -314,6 +596,7 @@ utoa(unsigned int value, char *buffer)
 static pgut_option options[] =
 {
 	{ 'l', 't', "table", &table_list },
+	{ 'l', 'I', "parent-table", &parent_table_list },
 	{ 'l', 'a', "alter", &alter_list },
 	{ 's', 's', "tablespace", &tablespace },
 	{ 'b', 'N', "execute", &execute_allowed },
@@ -321,6 +604,25 @@ static pgut_option options[] =
 	{ 'i', 'j', "jobs", &jobs },
 	{ 'b', 'D', "no-kill-backend", &no_kill_backend },
 	{ 'b', 'k', "no-superuser-check", &no_superuser_check },
+	{ 'i', 1, "index-memory", &index_memory },
+	{ 'i', 2, "index-parallel-workers", &index_parallel_workers },
+	{ 'i', 3, "tables-in-flight", &tables_in_flight },
+	{ 's', 4, "swap-window", &swap_window },
+	{ 'i', 5, "swap-max-sessions", &swap_max_sessions },
+	{ 'i', 6, "swap-max-tps", &swap_max_tps },
+	{ 'i', 7, "lock-budget", &lock_budget },
+	{ 'b', 8, "keep-oid", &keep_oid },
+	{ 'i', 9, "max-connections", &max_connections },
+	{ 'i', 10, "max-copies", &max_copies },
+	{ 'i', 11, "copy-rate", &copy_rate },
+	{ 'i', 12, "estimate-sample", &estimate_sample },
+	{ 'b', 13, "always-copy", &always_copy },
+	{ 's', 14, "report", &report_path },
+	{ 'b', 15, "report-events", &report_events },
+	{ 'b', 16, "compare-history", &compare_history },
+	{ 'b', 17, "wait-profile", &wait_profile },
+	{ 'i', 18, "slow-statement", &pgut_slow_statement_ms },
+	{ 'b', 19, "statement-stats", &pgut_statement_stats },
 	{ 0 },
 };
 
@@ -340,8 +642,11 @@ main(int argc, char *argv[])
 			 errmsg("too many arguments")));
 
 	check_tablespace();
+	check_swap_window();
+	check_alter_statements();
+	check_report();
 
-	if (!alter_list.head)
+	if (!alter_actions)
 		elog(INFO, "No alter statements, not executing migration");
 
 	if (!execute_allowed)
@@ -351,6 +656,9 @@ main(int argc, char *argv[])
 		ereport(ERROR,
 			(errcode(ERROR), errmsg("%s failed with error: %s", PROGRAM_NAME, errbuf)));
 
+	if (report_file && report_file != stdout)
+		fclose(report_file);
+
 	return 0;
 }
 
@@ -426,6 +734,108 @@ check_tablespace()
 	CLEARPGRES(res);
 }
 
+/*
+ * Parse --swap-window, HH:MM-HH:MM in local time. The window may wrap
+ * around midnight, e.g. 23:00-04:30.
+ *
+ * Raise an exception on error.
+ */
+static void
+check_swap_window(void)
+{
+	int		h1, m1, h2, m2;
+	char	junk;
+
+	if (swap_window == NULL)
+		return;
+
+	if (sscanf(swap_window, "%d:%d-%d:%d%c", &h1, &m1, &h2, &m2, &junk) != 4 ||
+		h1 < 0 || h1 > 23 || m1 < 0 || m1 > 59 ||
+		h2 < 0 || h2 > 23 || m2 < 0 || m2 > 59 ||
+		(h1 == h2 && m1 == m2))
+		ereport(ERROR,
+			(errcode(EINVAL),
+			 errmsg("invalid swap window \"%s\", expected HH:MM-HH:MM", swap_window)));
+
+	swap_window_start = h1 * 60 + m1;
+	swap_window_end = h2 * 60 + m2;
+}
+
+/*
+ * Open the --report file, "-" being the standard output. Lines are
+ * appended, so that the reports of successive runs accumulate.
+ *
+ * Raise an exception on error.
+ */
+static void
+check_report(void)
+{
+	if (report_path == NULL)
+	{
+		if (report_events)
+			ereport(ERROR,
+				(errcode(EINVAL),
+				 errmsg("--report-events needs --report")));
+		return;
+	}
+
+	if (strcmp(report_path, "-") == 0)
+		report_file = stdout;
+	else if ((report_file = fopen(report_path, "a")) == NULL)
+		ereport(ERROR,
+			(errcode_errno(),
+			 errmsg("could not open report file \"%s\": ", report_path)));
+}
+
+/*
+ * Fold every --alter statement into the action list of a single ALTER
+ * TABLE, so that the whole change set is validated together and the table
+ * is copied, indexed and swapped once. Trailing semicolons are dropped.
+ * RENAME cannot be combined with other actions by the server.
+ *
+ * Raise an exception on error.
+ */
+static void
+check_alter_statements(void)
+{
+	SimpleStringListCell   *cell;
+	StringInfoData			buf;
+	int						num = 0;
+	bool					rename = false;
+
+	initStringInfo(&buf);
+	for (cell = alter_list.head; cell; cell = cell->next)
+	{
+		const char *val = cell->val;
+		int			len = strlen(val);
+
+		while (len > 0 && (val[len - 1] == ';' || isspace((unsigned char) val[len - 1])))
+			len--;
+		while (len > 0 && isspace((unsigned char) *val))
+		{
+			val++;
+			len--;
+		}
+		if (len == 0)
+			continue;
+
+		rename |= (pg_strncasecmp(val, "rename", 6) == 0);
+		if (num++ > 0)
+			appendStringInfoString(&buf, ", ");
+		appendBinaryStringInfo(&buf, val, len);
+	}
+
+	if (rename && num > 1)
+		ereport(ERROR,
+			(errcode(EINVAL),
+			 errmsg("a RENAME cannot be combined with other --alter statements")));
+
+	if (num > 0)
+		alter_actions = buf.data;
+	else
+		termStringInfo(&buf);
+}
+
 /*
  * Perform sanity checks before beginning work. Make sure halo_migrate is
  * installed in the database, the user is a superuser, etc.
@@ -545,22 +955,26 @@ is_requested_relation_exists(char *errbuf, size_t errsize){
 
 	for (cell = table_list.head; cell; cell = cell->next)
 	{
-		appendStringInfo(&sql, "($%d)", iparam + 1);
+		appendStringInfo(&sql, "($%d, false)", iparam + 1);
 		params[iparam++] = cell->val;
 		if (iparam < num_relations)
 			appendStringInfoChar(&sql, ',');
 	}
+	/* a partitioned parent is no table of its own, but its partitions are */
 	for (cell = parent_table_list.head; cell; cell = cell->next)
 	{
-		appendStringInfo(&sql, "($%d)", iparam + 1);
+		appendStringInfo(&sql, "($%d, true)", iparam + 1);
 		params[iparam++] = cell->val;
 		if (iparam < num_relations)
 			appendStringInfoChar(&sql, ',');
 	}
 	appendStringInfoString(&sql,
-		") AS given_t(r)"
+		") AS given_t(r, parent)"
 		" WHERE NOT EXISTS("
-		"  SELECT FROM migrate.tables WHERE relid=to_regclass(given_t.r) )"
+		"  SELECT FROM migrate.table_metadata("
+		"   ARRAY[to_regclass(given_t.r)::oid] ||"
+		"   CASE WHEN given_t.parent THEN"
+		"    migrate.get_table_and_inheritors(to_regclass(given_t.r))::oid[] END) )"
 	);
 
 	/* double check the parameters array is sane */
@@ -678,7 +1092,7 @@ getoid(PGresult *res, int row, int col)
 }
 
 /*
- * Call migrate_one_table for the target tables or each table in a database.
+ * Call migrate_tables for the target tables or each table in a database.
  */
 static bool
 repack_one_database(const char *orderby, char *errbuf, size_t errsize)
@@ -690,6 +1104,8 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 	StringInfoData			sql;
 	SimpleStringListCell   *cell;
 	const char			  **params = NULL;
+	migrate_table		   *tables = NULL;
+	int						num_migrate = 0;
 	int						iparam = 0;
 	size_t					num_parent_tables,
 							num_tables,
@@ -723,13 +1139,18 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 	if (!is_requested_relation_exists(errbuf, errsize))
 		goto cleanup;
 
-	/* acquire target tables */
+	/*
+	 * acquire target tables; the metadata of all the candidates is collected
+	 * by one call to migrate.table_metadata()
+	 */
 	appendStringInfoString(&sql,
 		"SELECT t.*,"
-		" coalesce(v.tablespace, t.tablespace_orig) as tablespace_dest"
-		" FROM migrate.tables t, "
-		" (VALUES (quote_ident($1::text))) as v (tablespace)"
-		" WHERE ");
+		" coalesce(v.tablespace, t.tablespace_orig) as tablespace_dest,"
+		" coalesce(pg_table_size(t.relid), 0) as relsize,"
+		" coalesce(s.n_mod_since_analyze, 0) as changes,"
+		" coalesce(s.n_tup_ins + s.n_tup_upd + s.n_tup_del, 0) as total_changes"
+		" FROM migrate.table_metadata(ARRAY("
+		"   SELECT c.oid FROM pg_class c WHERE c.relkind = 'r' AND ");
 
 	params[iparam++] = tablespace;
 	if (num_tables || num_parent_tables)
@@ -741,7 +1162,7 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 			for (cell = table_list.head; cell; cell = cell->next)
 			{
 				/* Construct table name placeholders to be used by PQexecParams */
-				appendStringInfo(&sql, "relid = $%d::regclass", iparam + 1);
+				appendStringInfo(&sql, "c.oid = $%d::regclass", iparam + 1);
 				params[iparam++] = cell->val;
 				if (cell->next)
 					appendStringInfoString(&sql, " OR ");
@@ -760,7 +1181,7 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 			{
 				/* Construct table name placeholders to be used by PQexecParams */
 				appendStringInfo(&sql,
-								 "relid = ANY(migrate.get_table_and_inheritors($%d::regclass))",
+								 "c.oid = ANY(migrate.get_table_and_inheritors($%d::regclass))",
 								 iparam + 1);
 				params[iparam++] = cell->val;
 				if (cell->next)
@@ -771,7 +1192,8 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 	}
 	else if (num_schemas)
 	{
-		appendStringInfoString(&sql, "schemaname IN (");
+		appendStringInfoString(&sql,
+			"c.relnamespace IN (SELECT oid FROM pg_namespace WHERE nspname IN (");
 		for (cell = schema_list.head; cell; cell = cell->next)
 		{
 			/* Construct schema name placeholders to be used by PQexecParams */
@@ -780,13 +1202,22 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 			if (cell->next)
 				appendStringInfoString(&sql, ", ");
 		}
-		appendStringInfoString(&sql, ")");
+		appendStringInfoString(&sql, "))");
 	}
 	else
 	{
-		appendStringInfoString(&sql, "pkid IS NOT NULL");
+		appendStringInfoString(&sql, "true");
 	}
 
+	appendStringInfoString(&sql,
+		")) t"
+		" LEFT JOIN pg_stat_user_tables s ON s.relid = t.relid,"
+		" (VALUES (quote_ident($1::text))) as v (tablespace)");
+
+	/* a whole database: only the tables with a key, silently */
+	appendStringInfoString(&sql, (num_tables || num_parent_tables || num_schemas) ?
+						   " WHERE true" : " WHERE t.pkid IS NOT NULL");
+
 	/* Exclude tables which belong to extensions */
 	if (exclude_extension_list.head)
 	{
@@ -823,6 +1254,7 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 	}
 
 	res = execute_elevel(sql.data, (int) num_params, params, DEBUG2);
+	listed_usec = pgut_monotonic_usec();
 
 	/* on error skip the database */
 	if (PQresultStatus(res) != PGRES_TUPLES_OK)
@@ -834,91 +1266,100 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 	}
 
 	num = PQntuples(res);
+	tables = pgut_newarray(migrate_table, Max(num, 1));
 
 	for (i = 0; i < num; i++)
 	{
-		migrate_table	table;
+		migrate_table  *table = &tables[num_migrate];
 		StringInfoData	copy_sql;
 		const char *create_table_1;
 		const char *create_table_2;
 		const char *dest_tablespace;
 		const char *ckey;
 		int			c = 0;
-		int			dependent_views = 0;
-		PGresult   *view_check_res;
-
-		table.target_name = getstr(res, i, c++);
-		elog(DEBUG2, "table: %s", table.target_name);
-		table.target_oid = getoid(res, i, c++);
-		table.target_toast = getoid(res, i, c++);
-		table.target_tidx = getoid(res, i, c++);
+
+		memset(table, 0, sizeof(migrate_table));
+		table->target_name = getstr(res, i, c++);
+		elog(DEBUG2, "table: %s", table->target_name);
+		table->target_oid = getoid(res, i, c++);
+		table->target_toast = getoid(res, i, c++);
+		table->target_tidx = getoid(res, i, c++);
 		c++; // Skip schemaname
-		table.pkid = getoid(res, i, c++);
-		table.ckid = getoid(res, i, c++);
+		table->pkid = getoid(res, i, c++);
+		table->ckid = getoid(res, i, c++);
 
-		if (table.pkid == 0) {
+		if (table->pkid == 0) {
 			ereport(WARNING,
 					(errcode(E_PG_COMMAND),
-					 errmsg("relation \"%s\" must have a primary key or not-null unique keys", table.target_name)));
+					 errmsg("relation \"%s\" must have a primary key or not-null unique keys", table->target_name)));
 			continue;
 		}
 
-		table.create_pktype = getstr(res, i, c++);
-		table.create_log = getstr(res, i, c++);
-		table.create_trigger = getstr(res, i, c++);
-		table.enable_trigger = getstr(res, i, c++);
+		table->create_pktype = getstr(res, i, c++);
+		table->create_log = getstr(res, i, c++);
+		table->create_trigger = getstr(res, i, c++);
+		table->enable_trigger = getstr(res, i, c++);
 
 		create_table_1 = getstr(res, i, c++);
 		dest_tablespace = getstr(res, i, c++);	/* to be clobbered */
 		create_table_2 = getstr(res, i, c++);
-		table.copy_data = getstr(res, i , c++);
-		table.alter_col_storage = getstr(res, i, c++);
-		table.drop_columns = getstr(res, i, c++);
-		table.delete_log = getstr(res, i, c++);
-		table.lock_table = getstr(res, i, c++);
+		table->copy_data = getstr(res, i , c++);
+		table->alter_col_storage = getstr(res, i, c++);
+		table->drop_columns = getstr(res, i, c++);
+		table->delete_log = getstr(res, i, c++);
+		table->lock_table = getstr(res, i, c++);
 		ckey = getstr(res, i, c++);
-		table.sql_peek = getstr(res, i, c++);
-		table.sql_insert = getstr(res, i, c++);
-		table.sql_delete = getstr(res, i, c++);
-		table.sql_update = getstr(res, i, c++);
-		table.sql_pop = getstr(res, i, c++);
+		table->sql_peek = getstr(res, i, c++);
+		table->sql_insert = getstr(res, i, c++);
+		table->sql_delete = getstr(res, i, c++);
+		table->sql_update = getstr(res, i, c++);
+		table->sql_pop = getstr(res, i, c++);
+		table->part_parent = getoid(res, i, c++);
+		table->part_check = getstr(res, i, c++);
+		table->create_table_def = getstr(res, i, c++);
+		table->alter_col_options = getstr(res, i, c++);
+		table->dependent_views = atoi(getstr(res, i, c++));
 		dest_tablespace = getstr(res, i, c++);
+		table->relsize = atoll(getstr(res, i, c++));
+		table->changes = atoll(getstr(res, i, c++));
+		table->listed_changes = atoll(getstr(res, i, c++));
 
-		/* check for views referencing the table */
-		resetStringInfo(&sql);
-		printfStringInfo(&sql,
-			"SELECT distinct v.oid::regclass AS view"
-			" FROM pg_depend AS d "
-			"   JOIN pg_rewrite AS r "
-			"      ON r.oid = d.objid"
-			"   JOIN pg_class AS v "
-			"      ON v.oid = r.ev_class"
-			" WHERE v.relkind = 'v'"
-			"  AND d.classid = 'pg_rewrite'::regclass"
-			"  AND d.refclassid = 'pg_class'::regclass"
-			"  AND d.deptype = 'n'"
-  			"  AND d.refobjid = '%s'::regclass",
-			table.target_name);
-
-		view_check_res = execute_elevel(sql.data, 0, NULL, DEBUG2);
-		/* on error skip the table */
-		if (PQresultStatus(view_check_res) != PGRES_TUPLES_OK)
-		{
-			/* Return the error message otherwise */
-			if (errbuf)
-				snprintf(errbuf, errsize, "%s", PQerrorMessage(connection));
-			goto cleanup;
-		}
-
-		dependent_views = PQntuples(view_check_res);
-		if (dependent_views > 0) {
+		/* the views stay attached if the storage is swapped under them */
+		if (table->dependent_views > 0 && !keep_oid) {
 			ereport(WARNING,
 					(errcode(E_PG_COMMAND),
-					 errmsg("the table \"%s\" has %d views depending on it. this tool does not currently support migrating tables with dependent views.", table.target_name, dependent_views)));
-			CLEARPGRES(view_check_res);
+					 errmsg("the table \"%s\" has %d views depending on it. this tool does not currently support migrating tables with dependent views.", table->target_name, table->dependent_views)));
 			continue;
 		}
-		CLEARPGRES(view_check_res);
+
+		/*
+		 * A partition is detached and its rebuilt table attached in its
+		 * place, under the parent's lock. Foreign keys referencing it would
+		 * make the detach fail, or stay with the old table; find out now
+		 * rather than after the copy.
+		 */
+		if (table->part_parent && !keep_oid)
+		{
+			PGresult   *fkres;
+			const char *fkparams[1];
+			char		fkbuffer[12];
+			int			fkeys;
+
+			fkparams[0] = utoa(table->target_oid, fkbuffer);
+			fkres = execute_elevel("SELECT count(*) FROM pg_constraint"
+								   " WHERE contype = 'f' AND confrelid = $1",
+								   1, fkparams, DEBUG2);
+			fkeys = (PQresultStatus(fkres) == PGRES_TUPLES_OK) ?
+				atoi(PQgetvalue(fkres, 0, 0)) : 0;
+			CLEARPGRES(fkres);
+			if (fkeys > 0)
+			{
+				ereport(WARNING,
+						(errcode(E_PG_COMMAND),
+						 errmsg("the partition \"%s\" is referenced by %d foreign keys. this tool does not currently support migrating partitions referenced by foreign keys.", table->target_name, fkeys)));
+				continue;
+			}
+		}
 
 		/* Craft CREATE TABLE SQL */
 		resetStringInfo(&sql);
@@ -928,12 +1369,18 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 
 		/* Always append WITH NO DATA to CREATE TABLE SQL*/
 		appendStringInfoString(&sql, " WITH NO DATA");
-		table.create_table = sql.data;
-		table.tablespace = dest_tablespace;
+		table->create_table = pgut_strdup(sql.data);
+		table->tablespace = dest_tablespace;
 
 		/* Craft Copy SQL */
 		initStringInfo(&copy_sql);
-		appendStringInfoString(&copy_sql, table.copy_data);
+		if (!execute_allowed && estimate_sample > 0)
+		{
+			appendStringInfo(&copy_sql, "%s LIMIT %d", table->copy_data, estimate_sample);
+			table->copy_sample = pgut_strdup(copy_sql.data);
+			resetStringInfo(&copy_sql);
+		}
+		appendStringInfoString(&copy_sql, table->copy_data);
 		if (!orderby)
 
 		{
@@ -956,10 +1403,18 @@ repack_one_database(const char *orderby, char *errbuf, size_t errsize)
 			appendStringInfoString(&copy_sql, " ORDER BY ");
 			appendStringInfoString(&copy_sql, orderby);
 		}
-		table.copy_data = copy_sql.data;
+		table->copy_data = copy_sql.data;
 
-		migrate_one_table(&table, orderby, errbuf, errsize);
+		num_migrate++;
 	}
+
+	estimate_bytes = estimate_wal = estimate_usec = 0;
+	migrate_tables(tables, num_migrate, orderby, errbuf, errsize);
+	if (!execute_allowed && num_migrate > 1)
+		elog(under_regress() ? DEBUG2 : INFO,
+			 "estimate for %d tables: %.1f MB of disk space, %.1f MB of WAL, %.1f s one at a time",
+			 num_migrate, estimate_bytes / 1048576.0, estimate_wal / 1048576.0,
+			 estimate_usec / 1000000.0);
 	ret = true;
 
 cleanup:
@@ -967,6 +1422,7 @@ cleanup:
 	disconnect();
 	termStringInfo(&sql);
 	free(params);
+	free(tables);
 	return ret;
 }
 
@@ -985,6 +1441,7 @@ apply_log(PGconn *conn, const migrate_table *table, int count)
 	params[4] = table->sql_pop;
 	params[5] = utoa(count, buffer);
 
+	pgut_label = "apply_log";
 	res = pgut_execute(conn,
 					   "SELECT migrate.migrate_apply($1, $2, $3, $4, $5, $6)",
 					   6, params);
@@ -995,785 +1452,1877 @@ apply_log(PGconn *conn, const migrate_table *table, int count)
 }
 
 /*
- * Create indexes on temp table, possibly using multiple worker connections
- * concurrently if the user asked for --jobs=...
+ * Estimate the relative cost of building an index, for scheduling. Every
+ * build scans the whole heap, and then sorts or inserts roughly as much data
+ * as the original index holds; per byte, some access methods are much more
+ * expensive to build than a btree.
  */
-static bool
-rebuild_indexes(const migrate_table *table)
+static double
+index_build_cost(const char *amname, int64 size, int64 heap_size)
 {
-	PGresult	   *res = NULL;
-	int			    num_indexes;
-	int				i;
-	int				num_active_workers;
-	int				num_workers;
-	migrate_index   *index_jobs;
-	bool            have_error = false;
-
-	elog(DEBUG2, "---- create indexes ----");
-
-	num_indexes = table->n_indexes;
-
-	/* We might have more actual worker connections than we need,
-	 * if the number of workers exceeds the number of indexes to be
-	 * built. In that case, ignore the extra workers.
-	 */
-	num_workers = num_indexes > workers.num_workers ? workers.num_workers : num_indexes;
-	num_active_workers = num_workers;
-
-	elog(DEBUG2, "Have %d indexes and num_workers=%d", num_indexes,
-		 num_workers);
+	double		weight = 1.0;
+
+	if (amname == NULL)
+		weight = 1.0;
+	else if (strcmp(amname, "gin") == 0)
+		weight = 4.0;
+	else if (strcmp(amname, "gist") == 0)
+		weight = 3.0;
+	else if (strcmp(amname, "spgist") == 0)
+		weight = 2.0;
+	else if (strcmp(amname, "hash") == 0)
+		weight = 1.5;
+
+	return HEAP_SCAN_COST * (double) Max(heap_size, BLCKSZ) +
+		weight * (double) Max(size, BLCKSZ);
+}
 
-	index_jobs = table->indexes;
+/* qsort comparator: most expensive index first, then by OID for stability */
+static int
+index_cost_cmp(const void *a, const void *b)
+{
+	const migrate_index *ia = (const migrate_index *) a;
+	const migrate_index *ib = (const migrate_index *) b;
+
+	if (ia->cost > ib->cost)
+		return -1;
+	if (ia->cost < ib->cost)
+		return 1;
+	if (ia->target_oid < ib->target_oid)
+		return -1;
+	if (ia->target_oid > ib->target_oid)
+		return 1;
+	return 0;
+}
 
-	for (i = 0; i < num_indexes; i++)
-	{
+/*
+ * Fetch the valid indexes of 'table' into table->indexes, most expensive
+ * first, replacing any fetched before. table->index_oids records the
+ * catalog state they were read from.
+ */
+static void
+fetch_indexes(migrate_table *table, const char **indexparams)
+{
+	PGresult   *res;
+	int			j;
 
-		elog(DEBUG2, "set up index_jobs [%d]", i);
-		elog(DEBUG2, "target_oid   : %u", index_jobs[i].target_oid);
-		elog(DEBUG2, "create_index : %s", index_jobs[i].create_index);
+	free(table->indexes);
+	CLEARPGRES(table->indexres);
+	free(table->index_oids);
 
-		if (num_workers <= 1) {
-			/* Use primary connection if we are not setting up parallel
-			 * index building, or if we only have one worker.
-			 */
-			command(index_jobs[i].create_index, 0, NULL);
+	/* read the state first: a change after it shows up as a mismatch */
+	res = pgut_execute(table->conn, SQL_INDEX_OIDS, 1, indexparams);
+	table->index_oids = pgut_strdup(getstr(res, 0, 0));
+	CLEARPGRES(res);
 
-			/* This bookkeeping isn't actually important in this no-workers
-			 * case, but just for clarity.
-			 */
-			index_jobs[i].status = FINISHED;
-		}
-		else if (i < num_workers) {
-			/* Assign available worker to build an index. */
-			index_jobs[i].status = INPROGRESS;
-			index_jobs[i].worker_idx = i;
-			elog(LOG, "Initial worker %d to build index: %s",
-				 i, index_jobs[i].create_index);
+	table->indexres = pgut_execute(table->conn,
+		"SELECT i.indexrelid,"
+		" migrate.migrate_indexdef(i.indexrelid, i.indrelid, $2, FALSE, left(md5($3), 5)), "
+		" left(md5($3), 5), "
+		" pg_relation_size(i.indexrelid), a.amname, pg_relation_size(i.indrelid) "
+		" FROM pg_index i"
+		" JOIN pg_class c ON c.oid = i.indexrelid"
+		" JOIN pg_am a ON a.oid = c.relam"
+		" WHERE i.indrelid = $1 AND i.indisvalid",
+		3, indexparams);
 
-			if (!(PQsendQuery(workers.conns[i], index_jobs[i].create_index)))
-			{
-				elog(WARNING, "Error sending async query: %s\n%s",
-					 index_jobs[i].create_index,
-					 PQerrorMessage(workers.conns[i]));
-				have_error = true;
-				goto cleanup;
-			}
-		}
-		/* Else we have more indexes to be built than workers
-		 * available. That's OK, we'll get to them later.
-		 */
-	}
+	table->n_indexes = PQntuples(table->indexres);
+	table->indexes = pgut_malloc(table->n_indexes * sizeof(migrate_index));
+	table->index_size = 0;
 
-	if (num_workers > 1)
+	for (j = 0; j < table->n_indexes; j++)
 	{
-		int freed_worker = -1;
-		int ret;
+		PGresult   *indexres = table->indexres;
 
-/* Prefer poll() over select(), following PostgreSQL custom. */
-#ifdef HAVE_POLL
-		struct pollfd *input_fds;
+		table->indexes[j].target_oid = getoid(indexres, j, 0);
+		table->indexes[j].create_index = getstr(indexres, j, 1);
+		table->indexes[j].hash = getstr(indexres, j, 2);
+		table->indexes[j].size = strtoll(getstr(indexres, j, 3), NULL, 10);
+		table->index_size += table->indexes[j].size;
+		table->indexes[j].amname = getstr(indexres, j, 4);
+		table->indexes[j].cost = index_build_cost(table->indexes[j].amname,
+												  table->indexes[j].size,
+												  strtoll(getstr(indexres, j, 5), NULL, 10));
+		table->indexes[j].status = UNPROCESSED;
+		table->indexes[j].worker_idx = -1; /* Unassigned */
+		table->indexes[j].conn = NULL;
+		table->indexes[j].start_usec = 0;
+		table->indexes[j].duration_usec = 0;
+		table->indexes[j].mem_kb = 0;
+		table->indexes[j].parallel_workers = 0;
+	}
 
-		input_fds = pgut_malloc(sizeof(struct pollfd) * num_workers);
-		for (i = 0; i < num_workers; i++)
-		{
-			input_fds[i].fd = PQsocket(workers.conns[i]);
-			input_fds[i].events = POLLIN | POLLERR;
-			input_fds[i].revents = 0;
-		}
-#else
-		fd_set input_mask;
-		struct timeval timeout;
-		/* select() needs the highest-numbered socket descriptor */
-		int max_fd;
-#endif
+	/* Longest-processing-time first: build the most expensive indexes
+	 * first so that the small ones fill in the gaps at the end.
+	 */
+	qsort(table->indexes, table->n_indexes, sizeof(migrate_index),
+		  index_cost_cmp);
 
-		/* Now go through our index builds, and look for any which is
-		 * reported complete. Reassign that worker to the next index to
-		 * be built, if any.
-		 */
-		while (num_active_workers > 0)
-		{
-			elog(DEBUG2, "polling %d active workers", num_active_workers);
+	for (j = 0; j < table->n_indexes; j++)
+	{
+		elog(DEBUG2, "index[%d].target_oid      : %u", j, table->indexes[j].target_oid);
+		elog(DEBUG2, "index[%d].create_index    : %s", j, table->indexes[j].create_index);
+		elog(DEBUG2, "index[%d].amname          : %s", j, table->indexes[j].amname);
+		elog(DEBUG2, "index[%d].size            : " INT64_FORMAT, j, table->indexes[j].size);
+	}
+}
 
-#ifdef HAVE_POLL
-			ret = poll(input_fds, num_workers, POLL_TIMEOUT * 1000);
-#else
-			/* re-initialize timeout and input_mask before each
-			 * invocation of select(). I think this isn't
-			 * necessary on many Unixen, but just in case.
-			 */
-			timeout.tv_sec = POLL_TIMEOUT;
-			timeout.tv_usec = 0;
+/*
+ * Dry run: report what migrating 'table' would take. The copy is the live
+ * part of the heap and TOAST; every index is rebuilt at its live size; the
+ * log holds the row changes arriving, at the rate sampled since the tables
+ * were listed, for as long as the copy and the index builds run. The WAL
+ * written is about the copy and the indexes, plus the log twice, once into
+ * the log and once applied.
+ *
+ * Copy and index build times assume ESTIMATE_COPY_MBPS and
+ * ESTIMATE_INDEX_MBPS, unless --estimate-sample copies that many rows into
+ * the new table, builds its indexes and rolls back, and the times measured
+ * are scaled to the whole table.
+ */
+static void
+estimate_table(migrate_table *table, const char *create_table)
+{
+	PGconn		   *conn = table->conn;
+	PGresult	   *res;
+	const char	   *params[3];
+	char			buffer[12];
+	int				elevel = under_regress() ? DEBUG2 : INFO;
+	double			rows, live, copy_bytes, index_bytes = 0, width;
+	double			copy_sec, index_sec = 0, longest_index_sec = 0, build_sec;
+	double			change_rate, log_bytes, wal_bytes, sample_rows = 0;
+	double		   *index_secs;
+	int64			now;
+	int				j;
 
-			FD_ZERO(&input_mask);
-			for (i = 0, max_fd = 0; i < num_workers; i++)
-			{
-				FD_SET(PQsocket(workers.conns[i]), &input_mask);
-				if (PQsocket(workers.conns[i]) > max_fd)
-					max_fd = PQsocket(workers.conns[i]);
-			}
+	params[0] = utoa(table->target_oid, buffer);
+	params[1] = tablespace;
+	params[2] = table->target_name;
+	fetch_indexes(table, params);
+	index_secs = pgut_newarray(double, Max(table->n_indexes, 1));
+
+	/* sample the row changes over ESTIMATE_RATE_USEC at least */
+	now = pgut_monotonic_usec();
+	if (now - listed_usec < ESTIMATE_RATE_USEC)
+		usleep((useconds_t) (ESTIMATE_RATE_USEC - (now - listed_usec)));
+	now = pgut_monotonic_usec();
+
+	res = pgut_execute(conn, SQL_ESTIMATE, 1, params);
+	rows = atof(getstr(res, 0, 0));
+	live = atof(getstr(res, 0, 3)) + atof(getstr(res, 0, 4));
+	live = (live > 0 ? atof(getstr(res, 0, 3)) / live : 1.0);
+	copy_bytes = (atof(getstr(res, 0, 1)) + atof(getstr(res, 0, 2))) * live;
+	change_rate = (atof(getstr(res, 0, 5)) - table->listed_changes) * 1000000.0 /
+		Max(now - listed_usec, 1);
+	CLEARPGRES(res);
+	width = (rows > 0 ? copy_bytes / rows : 0);
 
-			ret = select(max_fd + 1, &input_mask, NULL, NULL, &timeout);
-#endif
-			/* XXX: the errno != EINTR check means we won't bail
-			 * out on SIGINT. We should probably just remove this
-			 * check, though it seems we also need to fix up
-			 * the on_interrupt handling for workers' index
-			 * builds (those PGconns don't seem to have c->cancel
-			 * set, so we don't cancel the in-progress builds).
-			 */
-			if (ret < 0 && errno != EINTR)
-				elog(ERROR, "poll() failed: %d, %d", ret, errno);
+	copy_sec = copy_bytes / (ESTIMATE_COPY_MBPS * 1048576.0);
+	for (j = 0; j < table->n_indexes; j++)
+	{
+		index_bytes += table->indexes[j].size * live;
+		index_secs[j] = table->indexes[j].size * live / (ESTIMATE_INDEX_MBPS * 1048576.0);
+	}
 
-			elog(DEBUG2, "Poll returned: %d", ret);
+	if (table->copy_sample)
+	{
+		int64		start;
 
-			for (i = 0; i < num_indexes; i++)
-			{
-				if (index_jobs[i].status == INPROGRESS)
-				{
-					Assert(index_jobs[i].worker_idx >= 0);
-					/* Must call PQconsumeInput before we can check PQisBusy */
-					if (PQconsumeInput(workers.conns[index_jobs[i].worker_idx]) != 1)
-					{
-						elog(WARNING, "Error fetching async query status: %s",
-							 PQerrorMessage(workers.conns[index_jobs[i].worker_idx]));
-						have_error = true;
-						goto cleanup;
-					}
-					if (!PQisBusy(workers.conns[index_jobs[i].worker_idx]))
-					{
-						elog(LOG, "Command finished in worker %d: %s",
-							 index_jobs[i].worker_idx,
-							 index_jobs[i].create_index);
-
-						while ((res = PQgetResult(workers.conns[index_jobs[i].worker_idx])))
-						{
-							if (PQresultStatus(res) != PGRES_COMMAND_OK)
-							{
-								elog(WARNING, "Error with create index: %s",
-									 PQerrorMessage(workers.conns[index_jobs[i].worker_idx]));
-								have_error = true;
-								goto cleanup;
-							}
-							CLEARPGRES(res);
-						}
-
-						/* We are only going to re-queue one worker, even
-						 * though more than one index build might be finished.
-						 * Any other jobs which may be finished will
-						 * just have to wait for the next pass through the
-						 * poll()/select() loop.
-						 */
-						freed_worker = index_jobs[i].worker_idx;
-						index_jobs[i].status = FINISHED;
-						num_active_workers--;
-						break;
-					}
-				}
-			}
-			if (freed_worker > -1)
+		pgut_command(conn, "BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+		res = pgut_execute_elevel(conn, create_table, 0, NULL, WARNING);
+		if (PQresultStatus(res) == PGRES_COMMAND_OK &&
+			(!alter_actions ||
+			 apply_alter_statement(conn, table->target_oid, alter_actions)))
+		{
+			CLEARPGRES(res);
+			start = pgut_monotonic_usec();
+			res = pgut_execute_elevel(conn, table->copy_sample, 0, NULL, WARNING);
+			if (PQresultStatus(res) == PGRES_COMMAND_OK)
+				sample_rows = atof(PQcmdTuples(res));
+			if (sample_rows > 0 && rows > sample_rows)
 			{
-				for (i = 0; i < num_indexes; i++)
+				copy_sec = (pgut_monotonic_usec() - start) / 1000000.0 *
+					rows / sample_rows;
+				for (j = 0; j < table->n_indexes; j++)
 				{
-					if (index_jobs[i].status == UNPROCESSED)
-					{
-						index_jobs[i].status = INPROGRESS;
-						index_jobs[i].worker_idx = freed_worker;
-						elog(LOG, "Assigning worker %d to build index #%d: "
-							 "%s", freed_worker, i,
-							 index_jobs[i].create_index);
-
-						if (!(PQsendQuery(workers.conns[freed_worker],
-										  index_jobs[i].create_index))) {
-							elog(WARNING, "Error sending async query: %s\n%s",
-								 index_jobs[i].create_index,
-								 PQerrorMessage(workers.conns[freed_worker]));
-							have_error = true;
-							goto cleanup;
-						}
-						num_active_workers++;
-						break;
-					}
+					CLEARPGRES(res);
+					start = pgut_monotonic_usec();
+					res = pgut_execute_elevel(conn, table->indexes[j].create_index,
+											  0, NULL, WARNING);
+					if (PQresultStatus(res) == PGRES_COMMAND_OK)
+						index_secs[j] = (pgut_monotonic_usec() - start) / 1000000.0 *
+							rows / sample_rows;
 				}
-				freed_worker = -1;
 			}
 		}
-
+		CLEARPGRES(res);
+		pgut_rollback(conn);
 	}
 
-cleanup:
-	CLEARPGRES(res);
-	return (!have_error);
+	for (j = 0; j < table->n_indexes; j++)
+	{
+		index_sec += index_secs[j];
+		longest_index_sec = Max(longest_index_sec, index_secs[j]);
+	}
+	/* with --jobs the builds overlap, but none is shorter than the longest */
+	build_sec = Max(longest_index_sec, index_sec / Max(jobs, 1));
+
+	log_bytes = change_rate * (width + LOG_ROW_OVERHEAD) * (copy_sec + build_sec);
+	wal_bytes = copy_bytes + index_bytes + 2 * log_bytes;
+
+	elog(elevel, "estimate for \"%s\": %.0f rows, %.1f MB to copy (%.0f%% live)",
+		 table->target_name, rows, copy_bytes / 1048576.0, live * 100);
+	elog(elevel, "  disk space: %.1f MB table and TOAST, %.1f MB indexes, %.1f MB log, %.1f MB in total",
+		 copy_bytes / 1048576.0, index_bytes / 1048576.0, log_bytes / 1048576.0,
+		 (copy_bytes + index_bytes + log_bytes) / 1048576.0);
+	elog(elevel, "  WAL: about %.1f MB", wal_bytes / 1048576.0);
+	elog(elevel, "  log growth: %.1f row changes/s, %.1f kB/s",
+		 change_rate, change_rate * (width + LOG_ROW_OVERHEAD) / 1024);
+	elog(elevel, "  copy: about %.1f s (%s)", copy_sec,
+		 sample_rows > 0 ? "calibrated by --estimate-sample" : "nominal rate");
+	for (j = 0; j < table->n_indexes; j++)
+		elog(elevel, "  index %u (%s, %.1f MB): about %.1f s",
+			 table->indexes[j].target_oid, table->indexes[j].amname,
+			 table->indexes[j].size * live / 1048576.0, index_secs[j]);
+	elog(elevel, "  duration: about %.1f s before catch-up and swap", copy_sec + build_sec);
+	if (alter_actions && !tablespace && !always_copy && !alter_may_scan(alter_actions))
+		elog(elevel, "  the alter statement may apply in place, without any of the above, if it needs no rewrite");
+
+	estimate_bytes += (int64) (copy_bytes + index_bytes + log_bytes);
+	estimate_wal += (int64) wal_bytes;
+	estimate_usec += (int64) ((copy_sec + build_sec) * 1000000);
+	free(index_secs);
 }
 
-
 /*
- * Re-organize one table. This function contains the key
- * logic. See this blog for a walk through:
- * https://www.percona.com/blog/2021/06/24/understanding-pg_repack-what-can-go-wrong-and-how-to-avoid-it/
+ * Start timing an AccessExclusive window which has just been granted.
  */
 static void
-migrate_one_table(migrate_table *table, const char *orderby, char *errbuf, size_t errsize)
+lock_window_begin(lock_window *lw, const char *what)
 {
-	PGresult	   *res = NULL;
-	const char	   *params[3];
-	int				num;
-	char		   *vxid = NULL;
-	char			buffer[12];
-	StringInfoData	sql;
-	bool            ret = false;
-	PGresult       *indexres = NULL;
-	const char     *indexparams[3];
-	const char	   *create_table;
-	char		    indexbuffer[12];
-	int             j;
-	char           *tmp_target_name = NULL;
-	char           *schema = NULL;
-	char           *table_without_namespace = NULL;
-	migrate_foreign_key *foreign_keys;
-	char *original_primary_key_def;
-    const char *original_primary_key_name;
-    const char *backing_index_name = NULL;
-	int primary_key = 0;
+	lw->what = what;
+	lw->start_usec = lw->step_usec = pgut_monotonic_usec();
+	lw->steps[0] = '\0';
+}
 
-	/* appname will be "halo_migrate" in normal use on 9.0+, or
-	 * "pg_regress" when run under `make installcheck`
-	 */
-	const char     *appname = getenv("PGAPPNAME");
+/* Record the statement(s) run since the last step */
+static void
+lock_window_step(lock_window *lw, const char *step)
+{
+	int64		now = pgut_monotonic_usec();
+	size_t		len = strlen(lw->steps);
 
-	/* Keep track of whether we have gotten through setup to install
-	 * the migrate_trigger, log table, etc. ourselves. We don't want to
-	 * go through migrate_cleanup() if we didn't actually set up the
-	 * trigger ourselves, lest we be cleaning up another halo_migrate's mess,
-	 * or worse, interfering with a still-running halo_migrate.
-	 */
-	bool            table_init = false;
+	snprintf(lw->steps + len, sizeof(lw->steps) - len, "%s%s %.3f ms",
+			 len > 0 ? ", " : "", step, (now - lw->step_usec) / 1000.0);
+	lw->step_usec = now;
+}
 
-	initStringInfo(&sql);
+/* Record a step timed by the server; the next step gets the rest */
+static void
+lock_window_add(lock_window *lw, const char *step, double elapsed_ms)
+{
+	size_t		len = strlen(lw->steps);
 
-	tmp_target_name = strdup(table->target_name);
-	schema = strtok(tmp_target_name, ".");
-	table_without_namespace = strtok(NULL, ".");
+	snprintf(lw->steps + len, sizeof(lw->steps) - len, "%s%s %.3f ms",
+			 len > 0 ? ", " : "", step, elapsed_ms);
+	lw->step_usec += (int64) (elapsed_ms * 1000.0);
+}
 
-	resetStringInfo(&sql);
-	/* Use a different create table statement that includes null restrictions and
-	 * defaults. */
-	printfStringInfo(&sql,
-		"SELECT migrate.get_create_table_statement('%s', '%s', 'migrate.table_%u', '%s')",
-		schema, table_without_namespace, table->target_oid, table->tablespace);
-	res = execute(sql.data, 0, NULL);
+/* Has the window already lasted longer than --lock-budget? */
+static bool
+lock_window_over(const lock_window *lw)
+{
+	return lock_budget > 0 &&
+		pgut_monotonic_usec() - lw->start_usec > (int64) lock_budget * 1000;
+}
 
-	if (PQntuples(res) < 1)
-	{
-		elog(WARNING,
-			"unable to generate SQL to CREATE temp table");
-		goto cleanup;
-	}
-
-	create_table = pgut_strdup(getstr(res, 0, 0));
-	CLEARPGRES(res);
-
-	elog(INFO, "migrating table \"%s\"", table->target_name);
-
-	elog(DEBUG2, "---- migrate_one_table ----");
-	elog(DEBUG2, "target_name       : %s", table->target_name);
-	elog(DEBUG2, "target_oid        : %u", table->target_oid);
-	elog(DEBUG2, "target_toast      : %u", table->target_toast);
-	elog(DEBUG2, "target_tidx       : %u", table->target_tidx);
-	elog(DEBUG2, "pkid              : %u", table->pkid);
-	elog(DEBUG2, "ckid              : %u", table->ckid);
-	elog(DEBUG2, "create_pktype     : %s", table->create_pktype);
-	elog(DEBUG2, "create_log        : %s", table->create_log);
-	elog(DEBUG2, "create_trigger    : %s", table->create_trigger);
-	elog(DEBUG2, "enable_trigger    : %s", table->enable_trigger);
-	elog(DEBUG2, "create_table      : %s", create_table);
-	elog(DEBUG2, "copy_data         : %s", table->copy_data);
-	elog(DEBUG2, "alter_col_storage : %s", table->alter_col_storage ?
-		 table->alter_col_storage : "(skipped)");
-	elog(DEBUG2, "drop_columns      : %s", table->drop_columns ? table->drop_columns : "(skipped)");
-	elog(DEBUG2, "delete_log        : %s", table->delete_log);
-	elog(DEBUG2, "lock_table        : %s", table->lock_table);
-	elog(DEBUG2, "sql_peek          : %s", table->sql_peek);
-	elog(DEBUG2, "sql_insert        : %s", table->sql_insert);
-	elog(DEBUG2, "sql_delete        : %s", table->sql_delete);
-	elog(DEBUG2, "sql_update        : %s", table->sql_update);
-	elog(DEBUG2, "sql_pop           : %s", table->sql_pop);
+/*
+ * Report how long the lock was held and where the time went. A window
+ * which was rolled back or still overran the budget is a WARNING.
+ */
+static void
+lock_window_end(lock_window *lw, migrate_table *table, bool committed)
+{
+	int64		held_usec = pgut_monotonic_usec() - lw->start_usec;
+	double		held_ms = held_usec / 1000.0;
+	int			i;
 
-	if (!execute_allowed)
-		return;
+	/* charge the hold to the lock phase of the timeline around the window */
+	for (i = table->n_timeline - 1; i >= 0; i--)
+		if (table->timeline[i].open)
+		{
+			table->timeline[i].hold_usec += held_usec;
+			break;
+		}
 
-	/* push migrate_cleanup_callback() on stack to clean temporary objects */
-	pgut_atexit_push(migrate_cleanup_callback, &table->target_oid);
+	if (!committed)
+		elog(WARNING, "%s: %s held the exclusive lock for %.3f ms, over --lock-budget; rolling back (%s)",
+			 table->target_name, lw->what, held_ms, lw->steps);
+	else
+		elog(lock_budget > 0 && held_ms > lock_budget ? WARNING :
+			 under_regress() ? DEBUG2 : LOG,
+			 "%s: %s held the exclusive lock for %.3f ms (%s)",
+			 table->target_name, lw->what, held_ms, lw->steps);
+}
 
-	/*
-	 * 1. Setup advisory lock and trigger on main table.
+/*
+ * Are we run by `make installcheck`? Timings and other varying output
+ * would trip up pg_regress, so it is kept out of the default log level.
+ */
+static bool
+under_regress(void)
+{
+	/* appname will be "halo_migrate" in normal use on 9.0+, or
+	 * "pg_regress" when run under `make installcheck`
 	 */
-	elog(DEBUG2, "---- setup triggers ----");
+	const char     *appname = getenv("PGAPPNAME");
 
-	params[0] = utoa(table->target_oid, buffer);
+	return appname && strcmp(appname, "pg_regress") == 0;
+}
 
-	if (!advisory_lock(connection, buffer))
-		goto cleanup;
+/*
+ * Resources of the --index-memory and --index-parallel-workers budgets not
+ * currently granted to a running index build.
+ */
+static int	index_mem_free_kb = 0;
+static int	index_workers_free = 0;
 
-	if (!(lock_exclusive(connection, buffer, table->lock_table, true)))
-	{
-		if (no_kill_backend)
-			elog(INFO, "Skipping migrate %s due to timeout", table->target_name);
-		else
-			elog(WARNING, "lock_exclusive() failed for %s", table->target_name);
-		goto cleanup;
-	}
+/* maintenance_work_mem an index build can put to use: about the size of
+ * the data it sorts, which is close to the size of the original index.
+ * GiST, SP-GiST and BRIN builds do not sort, so give them the minimum.
+ */
+static int64
+index_mem_need_kb(const migrate_index *job)
+{
+	if (job->amname &&
+		(strcmp(job->amname, "btree") == 0 ||
+		 strcmp(job->amname, "hash") == 0 ||
+		 strcmp(job->amname, "gin") == 0))
+		return Max(job->size / 1024 * 5 / 4, MIN_MAINTENANCE_WORK_MEM);
 
-	/*
-	 * pg_get_indexdef requires an access share lock, so do those calls while
-	 * we have an access exclusive lock anyway, so we know they won't block.
-	 */
-	elog(DEBUG2, "---- find indexes ----");
+	return MIN_MAINTENANCE_WORK_MEM;
+}
 
-	indexparams[0] = utoa(table->target_oid, indexbuffer);
-	indexparams[1] = tablespace != NULL ? tablespace : NULL;
-	indexparams[2] = table->target_name;
+/* Parallel workers an index build can put to use; only btree builds
+ * run in parallel.
+ */
+static int
+index_workers_need(const migrate_index *job)
+{
+	int64	threshold = PARALLEL_INDEX_MIN_SIZE;
+	int		n = 0;
 
-	/* First, just display a warning message for any invalid indexes
-	 * which may be on the table (mostly to match the behavior of 1.1.8).
-	 */
-	indexres = execute(
-		"SELECT pg_get_indexdef(indexrelid)"
-		" FROM pg_index WHERE indrelid = $1 AND NOT indisvalid",
-		1, indexparams);
+	if (job->amname == NULL || strcmp(job->amname, "btree") != 0)
+		return 0;
 
-	for (j = 0; j < PQntuples(indexres); j++)
+	while (job->size >= threshold && n < 64)
 	{
-		const char *indexdef;
-		indexdef = getstr(indexres, j, 0);
-		elog(WARNING, "skipping invalid index: %s", indexdef);
+		n++;
+		threshold *= 3;
 	}
+	return n;
+}
 
-	indexres = execute(
-		"SELECT indexrelid,"
-		" migrate.migrate_indexdef(indexrelid, indrelid, $2, FALSE, left(md5($3), 5)), "
-		" left(md5($3), 5) "
-		" FROM pg_index WHERE indrelid = $1 AND indisvalid",
-		3, indexparams);
+/*
+ * How many more index builds --index-memory lets start now, each needing
+ * at least MIN_MAINTENANCE_WORK_MEM.
+ */
+static int
+index_mem_slots(void)
+{
+	if (index_memory <= 0)
+		return INT_MAX;
+	return index_mem_free_kb / MIN_MAINTENANCE_WORK_MEM;
+}
 
-	table->n_indexes = PQntuples(indexres);
-	table->indexes = pgut_malloc(table->n_indexes * sizeof(migrate_index));
+/*
+ * Split what is left of the budgets among index_jobs[first .. first+count-1],
+ * which are about to start together; count is within index_mem_slots().
+ * Each build gets MIN_MAINTENANCE_WORK_MEM, and the rest of the memory is
+ * shared in proportion to what each can use beyond that, and never more, so
+ * a small index does not sit on memory a large sort needs. Whatever is not
+ * granted stays available for the builds started later.
+ */
+static void
+budget_index_jobs(migrate_index *index_jobs, int first, int count)
+{
+	int64	mem_need = 0;
+	int		workers_need = 0;
+	int		mem_free = index_mem_free_kb - count * MIN_MAINTENANCE_WORK_MEM;
+	int		workers_free = index_workers_free;
+	int		i;
 
-	for (j = 0; j < table->n_indexes; j++)
+	for (i = first; i < first + count; i++)
 	{
-		table->indexes[j].target_oid = getoid(indexres, j, 0);
-		table->indexes[j].create_index = getstr(indexres, j, 1);
-		table->indexes[j].hash = getstr(indexres, j, 2);
-		table->indexes[j].status = UNPROCESSED;
-		table->indexes[j].worker_idx = -1; /* Unassigned */
+		mem_need += index_mem_need_kb(&index_jobs[i]) - MIN_MAINTENANCE_WORK_MEM;
+		workers_need += index_workers_need(&index_jobs[i]);
 	}
 
-	for (j = 0; j < table->n_indexes; j++)
+	for (i = first; i < first + count; i++)
 	{
-		elog(DEBUG2, "index[%d].target_oid      : %u", j, table->indexes[j].target_oid);
-		elog(DEBUG2, "index[%d].create_index    : %s", j, table->indexes[j].create_index);
-	}
+		migrate_index  *job = &index_jobs[i];
 
+		job->mem_kb = 0;
+		job->parallel_workers = 0;
 
-	/*
-	 * Check if migrate_trigger is not conflict with existing trigger. We can
-	 * find it out later but we check it in advance and go to cleanup if needed.
-	 * In AFTER trigger context, since triggered tuple is not changed by other
-	 * trigger we don't care about the fire order.
-	 */
-	res = execute("SELECT migrate.conflicted_triggers($1)", 1, params);
-	if (PQntuples(res) > 0)
-	{
-		ereport(WARNING,
-				(errcode(E_PG_COMMAND),
-				 errmsg("the table \"%s\" already has a trigger called \"%s\"",
-						table->target_name, "migrate_trigger"),
-				 errdetail(
-					 "The trigger was probably installed during a previous"
-					 " attempt to run halo_migrate on the table which was"
-					 " interrupted and for some reason failed to clean up"
-					 " the temporary objects.  Please drop the trigger or drop"
-					" and recreate the halo_migrate extension altogether"
-					 " to remove all the temporary objects left over.")));
-		goto cleanup;
-	}
-
-	CLEARPGRES(res);
+		if (index_memory > 0)
+		{
+			int64	need = index_mem_need_kb(job) - MIN_MAINTENANCE_WORK_MEM;
+			int64	share = mem_need > 0 ?
+				(int64) ((double) mem_free * need / mem_need) : 0;
 
-	command(table->create_pktype, 0, NULL);
-	temp_obj_num++;
-	command(table->create_log, 0, NULL);
-	temp_obj_num++;
-	command(table->create_trigger, 0, NULL);
-	temp_obj_num++;
-	command(table->enable_trigger, 0, NULL);
-	printfStringInfo(&sql, "SELECT migrate.disable_autovacuum('migrate.log_%u')", table->target_oid);
-	command(sql.data, 0, NULL);
+			job->mem_kb = MIN_MAINTENANCE_WORK_MEM + (int) Min(need, share);
+			index_mem_free_kb -= job->mem_kb;
+		}
 
-	/* While we are still holding an AccessExclusive lock on the table, submit
-	 * the request for an AccessShare lock asynchronously from conn2.
-	 * We want to submit this query in conn2 while connection's
-	 * transaction still holds its lock, so that no DDL may sneak in
-	 * between the time that connection commits and conn2 gets its lock.
-	 */
-	pgut_command(conn2, "BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+		if (index_parallel_workers >= 0 && workers_need > 0)
+		{
+			int		need = index_workers_need(job);
+			int		share = (int) ((double) workers_free * need / workers_need);
 
-	/* grab the backend PID of conn2; we'll need this when querying
-	 * pg_locks momentarily.
-	 */
-	res = pgut_execute(conn2, "SELECT pg_backend_pid()", 0, NULL);
-	buffer[0] = '\0';
-	strncat(buffer, PQgetvalue(res, 0, 0), sizeof(buffer) - 1);
-	elog(DEBUG2, "server PID of secondary connection: %s", buffer);
-	CLEARPGRES(res);
+			job->parallel_workers = Min(need, share);
+			index_workers_free -= job->parallel_workers;
+		}
 
-	/*
-	 * Not using lock_access_share() here since we know that
-	 * it's not possible to obtain the ACCESS SHARE lock right now
-	 * in conn2, since the primary connection holds ACCESS EXCLUSIVE.
-	 */
-	printfStringInfo(&sql, "LOCK TABLE %s IN ACCESS SHARE MODE",
-					 table->target_name);
-	elog(DEBUG2, "LOCK TABLE %s IN ACCESS SHARE MODE (secondary connection non blocking)", table->target_name);
-	if (PQsetnonblocking(conn2, 1))
-	{
-		elog(WARNING, "Unable to set conn2 nonblocking.");
-		goto cleanup;
+		elog(DEBUG2, "index #%d: maintenance_work_mem = %d kB, max_parallel_maintenance_workers = %d",
+			 i, job->mem_kb, job->parallel_workers);
 	}
-	if (!(PQsendQuery(conn2, sql.data)))
+}
+
+/* Give the budget of a finished index build back. */
+static void
+release_index_job(migrate_index *job)
+{
+	if (index_memory > 0)
+		index_mem_free_kb += job->mem_kb;
+	if (index_parallel_workers >= 0)
+		index_workers_free += job->parallel_workers;
+}
+
+/* Append the SET commands which apply the budget granted to 'job'. */
+static void
+index_job_settings(StringInfo sql, const migrate_index *job)
+{
+	if (index_memory > 0)
+		appendStringInfo(sql, "SET maintenance_work_mem = '%dkB'; ",
+						 job->mem_kb);
+	if (index_parallel_workers >= 0)
+		appendStringInfo(sql, "SET max_parallel_maintenance_workers = %d; ",
+						 job->parallel_workers);
+}
+
+/*
+ * Send the CREATE INDEX of index_jobs[job] to 'conn', preceded by the
+ * settings of its share of the budget. 'worker' is the number of conn in
+ * the worker pool, or -1 if it is the table's own connection.
+ */
+static bool
+assign_index_job(migrate_index *index_jobs, int job, PGconn *conn, int worker)
+{
+	StringInfoData	sql;
+
+	index_jobs[job].status = INPROGRESS;
+	index_jobs[job].worker_idx = worker;
+	index_jobs[job].conn = conn;
+	index_jobs[job].start_usec = pgut_monotonic_usec();
+	if (worker >= 0)
 	{
-		elog(WARNING, "Error sending async query: %s\n%s", sql.data,
-			 PQerrorMessage(conn2));
-		goto cleanup;
+		elog(LOG, "Assigning worker %d to build index #%d: %s",
+			 worker, job, index_jobs[job].create_index);
+		wait_profile_set(conn, "index", false);
 	}
+	else
+		elog(DEBUG2, "create_index : %s", index_jobs[job].create_index);
 
-	/* Now that we've submitted the LOCK TABLE request through conn2,
-	 * look for and cancel any (potentially dangerous) DDL commands which
-	 * might also be waiting on our table lock at this point --
-	 * it's not safe to let them wait, because they may grab their
-	 * AccessExclusive lock before conn2 gets its AccessShare lock,
-	 * and perform unsafe DDL on the table.
-	 *
-	 * Normally, lock_access_share() would take care of this for us,
-	 * but we're not able to use it here.
-	 */
-	if (!(kill_ddl(connection, table->target_oid, true)))
+	initStringInfo(&sql);
+	index_job_settings(&sql, &index_jobs[job]);
+	appendStringInfoString(&sql, index_jobs[job].create_index);
+
+	if (!(PQsendQuery(conn, sql.data)))
 	{
-		if (no_kill_backend)
-			elog(INFO, "Skipping migrate %s due to timeout.", table->target_name);
-		else
-			elog(WARNING, "kill_ddl() failed.");
-		goto cleanup;
+		elog(WARNING, "Error sending async query: %s\n%s",
+			 sql.data, PQerrorMessage(conn));
+		termStringInfo(&sql);
+		return false;
 	}
+	termStringInfo(&sql);
+	return true;
+}
 
-	/* We're finished killing off any unsafe DDL. COMMIT in our main
-	 * connection, so that conn2 may get its AccessShare lock.
-	 */
-	command("COMMIT", 0, NULL);
+/*
+ * Start index builds on every idle connection. Tables are served in the
+ * order they entered the pipeline, so that the oldest one gets to its swap
+ * first; the indexes of a table are already sorted most expensive first.
+ * Without a worker pool, each table builds its indexes one at a time on its
+ * own connection. Returns true if a table failed to start a build.
+ */
+static bool
+start_index_builds(migrate_table *tables, int num_tables, bool *worker_busy)
+{
+	bool	failed = false;
+	bool	pool_idle = true;
+	int		i;
+	int		k;
 
-	/* The main connection has now committed its migrate_trigger,
-	 * log table, and temp. table. If any error occurs from this point
-	 * on and we bail out, we should try to clean those up.
+	/* The pool outlives each table; replace workers that broke since,
+	 * which is only safe while none of them is in use.
 	 */
-	table_init = true;
+	for (k = 0; k < workers.num_workers; k++)
+		if (worker_busy[k])
+			pool_idle = false;
+	if (workers.num_workers > 0 && pool_idle)
+		check_workers();
 
-	/* Keep looping PQgetResult() calls until it returns NULL, indicating the
-	 * command is done and we have obtained our lock.
-	 */
-	while ((res = PQgetResult(conn2)))
+	for (i = 0; i < num_tables; i++)
 	{
-		elog(DEBUG2, "Waiting on ACCESS SHARE lock (secondary connection)...");
-		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		migrate_table  *table = &tables[i];
+		int				idle = 0;
+		int				count;
+
+		if (table->phase != TABLE_INDEXING ||
+			table->next_index >= table->n_indexes)
+			continue;
+
+		if (workers.num_workers == 0)
 		{
-			elog(WARNING, "Error with LOCK TABLE: %s", PQerrorMessage(conn2));
-			goto cleanup;
-		}
-		CLEARPGRES(res);
-	}
+			if (table->running_indexes > 0 || index_mem_slots() == 0)
+				continue;
 
-	/* Turn conn2 back into blocking mode for further non-async use. */
-	if (PQsetnonblocking(conn2, 0))
-	{
-		elog(WARNING, "Unable to set conn2 blocking.");
-		goto cleanup;
-	}
+			budget_index_jobs(table->indexes, table->next_index, 1);
+			table->running_indexes++;
+			table->max_running_indexes = 1;
+			if (!assign_index_job(table->indexes, table->next_index++,
+								  table->conn, -1))
+			{
+				table->phase = TABLE_FAILED;
+				failed = true;
+			}
+			continue;
+		}
 
-	/*
-	 * 2. Copy tuples into temp log table.
-	 */
-	elog(DEBUG2, "---- copy tuples ----");
+		for (k = 0; k < workers.num_workers; k++)
+			if (!worker_busy[k] && PQstatus(workers.conns[k]) == CONNECTION_OK)
+				idle++;
+		if (idle == 0)
+			break;
 
-	/* Must use SERIALIZABLE (or at least not READ COMMITTED) to avoid race
-	 * condition between the create_table statement and rows subsequently
-	 * being added to the log.
-	 */
-	command("BEGIN ISOLATION LEVEL SERIALIZABLE", 0, NULL);
-	/* SET work_mem = maintenance_work_mem */
-	command("SELECT set_config('work_mem', current_setting('maintenance_work_mem'), true)", 0, NULL);
-	if (orderby && !orderby[0])
-		command("SET LOCAL synchronize_seqscans = off", 0, NULL);
+		count = Min(Min(idle, index_mem_slots()),
+					table->n_indexes - table->next_index);
+		if (count == 0)
+			break;
+		budget_index_jobs(table->indexes, table->next_index, count);
+		for (k = 0; count > 0; k++)
+		{
+			if (worker_busy[k] || PQstatus(workers.conns[k]) != CONNECTION_OK)
+				continue;
 
-	/* Fetch an array of Virtual IDs of all transactions active right now.
-	 */
-	params[0] = buffer; /* backend PID of conn2 */
-	params[1] = PROGRAM_NAME;
-	res = execute(SQL_XID_SNAPSHOT, 2, params);
-	vxid = pgut_strdup(PQgetvalue(res, 0, 0));
+			worker_busy[k] = true;
+			table->running_indexes++;
+			count--;
+			if (!assign_index_job(table->indexes, table->next_index++,
+								  workers.conns[k], k))
+			{
+				/* Give back the budget of the builds not started */
+				while (count-- > 0)
+					release_index_job(&table->indexes[table->next_index + count]);
+				table->phase = TABLE_FAILED;
+				failed = true;
+				break;
+			}
+		}
+		table->max_running_indexes = Max(table->max_running_indexes,
+										 table->running_indexes);
+	}
 
-	CLEARPGRES(res);
+	return failed;
+}
 
-	/* Delete any existing entries in the log table now, since we have not
-	 * yet run the CREATE TABLE ... AS SELECT, which will take in all existing
-	 * rows from the target table; if we also included prior rows from the
-	 * log we could wind up with duplicates.
-	 */
-	command(table->delete_log, 0, NULL);
+/*
+ * Collect the index builds of 'table' which have finished. Returns false if
+ * one of them failed.
+ */
+static bool
+collect_index_builds(migrate_table *table, bool *worker_busy)
+{
+	PGresult	   *res;
+	char			name[32];
+	int				i;
 
-	/* We need to be able to obtain an AccessShare lock on the target table
-	 * for the create_table command to go through, so go ahead and obtain
-	 * the lock explicitly.
-	 *
-	 * Since conn2 has been diligently holding its AccessShare lock, it
-	 * is possible that another transaction has been waiting to acquire
-	 * an AccessExclusive lock on the table (e.g. a concurrent ALTER TABLE
-	 * or TRUNCATE which we must not allow). If there are any such
-	 * transactions, lock_access_share() will kill them so that our
-	 * CREATE TABLE ... AS SELECT does not deadlock waiting for an
-	 * AccessShare lock.
-	 */
-	if (!(lock_access_share(connection, table->target_oid, table->target_name)))
-		goto cleanup;
+	for (i = 0; i < table->n_indexes; i++)
+	{
+		migrate_index  *job = &table->indexes[i];
+		bool			ok = true;
 
-	/*
-	 * Create the new table and apply alter statement
-	 */
-	elog(DEBUG2, "---- create temp table ----");
-	command(create_table, 0, NULL);
+		if (job->status != INPROGRESS)
+			continue;
 
-	if (!(apply_alter_statement(connection, table->target_oid, alter_list.head->val)))
-		goto cleanup;
+		/* Must call PQconsumeInput before we can check PQisBusy */
+		if (PQconsumeInput(job->conn) != 1)
+		{
+			elog(WARNING, "Error fetching async query status: %s",
+				 PQerrorMessage(job->conn));
+			return false;
+		}
+		if (PQisBusy(job->conn))
+			continue;
 
-	/* apply alter column statemnts (if any) */
-	resetStringInfo(&sql);
-    printfStringInfo(&sql,
-            "SELECT"
-            "    c.relname,"
-            "    a.attname as column,"
-            "    array_to_string(a.attoptions, ', ') as attoptions"
-            " FROM"
-            "    pg_class c"
-            "    INNER JOIN pg_attribute a"
-            "        ON c.oid = a.attrelid  "
-            "    LEFT JOIN pg_namespace n "
-            "        ON n.oid = c.relnamespace "
-            " WHERE"
-            "    attnum > 0 AND N.nspname = '%s' AND c.relname = '%s' AND array_length(a.attoptions, 1) > 0"
-            " ORDER BY"
-            "    c.relname,"
-            "    a.attname",
-            schema, table_without_namespace);
-    elog(DEBUG2, "--- %s", sql.data);
-    res = execute(sql.data, 0, NULL);
-	for (j = 0; j < PQntuples(res); j++)
-	{
-		char *col = getstr(res, j, 1);
-		char *options = getstr(res, j, 2);
+		/* Read every result, so that the connection can be reused */
+		while ((res = PQgetResult(job->conn)))
+		{
+			if (PQresultStatus(res) != PGRES_COMMAND_OK && ok)
+			{
+				elog(WARNING, "Error with create index: %s",
+					 PQerrorMessage(job->conn));
+				ok = false;
+			}
+			CLEARPGRES(res);
+		}
 
-		resetStringInfo(&sql);
-		printfStringInfo(&sql,
-			"ALTER TABLE migrate.table_%u ALTER %s SET (%s)",
-			table->target_oid, col, options);
-		command(sql.data, 0, NULL);
+		job->status = FINISHED;
+		job->duration_usec = pgut_monotonic_usec() - job->start_usec;
+		snprintf(name, sizeof(name), "index %u", job->target_oid);
+		timeline_add(table, name, job->start_usec,
+					 job->start_usec + job->duration_usec, job->size);
+		release_index_job(job);
+		table->running_indexes--;
+		report_progress(table, "index");
+		if (job->worker_idx >= 0)
+		{
+			worker_busy[job->worker_idx] = false;
+			elog(LOG, "Command finished in worker %d: %s",
+				 job->worker_idx, job->create_index);
+		}
+
+		if (!ok)
+			return false;
 	}
-	CLEARPGRES(res);
 
-	/*
-	 * Before copying data to the target table, we need to set the column storage
-	 * type if its storage type has been changed from the type default.
-	 */
-	if (table->alter_col_storage)
-		command(table->alter_col_storage, 0, NULL);
+	return true;
+}
+
+/*
+ * Cancel the index builds of a failed table which are still running, and
+ * wait until their connections are idle again.
+ */
+static void
+abort_index_builds(migrate_table *table, bool *worker_busy)
+{
+	PGresult	   *res;
+	int				i;
 
+	for (i = 0; i < table->n_indexes; i++)
+	{
+		migrate_index  *job = &table->indexes[i];
+		PGcancel	   *cancel;
+		char			errbuf[256];
 
-	elog(DEBUG2, "---- copy data ----");
-	command(table->copy_data, 0, NULL);
-	temp_obj_num++;
+		if (job->status != INPROGRESS)
+			continue;
 
-	printfStringInfo(&sql, "SELECT migrate.disable_autovacuum('migrate.table_%u')", table->target_oid);
-	command(sql.data, 0, NULL);
-	/* Note: We don't add dropped columns to the temp table because we're not
-	 * swapping OIDs (the data doesn't need to match) */
-	command("COMMIT", 0, NULL);
+		cancel = PQgetCancel(job->conn);
+		if (cancel)
+		{
+			PQcancel(cancel, errbuf, sizeof(errbuf));
+			PQfreeCancel(cancel);
+		}
+		while ((res = PQgetResult(job->conn)))
+			CLEARPGRES(res);
 
-	/*
-	 * 3. Create indexes on temp table.
-	 */
-	elog(DEBUG2, "---- create indexes on temp table ----");
-	if (!rebuild_indexes(table))
-		goto cleanup;
+		job->status = UNPROCESSED;
+		release_index_job(job);
+		table->running_indexes--;
+		if (job->worker_idx >= 0)
+			worker_busy[job->worker_idx] = false;
+	}
+}
 
-	CLEARPGRES(res);
+/*
+ * All indexes of 'table' are built. Report how long each build took; with
+ * --jobs this is how to tell whether the makespan is bound by one huge
+ * index or by the schedule.
+ */
+static void
+index_builds_done(migrate_table *table)
+{
+	migrate_index  *index_jobs = table->indexes;
+	int64			total_usec = 0;
+	int				elevel;
+	int				i;
 
-	/*
-	 * 4. Apply log to temp table until no tuples are left in the log
-	 * and all of the old transactions are finished.
-	 */
-	elog(DEBUG2, "---- apply logs to temp table ----");
-	for (;;)
+	elevel = (workers.num_workers > 0 ? LOG : DEBUG2);
+	for (i = 0; i < table->n_indexes; i++)
+	{
+		total_usec += index_jobs[i].duration_usec;
+		elog(elevel, "index build took %.3f s (%s, " INT64_FORMAT " bytes, %d kB, %d workers): %s",
+			 index_jobs[i].duration_usec / 1000000.0,
+			 index_jobs[i].amname ? index_jobs[i].amname : "?",
+			 index_jobs[i].size, index_jobs[i].mem_kb,
+			 index_jobs[i].parallel_workers, index_jobs[i].create_index);
+	}
+	if (table->n_indexes > 0)
+		elog(elevel, "built %d indexes in %.3f s using up to %d connections (sum of build times %.3f s)",
+			 table->n_indexes,
+			 (pgut_monotonic_usec() - table->index_start_usec) / 1000000.0,
+			 Max(table->max_running_indexes, 1), total_usec / 1000000.0);
+
+	/* The table's own connection keeps the budget settings otherwise */
+	if (workers.num_workers == 0 && table->n_indexes > 0)
 	{
-		num = apply_log(connection, table, APPLY_COUNT);
+		if (index_memory > 0)
+			pgut_command(table->conn, "RESET maintenance_work_mem", 0, NULL);
+		if (index_parallel_workers >= 0)
+			pgut_command(table->conn, "RESET max_parallel_maintenance_workers", 0, NULL);
+	}
+}
 
-		/* We'll keep applying tuples from the log table in batches
-		 * of APPLY_COUNT, until applying a batch of tuples
-		 * (via LIMIT) results in our having applied
-		 * MIN_TUPLES_BEFORE_SWITCH or fewer tuples. We don't want to
-		 * get stuck repetitively applying some small number of tuples
-		 * from the log table as inserts/updates/deletes may be
-		 * constantly coming into the original table.
-		 */
-		if (num > MIN_TUPLES_BEFORE_SWITCH)
-			continue;	/* there might be still some tuples, repeat. */
+/*
+ * Wait until one of the connections the pipeline is waiting on has
+ * something to read, or until 'wake_usec' on the monotonic clock if it is
+ * not negative.
+ */
+static void
+wait_for_tables(migrate_table *tables, int num_tables, int64 wake_usec)
+{
+	fd_set			mask;
+	struct timeval	timeout;
+	int64			wait_usec;
+	int				maxsock = -1;
+	int				i;
+	int				j;
 
-		/* old transactions still alive ? */
-		params[0] = vxid;
-		res = execute(SQL_XID_ALIVE, 1, params);
-		num = PQntuples(res);
+	FD_ZERO(&mask);
+	for (i = 0; i < num_tables; i++)
+	{
+		migrate_table  *table = &tables[i];
+		int				sock;
 
-		if (num > 0)
+		if (table->phase == TABLE_COPYING)
 		{
-			/* Wait for old transactions.
-			 * Only display this message if we are NOT
-			 * running under pg_regress, so as not to cause
-			 * noise which would trip up pg_regress.
-			 */
-
-			if (!appname || strcmp(appname, "pg_regress") != 0)
+			sock = PQsocket(table->conn);
+			FD_SET(sock, &mask);
+			maxsock = Max(maxsock, sock);
+		}
+		else if (table->phase == TABLE_INDEXING)
+		{
+			for (j = 0; j < table->n_indexes; j++)
 			{
-				elog(NOTICE, "Waiting for %d transactions to finish. First PID: %s", num, PQgetvalue(res, 0, 0));
+				if (table->indexes[j].status != INPROGRESS)
+					continue;
+				sock = PQsocket(table->indexes[j].conn);
+				FD_SET(sock, &mask);
+				maxsock = Max(maxsock, sock);
 			}
-
-			CLEARPGRES(res);
-			sleep(1);
-			continue;
 		}
-		else
+	}
+
+	if (wake_usec >= 0)
+		wait_usec = Max(wake_usec - pgut_monotonic_usec(), 0);
+	else
+		wait_usec = POLL_TIMEOUT * INT64CONST(1000000);
+
+	if (maxsock < 0)
+	{
+		/* only tables waiting for old transactions or for --copy-rate */
+		usleep((useconds_t) Min(wait_usec, INT64CONST(1000000)));
+		return;
+	}
+
+	timeout.tv_sec = (long) (wait_usec / 1000000);
+	timeout.tv_usec = (long) (wait_usec % 1000000);
+	wait_for_sockets(maxsock + 1, &mask, &timeout);
+}
+
+/*
+ * qsort comparator: cold tables, without row changes since their last
+ * analyze (typically historical partitions), biggest first; then the hot
+ * ones, the busiest last; then by name.
+ */
+static int
+table_size_cmp(const void *a, const void *b)
+{
+	const migrate_table *ta = (const migrate_table *) a;
+	const migrate_table *tb = (const migrate_table *) b;
+
+	if ((ta->changes > 0) != (tb->changes > 0))
+		return (ta->changes > 0) ? 1 : -1;
+	if (ta->changes != tb->changes)
+		return (ta->changes < tb->changes) ? -1 : 1;
+	if (ta->relsize != tb->relsize)
+		return (ta->relsize > tb->relsize) ? -1 : 1;
+	return strcmp(ta->target_name, tb->target_name);
+}
+
+/*
+ * Migrate 'tables' in a pipeline of at most --tables-in-flight tables. Each
+ * table in flight has a connection pair of its own, so that the setup and
+ * copy of the next tables run while the earlier ones build their indexes
+ * and catch up with their logs. Index builds of all tables share the
+ * worker pool.
+ *
+ * With more than one table in flight, or partitions among the tables, the
+ * cold tables start first, biggest first so that the small ones fill in
+ * behind them, and the hot ones last (see table_size_cmp()). --max-connections caps the
+ * connection pairs together with the index workers, --max-copies the
+ * copies running at once, and --copy-rate spaces out the copy starts: a
+ * table starts its copy only once the bytes of the copies before it have
+ * been paid for at that rate. A copy, once started, is not throttled.
+ */
+static void
+migrate_tables(migrate_table *tables, int num_tables, const char *orderby,
+			   char *errbuf, size_t errsize)
+{
+	PGconn		  **slot_conn;
+	PGconn		  **slot_conn2;
+	bool		   *slot_used;
+	bool		   *worker_busy;
+	int				num_slots;
+	int				next_table = 0;
+	int				in_flight = 0;
+	int				copying = 0;
+	int64			next_copy_usec = 0;
+	int				i;
+
+	if (num_tables == 0)
+		return;
+
+	for (i = 0; i < num_tables && !tables[i].part_parent; i++)
+		;
+	if (tables_in_flight > 1 || i < num_tables)
+		qsort(tables, num_tables, sizeof(migrate_table), table_size_cmp);
+
+	/* Slot 0 is the primary connection pair; the others are opened now
+	 * and reused by the following tables.
+	 */
+	num_slots = Min(Max(tables_in_flight, 1), num_tables);
+	if (max_connections > 0 &&
+		num_slots * 2 + workers.num_workers + (wait_profile ? 2 : 1) > max_connections)
+	{
+		num_slots = Max((max_connections - workers.num_workers - (wait_profile ? 2 : 1)) / 2, 1);
+		elog(NOTICE, "--max-connections=%d allows %d tables in flight with %d index workers",
+			 max_connections, num_slots, workers.num_workers);
+	}
+	slot_conn = pgut_newarray(PGconn *, num_slots);
+	slot_conn2 = pgut_newarray(PGconn *, num_slots);
+	slot_used = pgut_newarray(bool, num_slots);
+	slot_conn[0] = connection;
+	slot_conn2[0] = conn2;
+	for (i = 1; i < num_slots; i++)
+	{
+		slot_conn[i] = open_connection(WARNING);
+		slot_conn2[i] = slot_conn[i] ? open_connection(WARNING) : NULL;
+		if (slot_conn2[i] == NULL)
 		{
-			/* All old transactions are finished;
-			 * go to next step. */
-			CLEARPGRES(res);
+			pgut_disconnect(slot_conn[i]);
+			elog(WARNING, "migrating %d tables at a time instead of %d",
+				 i, tables_in_flight);
 			break;
 		}
 	}
+	num_slots = i;
+	memset(slot_used, 0, sizeof(bool) * num_slots);
 
-    /*
-     * Get primary and foreign keys for the table before we block access.
-     */
-	elog(DEBUG2, "---- pre-swap: migrate foreign keys, add primary key ----");
-
-    /* Find name of migrated index to back the primary key to avoid a duplicate index for the primary key */
-    resetStringInfo(&sql);
-    printfStringInfo(&sql,
-            "SELECT"
-            "       pg_get_indexdef(i.oid) AS indexdef,"
-            "       i.relname AS indexname"
-            " FROM pg_index x"
-            " JOIN pg_class c ON c.oid = x.indrelid"
-            " JOIN pg_class i ON i.oid = x.indexrelid"
-            " LEFT JOIN pg_namespace n ON n.oid = c.relnamespace"
-            " LEFT JOIN pg_tablespace t ON t.oid = i.reltablespace"
-            " WHERE (c.relkind = ANY (ARRAY['r'::\"char\", 'm'::\"char\"])) AND i.relkind = 'i'::\"char\" and n.nspname = '%s' and c.relname = '%s' and indisprimary = 't'",
-            schema, table_without_namespace);
-    elog(DEBUG2, "--- %s", sql.data);
-    res = execute_elevel(sql.data, 0, NULL, DEBUG2);
-    /* on error bail */
-    if (PQresultStatus(res) != PGRES_TUPLES_OK)
-    {
-            /* Return the error message otherwise */
-            if (errbuf)
-                    snprintf(errbuf, errsize, "%s", PQerrorMessage(connection));
-            goto cleanup;
-    }
-    
-    primary_key = PQntuples(res);
+	/* one more connection publishes migrate.progress, outside of the
+	 * transactions of the tables
+	 */
+	if (execute_allowed)
+	{
+		progress_conn = open_connection(DEBUG2);
+		wait_profile_start();
+	}
 
-    if (primary_key > 0) {
-	    IndexDef		stmt;
+	worker_busy = pgut_newarray(bool, Max(workers.max_num_workers, 1));
+	memset(worker_busy, 0, sizeof(bool) * Max(workers.max_num_workers, 1));
 
-	    original_primary_key_def = getstr(res, 0, 0);
-	    original_primary_key_name = getstr(res, 0, 1);
-	    CLEARPGRES(res);
-	    elog(DEBUG2, "original_primary_key_def  :  %s", original_primary_key_def);
-	    elog(DEBUG2, "original_primary_key_name  :  %s", original_primary_key_name);
+	index_mem_free_kb = index_memory * 1024;
+	index_workers_free = index_parallel_workers;
 
-		parse_indexdef(&stmt, strdup(original_primary_key_def), original_primary_key_name, table->target_name);
-		/* iterate through indexes and see which one
-		 * matches the original_primary_key_def */
-		for (j = 0; j < table->n_indexes; j++)
+	for (;;)
+	{
+		bool	progress = false;
+		int64	wake_usec = -1;
+		int64	now;
+		int		wait_ms;
+
+		copying = 0;
+		for (i = 0; i < next_table; i++)
+			copying += (tables[i].phase == TABLE_COPYING);
+
+		/* Start tables while there is room in the pipeline. */
+		now = pgut_monotonic_usec();
+		while (next_table < num_tables && in_flight < num_slots)
 		{
-			StringInfoData	index_sql;
-			const char *original_create_index = NULL;
+			migrate_table  *table = &tables[next_table];
 
-			initStringInfo(&index_sql);
-			printfStringInfo(&index_sql, "ON migrate.table_%u USING %s (%s)%s",
-				table->target_oid, stmt.type, stmt.columns, stmt.options);
-			original_create_index = strdup(table->indexes[j].create_index);
-			if (strpos(original_create_index, index_sql.data) >= 0)
+			if (max_copies > 0 && copying >= max_copies)
+				break;
+			if (copy_rate > 0 && now < next_copy_usec)
 			{
-				resetStringInfo(&index_sql);
-				printfStringInfo(&index_sql, "%s_%s", stmt.index, table->indexes[j].hash);
-				backing_index_name = index_sql.data;
+				wake_usec = next_copy_usec;
 				break;
 			}
+			next_table++;
+
+			for (i = 0; slot_used[i]; i++)
+				;
+			table->slot = i;
+			table->conn = slot_conn[i];
+			table->conn2 = slot_conn2[i];
+			if (migrate_table_start(table, orderby))
+			{
+				slot_used[i] = true;
+				in_flight++;
+				copying++;
+				/* bytes / (MB/s) is 1.048576 microseconds per byte and MB/s */
+				if (copy_rate > 0)
+					next_copy_usec = Max(next_copy_usec, now) +
+						(int64) (table->relsize / (copy_rate * 1.048576));
+			}
 		}
 
-		if (backing_index_name == NULL)
+		if (in_flight == 0 && next_table == num_tables)
+			break;
+
+		now = pgut_monotonic_usec();
+		for (i = 0; i < next_table; i++)
 		{
-			elog(DEBUG2, "aborting, couldn't determine migrated primary key");
-			goto cleanup;
-		}
-	}
+			migrate_table  *table = &tables[i];
 
-	/* don't clear indexes until after done accessing table->indexes or memory corrupts */
-	CLEARPGRES(indexres);
+			switch (table->phase)
+			{
+				case TABLE_COPYING:
+					/* Must call PQconsumeInput before we can check PQisBusy */
+					if (PQconsumeInput(table->conn) != 1)
+					{
+						elog(WARNING, "Error fetching async query status: %s",
+							 PQerrorMessage(table->conn));
+						table->phase = TABLE_FAILED;
+					}
+					else if (!PQisBusy(table->conn) &&
+							 !migrate_table_copied(table))
+						table->phase = TABLE_FAILED;
+					progress |= (table->phase != TABLE_COPYING);
+					break;
 
-	/* Find existing foreign keys. */
-	resetStringInfo(&sql);
-	printfStringInfo(&sql,
-		"SELECT"
-		"    tc.table_schema,"
-		"    tc.constraint_name,"
-		"    tc.table_name,"
-		"    kcu.column_name,"
-		"    ccu.table_schema AS foreign_table_schema,"
-		"    ccu.table_name AS foreign_table_name,"
-		"    ccu.column_name AS foreign_column_name,"
-		"    left(md5(ccu.table_schema || '.' || ccu.table_name), 5)"
-		" FROM"
-		"    information_schema.table_constraints AS tc"
-		"    JOIN information_schema.key_column_usage AS kcu"
-		"      ON tc.constraint_name = kcu.constraint_name"
-		"      AND tc.table_schema = kcu.table_schema"
-		"    JOIN information_schema.constraint_column_usage AS ccu"
-		"      ON ccu.constraint_name = tc.constraint_name"
-		"      AND ccu.table_schema = tc.table_schema"
-		" WHERE tc.constraint_type = 'FOREIGN KEY' AND ccu.table_name ='%s' and ccu.table_schema = '%s'",
-		table_without_namespace, schema);
-	elog(DEBUG2, "--- %s", sql.data);
-	res = execute_elevel(sql.data, 0, NULL, DEBUG2);
+				case TABLE_INDEXING:
+					if (!collect_index_builds(table, worker_busy))
+						table->phase = TABLE_FAILED;
+					else if (table->next_index == table->n_indexes &&
+							 table->running_indexes == 0)
+					{
+						index_builds_done(table);
+						timeline_end(table, "index builds", -1, -1);
+						elog(DEBUG2, "---- apply logs to temp table ----");
+						table->phase = TABLE_APPLYING;
+						report_progress(table, "catch-up");
+					}
+					progress |= (table->phase != TABLE_INDEXING);
+					break;
 
-	/* on error bail */
-	if (PQresultStatus(res) != PGRES_TUPLES_OK)
-	{
-		/* Return the error message otherwise */
-		if (errbuf)
-			snprintf(errbuf, errsize, "%s", PQerrorMessage(connection));
-		goto cleanup;
-	}
+				case TABLE_APPLYING:
+					if (now < table->next_apply_usec)
+					{
+						if (wake_usec < 0 || table->next_apply_usec < wake_usec)
+							wake_usec = table->next_apply_usec;
+						break;
+					}
+					/* wait less for old transactions when others need serving */
+					wait_ms = (in_flight > 1 ? 100 : 1000);
+					if (!migrate_table_catch_up(table, wait_ms) || !swap_allowed(table))
+					{
+						/* keep applying and check again in a second */
+						table->next_apply_usec = pgut_monotonic_usec() +
+							(1000 - wait_ms) * INT64CONST(1000);
+						if (wake_usec < 0 || table->next_apply_usec < wake_usec)
+							wake_usec = table->next_apply_usec;
+						break;
+					}
+					migrate_table_finish(table,
+										 migrate_table_swap(table, errbuf, errsize));
+					slot_used[table->slot] = false;
+					in_flight--;
+					progress = true;
+					break;
 
-	num = PQntuples(res);
+				case TABLE_FAILED:
+					abort_index_builds(table, worker_busy);
+					migrate_table_finish(table, false);
+					slot_used[table->slot] = false;
+					in_flight--;
+					progress = true;
+					break;
 
-	/*
-	 * Rebuild foreign keys so that they point to the new table.
+				default:
+					break;
+			}
+		}
+
+		progress |= start_index_builds(tables, next_table, worker_busy);
+
+		if (!progress)
+			wait_for_tables(tables, next_table, wake_usec);
+	}
+
+	for (i = 1; i < num_slots; i++)
+	{
+		pgut_disconnect(slot_conn[i]);
+		pgut_disconnect(slot_conn2[i]);
+	}
+	wait_profile_stop();
+	if (progress_conn)
+		pgut_disconnect(progress_conn);
+	progress_conn = NULL;
+	free(slot_conn);
+	free(slot_conn2);
+	free(slot_used);
+	free(worker_busy);
+}
+
+
+/*
+ * Start migrating one table: install the trigger and the log table, then
+ * send the copy of the existing rows, which runs asynchronously on
+ * table->conn. This, migrate_table_copied(), migrate_table_catch_up() and
+ * migrate_table_swap() contain the key logic. See this blog for a walk
+ * through:
+ * https://www.percona.com/blog/2021/06/24/understanding-pg_repack-what-can-go-wrong-and-how-to-avoid-it/
+ *
+ * Returns false if the table was skipped, failed, or altered in place
+ * without a copy; it has been cleaned up already then.
+ */
+static bool
+migrate_table_start(migrate_table *table, const char *orderby)
+{
+	PGconn		   *conn = table->conn;
+	PGconn		   *conn2 = table->conn2;
+	PGresult	   *res = NULL;
+	const char	   *params[3];
+	char			buffer[12];
+	StringInfoData	sql;
+	const char     *indexparams[3];
+	const char	   *create_table = NULL;
+	char		    indexbuffer[12];
+	char		   *own_pids;
+	int             j;
+	char           *tmp_target_name;
+	lock_window		lw;
+	int				attempts = 0;
+
+	initStringInfo(&sql);
+	table->start_usec = pgut_monotonic_usec();
+	table->start_time = time(NULL);
+	table->rows_copied = -1;
+
+	tmp_target_name = pgut_strdup(table->target_name);
+	table->schema = strtok(tmp_target_name, ".");
+	table->table_without_namespace = strtok(NULL, ".");
+
+	/* Use a different create table statement that includes null restrictions and
+	 * defaults. */
+	printfStringInfo(&sql, "%s%s;", table->create_table_def, table->tablespace);
+	create_table = pgut_strdup(sql.data);
+
+	elog(INFO, "migrating table \"%s\"", table->target_name);
+
+	elog(DEBUG2, "---- migrate_table_start ----");
+	elog(DEBUG2, "target_name       : %s", table->target_name);
+	elog(DEBUG2, "target_oid        : %u", table->target_oid);
+	elog(DEBUG2, "target_toast      : %u", table->target_toast);
+	elog(DEBUG2, "target_tidx       : %u", table->target_tidx);
+	elog(DEBUG2, "pkid              : %u", table->pkid);
+	elog(DEBUG2, "ckid              : %u", table->ckid);
+	elog(DEBUG2, "create_pktype     : %s", table->create_pktype);
+	elog(DEBUG2, "create_log        : %s", table->create_log);
+	elog(DEBUG2, "create_trigger    : %s", table->create_trigger);
+	elog(DEBUG2, "enable_trigger    : %s", table->enable_trigger);
+	elog(DEBUG2, "create_table      : %s", create_table);
+	elog(DEBUG2, "copy_data         : %s", table->copy_data);
+	elog(DEBUG2, "alter_col_storage : %s", table->alter_col_storage ?
+		 table->alter_col_storage : "(skipped)");
+	elog(DEBUG2, "drop_columns      : %s", table->drop_columns ? table->drop_columns : "(skipped)");
+	elog(DEBUG2, "delete_log        : %s", table->delete_log);
+	elog(DEBUG2, "lock_table        : %s", table->lock_table);
+	elog(DEBUG2, "sql_peek          : %s", table->sql_peek);
+	elog(DEBUG2, "sql_insert        : %s", table->sql_insert);
+	elog(DEBUG2, "sql_delete        : %s", table->sql_delete);
+	elog(DEBUG2, "sql_update        : %s", table->sql_update);
+	elog(DEBUG2, "sql_pop           : %s", table->sql_pop);
+
+	if (!execute_allowed)
+	{
+		estimate_table(table, create_table);
+		goto cleanup;
+	}
+
+	/* Changes PostgreSQL makes in the catalogs alone need no copy */
+	if (alter_actions && !tablespace && !always_copy && !alter_may_scan(alter_actions))
+	{
+		switch (alter_in_place(table))
+		{
+			case 1:
+				migrate_table_finish(table, true);
+				termStringInfo(&sql);
+				free((char *) create_table);
+				return false;
+			case -1:
+				goto cleanup;
+			default:
+				break;
+		}
+	}
+
+	/* push migrate_cleanup_callback() on stack to clean temporary objects */
+	pgut_atexit_push(migrate_cleanup_callback, table);
+
+	/*
+	 * 1. Setup advisory lock and trigger on main table.
+	 */
+	elog(DEBUG2, "---- setup triggers ----");
+
+	params[0] = utoa(table->target_oid, buffer);
+
+	if (!advisory_lock(conn, buffer))
+		goto cleanup;
+
+	/*
+	 * pg_get_indexdef only needs the catalogs, so collect the index
+	 * definitions before we take the AccessExclusive lock, and under the
+	 * lock merely check that nobody changed the indexes in between.
+	 */
+	elog(DEBUG2, "---- find indexes ----");
+
+	indexparams[0] = utoa(table->target_oid, indexbuffer);
+	indexparams[1] = tablespace != NULL ? tablespace : NULL;
+	indexparams[2] = table->target_name;
+
+	/* First, just display a warning message for any invalid indexes
+	 * which may be on the table (mostly to match the behavior of 1.1.8).
+	 */
+	res = pgut_execute(conn,
+		"SELECT pg_get_indexdef(indexrelid)"
+		" FROM pg_index WHERE indrelid = $1 AND NOT indisvalid",
+		1, indexparams);
+
+	for (j = 0; j < PQntuples(res); j++)
+	{
+		const char *indexdef;
+		indexdef = getstr(res, j, 0);
+		elog(WARNING, "skipping invalid index: %s", indexdef);
+	}
+	CLEARPGRES(res);
+
+	fetch_indexes(table, indexparams);
+
+	report_progress(table, "setup");
+
+setup:
+	timeline_begin(table, "setup lock", true);
+	if (!(lock_exclusive(conn, conn2, buffer, true)))
+	{
+		if (no_kill_backend)
+			elog(INFO, "Skipping migrate %s due to timeout", table->target_name);
+		else
+			elog(WARNING, "lock_exclusive() failed for %s", table->target_name);
+		goto cleanup;
+	}
+	table->lock_wait_usec += lock_waited_usec;
+	lock_window_begin(&lw, "setup");
+
+	res = pgut_execute(conn, SQL_INDEX_OIDS, 1, indexparams);
+	if (strcmp(getstr(res, 0, 0), table->index_oids) != 0)
+	{
+		elog(DEBUG2, "indexes changed before the lock, fetching them again");
+		fetch_indexes(table, indexparams);
+	}
+	CLEARPGRES(res);
+	lock_window_step(&lw, "check indexes");
+
+	/*
+	 * Check if migrate_trigger is not conflict with existing trigger. We can
+	 * find it out later but we check it in advance and go to cleanup if needed.
+	 * In AFTER trigger context, since triggered tuple is not changed by other
+	 * trigger we don't care about the fire order.
+	 */
+	res = pgut_execute(conn, "SELECT migrate.conflicted_triggers($1)", 1, params);
+	if (PQntuples(res) > 0)
+	{
+		ereport(WARNING,
+				(errcode(E_PG_COMMAND),
+				 errmsg("the table \"%s\" already has a trigger called \"%s\"",
+						table->target_name, "migrate_trigger"),
+				 errdetail(
+					 "The trigger was probably installed during a previous"
+					 " attempt to run halo_migrate on the table which was"
+					 " interrupted and for some reason failed to clean up"
+					 " the temporary objects.  Please drop the trigger or drop"
+					" and recreate the halo_migrate extension altogether"
+					 " to remove all the temporary objects left over.")));
+		goto cleanup;
+	}
+
+	CLEARPGRES(res);
+	lock_window_step(&lw, "check triggers");
+
+	pgut_command(conn, table->create_pktype, 0, NULL);
+	table->temp_obj_num++;
+	pgut_command(conn, table->create_log, 0, NULL);
+	table->temp_obj_num++;
+	pgut_command(conn, table->create_trigger, 0, NULL);
+	table->temp_obj_num++;
+	pgut_command(conn, table->enable_trigger, 0, NULL);
+	printfStringInfo(&sql, "SELECT migrate.disable_autovacuum('migrate.log_%u')", table->target_oid);
+	pgut_command(conn, sql.data, 0, NULL);
+	lock_window_step(&lw, "create trigger and log");
+
+	/* While we are still holding an AccessExclusive lock on the table, submit
+	 * the request for an AccessShare lock asynchronously from conn2.
+	 * We want to submit this query in conn2 while connection's
+	 * transaction still holds its lock, so that no DDL may sneak in
+	 * between the time that connection commits and conn2 gets its lock.
+	 */
+	pgut_command(conn2, "BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+
+	/* log the backend PID of conn2, to find it in pg_locks when debugging;
+	 * buffer keeps the table OID for a retry of the setup
+	 */
+	res = pgut_execute(conn2, "SELECT pg_backend_pid()", 0, NULL);
+	elog(DEBUG2, "server PID of secondary connection: %s", PQgetvalue(res, 0, 0));
+	CLEARPGRES(res);
+
+	/*
+	 * Not using lock_access_share() here since we know that
+	 * it's not possible to obtain the ACCESS SHARE lock right now
+	 * in conn2, since the primary connection holds ACCESS EXCLUSIVE.
+	 */
+	printfStringInfo(&sql, "LOCK TABLE %s IN ACCESS SHARE MODE",
+					 table->target_name);
+	elog(DEBUG2, "LOCK TABLE %s IN ACCESS SHARE MODE (secondary connection non blocking)", table->target_name);
+	if (PQsetnonblocking(conn2, 1))
+	{
+		elog(WARNING, "Unable to set conn2 nonblocking.");
+		goto cleanup;
+	}
+	if (!(PQsendQuery(conn2, sql.data)))
+	{
+		elog(WARNING, "Error sending async query: %s\n%s", sql.data,
+			 PQerrorMessage(conn2));
+		goto cleanup;
+	}
+	lock_window_step(&lw, "request share lock");
+
+	/* Now that we've submitted the LOCK TABLE request through conn2,
+	 * look for and cancel any (potentially dangerous) DDL commands which
+	 * might also be waiting on our table lock at this point --
+	 * it's not safe to let them wait, because they may grab their
+	 * AccessExclusive lock before conn2 gets its AccessShare lock,
+	 * and perform unsafe DDL on the table.
+	 *
+	 * Normally, lock_access_share() would take care of this for us,
+	 * but we're not able to use it here.
+	 */
+	if (!(kill_ddl(conn, conn2, table->target_oid, true)))
+	{
+		if (no_kill_backend)
+			elog(INFO, "Skipping migrate %s due to timeout.", table->target_name);
+		else
+			elog(WARNING, "kill_ddl() failed.");
+		goto cleanup;
+	}
+	lock_window_step(&lw, "kill ddl");
+
+	/* Rather than overrun --lock-budget, undo everything, let conn2 have
+	 * its AccessShare lock in vain and start over.
+	 */
+	if (lock_window_over(&lw))
+	{
+		lock_window_end(&lw, table, false);
+		pgut_rollback(conn);
+		/* sampling the server takes a round trip, not under the lock */
+		timeline_end(table, "setup lock", -1, -1);
+		while ((res = PQgetResult(conn2)))
+			CLEARPGRES(res);
+		PQsetnonblocking(conn2, 0);
+		pgut_rollback(conn2);
+		table->temp_obj_num = 0;
+
+		if (++attempts < LOCK_BUDGET_ATTEMPTS)
+			goto setup;
+		elog(WARNING, "could not set up %s within --lock-budget in %d attempts",
+			 table->target_name, attempts);
+		goto cleanup;
+	}
+
+	/* We're finished killing off any unsafe DDL. COMMIT in our main
+	 * connection, so that conn2 may get its AccessShare lock.
+	 */
+	pgut_command(conn, "COMMIT", 0, NULL);
+	lock_window_step(&lw, "commit");
+	lock_window_end(&lw, table, true);
+	timeline_end(table, "setup lock", -1, -1);
+
+	/* The main connection has now committed its migrate_trigger,
+	 * log table, and temp. table. If any error occurs from this point
+	 * on and we bail out, we should try to clean those up.
+	 */
+	table->table_init = true;
+
+	/* Keep looping PQgetResult() calls until it returns NULL, indicating the
+	 * command is done and we have obtained our lock.
+	 */
+	while ((res = PQgetResult(conn2)))
+	{
+		elog(DEBUG2, "Waiting on ACCESS SHARE lock (secondary connection)...");
+		if (PQresultStatus(res) != PGRES_COMMAND_OK)
+		{
+			elog(WARNING, "Error with LOCK TABLE: %s", PQerrorMessage(conn2));
+			goto cleanup;
+		}
+		CLEARPGRES(res);
+	}
+
+	/* Turn conn2 back into blocking mode for further non-async use. */
+	if (PQsetnonblocking(conn2, 0))
+	{
+		elog(WARNING, "Unable to set conn2 blocking.");
+		goto cleanup;
+	}
+
+	/*
+	 * 2. Copy tuples into temp log table.
+	 */
+	elog(DEBUG2, "---- copy tuples ----");
+
+	/* Must use SERIALIZABLE (or at least not READ COMMITTED) to avoid race
+	 * condition between the create_table statement and rows subsequently
+	 * being added to the log.
+	 */
+	pgut_command(conn, "BEGIN ISOLATION LEVEL SERIALIZABLE", 0, NULL);
+	/* SET work_mem = maintenance_work_mem */
+	pgut_command(conn, "SELECT set_config('work_mem', current_setting('maintenance_work_mem'), true)", 0, NULL);
+	if (orderby && !orderby[0])
+		pgut_command(conn, "SET LOCAL synchronize_seqscans = off", 0, NULL);
+	/* a cold table is copied without waiting for the WAL flush at commit;
+	 * a crash would only lose the copy, which the cleanup drops anyway */
+	if (table->changes == 0)
+		pgut_command(conn, "SET LOCAL synchronous_commit = off", 0, NULL);
+
+	/* Fetch an array of Virtual IDs of all transactions active right now.
+	 */
+	own_pids = own_backend_pids();
+	params[0] = own_pids;
+	params[1] = PROGRAM_NAME;
+	res = pgut_execute(conn, SQL_XID_SNAPSHOT, 2, params);
+	table->vxid = pgut_strdup(PQgetvalue(res, 0, 0));
+	free(own_pids);
+
+	CLEARPGRES(res);
+
+	/* Delete any existing entries in the log table now, since we have not
+	 * yet run the CREATE TABLE ... AS SELECT, which will take in all existing
+	 * rows from the target table; if we also included prior rows from the
+	 * log we could wind up with duplicates.
+	 */
+	pgut_command(conn, table->delete_log, 0, NULL);
+
+	/* We need to be able to obtain an AccessShare lock on the target table
+	 * for the create_table command to go through, so go ahead and obtain
+	 * the lock explicitly.
+	 *
+	 * Since conn2 has been diligently holding its AccessShare lock, it
+	 * is possible that another transaction has been waiting to acquire
+	 * an AccessExclusive lock on the table (e.g. a concurrent ALTER TABLE
+	 * or TRUNCATE which we must not allow). If there are any such
+	 * transactions, lock_access_share() will kill them so that our
+	 * CREATE TABLE ... AS SELECT does not deadlock waiting for an
+	 * AccessShare lock.
+	 */
+	if (!(lock_access_share(conn, conn2, table->target_oid, table->target_name)))
+		goto cleanup;
+
+	/*
+	 * Create the new table and apply alter statement
+	 */
+	elog(DEBUG2, "---- create temp table ----");
+	pgut_command(conn, create_table, 0, NULL);
+
+	if (alter_actions &&
+		!(apply_alter_statement(conn, table->target_oid, alter_actions)))
+		goto cleanup;
+
+	/* A partition's rebuilt table is attached to the parent in its place,
+	 * so its columns must still match the parent's; and a constraint
+	 * implying the partition bound spares the attach a scan.
+	 */
+	if (table->part_parent)
+	{
+		printfStringInfo(&sql, SQL_PARTITION_MISMATCH,
+						 table->target_oid, table->part_parent);
+		res = pgut_execute(conn, sql.data, 0, NULL);
+		if (PQntuples(res) > 0)
+		{
+			elog(WARNING, "the alter statement changes column \"%s\" of partition %s, which must match its parent",
+				 getstr(res, 0, 0), table->target_name);
+			goto cleanup;
+		}
+		CLEARPGRES(res);
+
+		if (table->part_check)
+		{
+			printfStringInfo(&sql,
+				"ALTER TABLE migrate.table_%u ADD CONSTRAINT migrate_partition_check CHECK (%s)",
+				table->target_oid, table->part_check);
+			pgut_command(conn, sql.data, 0, NULL);
+		}
+	}
+
+	/* apply alter column statemnts (if any) */
+	if (table->alter_col_options)
+		pgut_command(conn, table->alter_col_options, 0, NULL);
+
+	/*
+	 * Before copying data to the target table, we need to set the column storage
+	 * type if its storage type has been changed from the type default.
+	 */
+	if (table->alter_col_storage)
+		pgut_command(conn, table->alter_col_storage, 0, NULL);
+
+
+	/* migrate.progress follows the copy by the size of the new table's
+	 * files; the table is not committed, so others cannot look it up.
+	 */
+	if (progress_conn)
+	{
+		printfStringInfo(&sql, "SELECT pg_relation_filepath('migrate.table_%u')",
+						 table->target_oid);
+		res = pgut_execute(conn, sql.data, 0, NULL);
+		table->copy_path = pgut_strdup(getstr(res, 0, 0));
+		CLEARPGRES(res);
+	}
+
+	/* The copy runs in the background; migrate_tables() notices when it
+	 * is done and calls migrate_table_copied().
+	 */
+	elog(DEBUG2, "---- copy data ----");
+	timeline_begin(table, "copy", false);
+	pgut_send(conn, table->copy_data, 0, NULL);
+	table->phase = TABLE_COPYING;
+	report_progress(table, "copy");
+
+	termStringInfo(&sql);
+	free((char *) create_table);
+	return true;
+
+cleanup:
+	CLEARPGRES(res);
+	termStringInfo(&sql);
+	if (create_table)
+		free((char *) create_table);
+	migrate_table_finish(table, false);
+	return false;
+}
+
+/*
+ * The initial copy of 'table' has finished: commit it, so that its indexes
+ * can be built.
+ */
+static bool
+migrate_table_copied(migrate_table *table)
+{
+	PGresult	   *res;
+	StringInfoData	sql;
+	bool			ok = true;
+
+	while ((res = PQgetResult(table->conn)))
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK && ok)
+		{
+			elog(WARNING, "Error copying data of \"%s\": %s",
+				 table->target_name, PQerrorMessage(table->conn));
+			ok = false;
+		}
+		else if (PQcmdTuples(res)[0] != '\0')
+			table->rows_copied = atoll(PQcmdTuples(res));
+		CLEARPGRES(res);
+	}
+	if (!ok)
+		return false;
+	timeline_end(table, "copy", table->rows_copied, table->relsize);
+	table->temp_obj_num++;
+
+	initStringInfo(&sql);
+	printfStringInfo(&sql, "SELECT migrate.disable_autovacuum('migrate.table_%u')", table->target_oid);
+	pgut_command(table->conn, sql.data, 0, NULL);
+	/* Note: We don't add dropped columns to the temp table because we're not
+	 * swapping OIDs (the data doesn't need to match) */
+	pgut_command(table->conn, "COMMIT", 0, NULL);
+	termStringInfo(&sql);
+
+	/*
+	 * 3. Create indexes on temp table.
+	 */
+	elog(DEBUG2, "---- create indexes on temp table ----");
+	table->index_start_usec = pgut_monotonic_usec();
+	table->phase = TABLE_INDEXING;
+	report_progress(table, "index");
+	timeline_begin(table, "index builds", false);
+	return true;
+}
+
+/*
+ * 4. Apply log to temp table until no tuples are left in the log
+ * and all of the old transactions are finished. Returns false if some old
+ * transactions are still alive after waiting wait_ms for them; the caller
+ * tries again a second later and serves the other tables in flight in the
+ * meantime.
+ */
+static bool
+migrate_table_catch_up(migrate_table *table, int wait_ms)
+{
+	PGresult	   *res;
+	const char	   *params[2];
+	char			buffer[12];
+	int				num;
+	int64			start_usec = pgut_monotonic_usec();
+	int64			applied = 0;
+
+	/* We'll keep applying tuples from the log table in batches
+	 * of APPLY_COUNT, until applying a batch of tuples
+	 * (via LIMIT) results in our having applied
+	 * MIN_TUPLES_BEFORE_SWITCH or fewer tuples. We don't want to
+	 * get stuck repetitively applying some small number of tuples
+	 * from the log table as inserts/updates/deletes may be
+	 * constantly coming into the original table.
+	 */
+	timeline_begin(table, "apply", true);
+	do
+	{
+		num = apply_log(table->conn, table, APPLY_COUNT);
+		applied += num;
+	} while (num > MIN_TUPLES_BEFORE_SWITCH);
+	table->rows_applied += applied;
+	table->apply_usec += pgut_monotonic_usec() - start_usec;
+	timeline_end(table, "apply", applied, -1);
+	report_progress(table, "catch-up");
+
+	/* old transactions still alive ? */
+	snprintf(buffer, sizeof(buffer), "%d", wait_ms);
+	params[0] = table->vxid;
+	params[1] = buffer;
+	timeline_begin(table, "vxid wait", true);
+	pgut_label = "XID_ALIVE";
+	res = pgut_execute(table->conn, SQL_XID_ALIVE, 2, params);
+	timeline_end(table, "vxid wait", -1, -1);
+	num = atoi(PQgetvalue(res, 0, 0));
+
+	if (num > 0)
+	{
+		/* Wait for old transactions.
+		 * Only display this message if we are NOT
+		 * running under pg_regress, so as not to cause
+		 * noise which would trip up pg_regress.
+		 */
+
+		if (!under_regress())
+		{
+			elog(NOTICE, "Waiting for %d transactions to finish. First PID: %s", num, PQgetvalue(res, 0, 1));
+		}
+
+		CLEARPGRES(res);
+		return false;
+	}
+
+	/* All old transactions are finished; go to next step. */
+	CLEARPGRES(res);
+	return true;
+}
+
+/* Sessions working on the table, and its row changes so far */
+#define SQL_SWAP_LOAD \
+	"SELECT (SELECT count(DISTINCT l.pid) FROM pg_locks l" \
+	"         JOIN pg_stat_activity a ON a.pid = l.pid" \
+	"        WHERE l.locktype = 'relation' AND l.relation = $1" \
+	"          AND (a.state = 'active' OR NOT l.granted)" \
+	"          AND l.pid <> ALL ($2::integer[]))," \
+	"       (SELECT n_tup_ins + n_tup_upd + n_tup_del" \
+	"          FROM pg_stat_user_tables WHERE relid = $1)"
+
+#define SWAP_HOLD_NONE		0
+#define SWAP_HOLD_WINDOW	1
+#define SWAP_HOLD_SESSIONS	2
+#define SWAP_HOLD_TPS		3
+
+/*
+ * Decide whether a caught-up table may be swapped now: we must be inside
+ * --swap-window, and the load on the table must be under --swap-max-sessions
+ * (sessions active on it or waiting for a lock on it) and --swap-max-tps
+ * (row changes per second, from pg_stat_user_tables deltas between two
+ * calls). Until then the caller keeps the table in catch-up, applying the
+ * log every second, so the swap is short whenever it comes.
+ */
+static bool
+swap_allowed(migrate_table *table)
+{
+	int			hold = SWAP_HOLD_NONE;
+	int64		load = 0;
+
+	if (swap_window)
+	{
+		time_t		now = time(NULL);
+		struct tm  *tm = localtime(&now);
+		int			minute = tm->tm_hour * 60 + tm->tm_min;
+
+		if (swap_window_start < swap_window_end ?
+			(minute < swap_window_start || minute >= swap_window_end) :
+			(minute < swap_window_start && minute >= swap_window_end))
+		{
+			hold = SWAP_HOLD_WINDOW;
+			table->load_usec = 0;	/* sample afresh once the window opens */
+		}
+	}
+
+	if (hold == SWAP_HOLD_NONE && (swap_max_sessions >= 0 || swap_max_tps >= 0))
+	{
+		PGresult   *res;
+		const char *params[2];
+		char		relid[12];
+		char		pids[64];
+		int64		now_usec = pgut_monotonic_usec();
+		int64		changes;
+
+		params[0] = utoa(table->target_oid, relid);
+		snprintf(pids, sizeof(pids), "{%d,%d}", PQbackendPID(table->conn),
+				 PQbackendPID(table->conn2));
+		params[1] = pids;
+		res = pgut_execute(table->conn, SQL_SWAP_LOAD, 2, params);
+		changes = PQgetisnull(res, 0, 1) ? 0 : atoll(getstr(res, 0, 1));
+
+		if (swap_max_sessions >= 0 && atoi(getstr(res, 0, 0)) > swap_max_sessions)
+		{
+			hold = SWAP_HOLD_SESSIONS;
+			load = atoi(getstr(res, 0, 0));
+		}
+		else if (swap_max_tps >= 0)
+		{
+			/* the first sample only sets the baseline */
+			if (table->load_usec == 0)
+				hold = SWAP_HOLD_TPS;
+			else
+			{
+				load = (changes - table->load_changes) * 1000000 /
+					Max(now_usec - table->load_usec, 1);
+				if (load > swap_max_tps)
+					hold = SWAP_HOLD_TPS;
+			}
+		}
+		table->load_changes = changes;
+		table->load_usec = now_usec;
+		CLEARPGRES(res);
+	}
+
+	if (hold != table->swap_hold)
+	{
+		switch (hold)
+		{
+			case SWAP_HOLD_WINDOW:
+				elog(NOTICE, "%s: waiting for swap window %s",
+					 table->target_name, swap_window);
+				break;
+			case SWAP_HOLD_SESSIONS:
+				elog(NOTICE, "%s: waiting for load to drop, " INT64_FORMAT " sessions on the table",
+					 table->target_name, load);
+				break;
+			case SWAP_HOLD_TPS:
+				if (table->swap_hold == SWAP_HOLD_NONE)
+					elog(NOTICE, "%s: waiting for load to drop, sampling row changes",
+						 table->target_name);
+				break;
+		}
+		table->swap_hold = hold;
+	}
+
+	return hold == SWAP_HOLD_NONE;
+}
+
+/*
+ * Move foreign keys and the primary key to the new table, swap it in place
+ * of the original one, drop the leftovers and analyze.
+ */
+static bool
+migrate_table_swap(migrate_table *table, char *errbuf, size_t errsize)
+{
+	PGconn		   *conn = table->conn;
+	PGconn		   *conn2 = table->conn2;
+	PGresult	   *res = NULL;
+	const char	   *params[2];
+	char			buffer[12];
+	char		    indexbuffer[12];
+	StringInfoData	sql;
+	bool            ret = false;
+	int             j;
+	int				num = 0;
+	bool			keep = keep_oid;
+	const char     *schema = table->schema;
+	const char     *table_without_namespace = table->table_without_namespace;
+	migrate_foreign_key *foreign_keys = NULL;
+	char *original_primary_key_def;
+    const char *original_primary_key_name;
+    const char *backing_index_name = NULL;
+	int primary_key = 0;
+	lock_window		lw;
+	int				attempts = 0;
+	const char	   *swap_params[8];
+	PGresult	   *swap_res;
+
+	initStringInfo(&sql);
+	report_progress(table, "swap");
+
+	/*
+	 * With --keep-oid the original table keeps its OID, constraints and
+	 * dependents, so there are no keys to move; but the ALTER must leave the
+	 * layout of the existing columns alone for the storage to fit.
+	 */
+	if (keep)
+	{
+		const char *why = NULL;
+		char		why_buf[256];
+
+		/* the replay runs under the swap's lock: no index builds, no scans */
+		if (alter_actions && alter_may_scan(alter_actions))
+			why = "the alter statement adds indexes or constraints or scans the table";
+		else
+		{
+			params[0] = utoa(table->target_oid, buffer);
+			res = pgut_execute(conn, "SELECT migrate.storage_mismatch($1, false)",
+							   1, params);
+			if (!PQgetisnull(res, 0, 0))
+			{
+				snprintf(why_buf, sizeof(why_buf), "%s changes", getstr(res, 0, 0));
+				why = why_buf;
+			}
+			CLEARPGRES(res);
+		}
+		if (why)
+		{
+			if (table->dependent_views > 0)
+			{
+				elog(WARNING, "cannot keep the OID of %s, which has dependent views: %s",
+					 table->target_name, why);
+				goto cleanup;
+			}
+			elog(NOTICE, "cannot keep the OID of %s: %s, swapping by rename",
+				 table->target_name, why);
+			keep = false;
+		}
+		else
+			goto swap;
+	}
+
+    /*
+     * Get primary and foreign keys for the table before we block access.
+     */
+	elog(DEBUG2, "---- pre-swap: migrate foreign keys, add primary key ----");
+
+    /* Find name of migrated index to back the primary key to avoid a duplicate index for the primary key */
+    resetStringInfo(&sql);
+    printfStringInfo(&sql,
+            "SELECT"
+            "       pg_get_indexdef(i.oid) AS indexdef,"
+            "       i.relname AS indexname"
+            " FROM pg_index x"
+            " JOIN pg_class c ON c.oid = x.indrelid"
+            " JOIN pg_class i ON i.oid = x.indexrelid"
+            " LEFT JOIN pg_namespace n ON n.oid = c.relnamespace"
+            " LEFT JOIN pg_tablespace t ON t.oid = i.reltablespace"
+            " WHERE (c.relkind = ANY (ARRAY['r'::\"char\", 'm'::\"char\"])) AND i.relkind = 'i'::\"char\" and n.nspname = '%s' and c.relname = '%s' and indisprimary = 't'",
+            schema, table_without_namespace);
+    elog(DEBUG2, "--- %s", sql.data);
+    res = pgut_execute_elevel(conn, sql.data, 0, NULL, DEBUG2);
+    /* on error bail */
+    if (PQresultStatus(res) != PGRES_TUPLES_OK)
+    {
+            /* Return the error message otherwise */
+            if (errbuf)
+                    snprintf(errbuf, errsize, "%s", PQerrorMessage(conn));
+            goto cleanup;
+    }
+
+    primary_key = PQntuples(res);
+
+    if (primary_key > 0) {
+	    IndexDef		stmt;
+
+	    original_primary_key_def = getstr(res, 0, 0);
+	    original_primary_key_name = getstr(res, 0, 1);
+	    elog(DEBUG2, "original_primary_key_def  :  %s", original_primary_key_def);
+	    elog(DEBUG2, "original_primary_key_name  :  %s", original_primary_key_name);
+
+		parse_indexdef(&stmt, strdup(original_primary_key_def), original_primary_key_name, table->target_name);
+		CLEARPGRES(res);
+		/* iterate through indexes and see which one
+		 * matches the original_primary_key_def */
+		for (j = 0; j < table->n_indexes; j++)
+		{
+			StringInfoData	index_sql;
+			const char *original_create_index = NULL;
+
+			initStringInfo(&index_sql);
+			printfStringInfo(&index_sql, "ON migrate.table_%u USING %s (%s)%s",
+				table->target_oid, stmt.type, stmt.columns, stmt.options);
+			original_create_index = strdup(table->indexes[j].create_index);
+			if (strpos(original_create_index, index_sql.data) >= 0)
+			{
+				resetStringInfo(&index_sql);
+				printfStringInfo(&index_sql, "%s_%s", stmt.index, table->indexes[j].hash);
+				backing_index_name = index_sql.data;
+				break;
+			}
+		}
+
+		if (backing_index_name == NULL)
+		{
+			elog(DEBUG2, "aborting, couldn't determine migrated primary key");
+			goto cleanup;
+		}
+	}
+	CLEARPGRES(res);
+
+	/* Find existing foreign keys. */
+	resetStringInfo(&sql);
+	printfStringInfo(&sql,
+		"SELECT"
+		"    tc.table_schema,"
+		"    tc.constraint_name,"
+		"    tc.table_name,"
+		"    kcu.column_name,"
+		"    ccu.table_schema AS foreign_table_schema,"
+		"    ccu.table_name AS foreign_table_name,"
+		"    ccu.column_name AS foreign_column_name,"
+		"    left(md5(ccu.table_schema || '.' || ccu.table_name), 5)"
+		" FROM"
+		"    information_schema.table_constraints AS tc"
+		"    JOIN information_schema.key_column_usage AS kcu"
+		"      ON tc.constraint_name = kcu.constraint_name"
+		"      AND tc.table_schema = kcu.table_schema"
+		"    JOIN information_schema.constraint_column_usage AS ccu"
+		"      ON ccu.constraint_name = tc.constraint_name"
+		"      AND ccu.table_schema = tc.table_schema"
+		" WHERE tc.constraint_type = 'FOREIGN KEY' AND ccu.table_name ='%s' and ccu.table_schema = '%s'",
+		table_without_namespace, schema);
+	elog(DEBUG2, "--- %s", sql.data);
+	res = pgut_execute_elevel(conn, sql.data, 0, NULL, DEBUG2);
+
+	/* on error bail */
+	if (PQresultStatus(res) != PGRES_TUPLES_OK)
+	{
+		/* Return the error message otherwise */
+		if (errbuf)
+			snprintf(errbuf, errsize, "%s", PQerrorMessage(conn));
+		goto cleanup;
+	}
+
+	num = PQntuples(res);
+
+	/*
+	 * Rebuild foreign keys so that they point to the new table.
 	 */
 
 	foreign_keys = pgut_malloc(num * sizeof(migrate_foreign_key));
@@ -1805,143 +3354,1071 @@ migrate_one_table(migrate_table *table, const char *orderby, char *errbuf, size_
 		pgut_command(conn2, sql.data, 0, NULL);
 
 		resetStringInfo(&sql);
-		/* note this DDL will be reversed if we bail because it's in a transaction */
+		/* note this DDL will be reversed if we bail because it's in a transaction */
+		printfStringInfo(&sql,
+			"ALTER TABLE %s.%s DROP CONSTRAINT %s",
+			foreign_keys[j].table_schema,
+			foreign_keys[j].table_name,
+			foreign_keys[j].constraint_name);
+		elog(DEBUG2, "--- %s", sql.data);
+		pgut_command(conn2, sql.data, 0, NULL);
+	}
+
+	/* re-enable auto vacuum */
+	// TODO only if this matches the original table setting
+	printfStringInfo(&sql, "SELECT migrate.reset_autovacuum('migrate.table_%u')", table->target_oid);
+	pgut_command(conn2, sql.data, 0, NULL);
+
+	/*
+	 * 5. Swap: will be done with conn2, since it already holds an
+	 *    AccessShare lock.
+	 */
+swap:
+	elog(DEBUG2, "---- swap ----");
+relock:
+	timeline_begin(table, "swap lock", true);
+	/* migrate.swap_table() detaches a partition from its parent, which needs
+	 * an AccessExclusive lock on the parent; take it first, in the order
+	 * queries lock the tree, to avoid deadlocks.
+	 */
+	if (table->part_parent && !keep)
+	{
+		pgut_command(conn2, "SAVEPOINT migrate_sp0", 0, NULL);
+		if (!(lock_exclusive(conn2, conn, utoa(table->part_parent, buffer), false)))
+		{
+			elog(WARNING, "lock_exclusive() failed in conn2 for the parent of %s",
+				 table->target_name);
+			goto cleanup;
+		}
+		table->lock_wait_usec += lock_waited_usec;
+	}
+
+	/* Bump our existing AccessShare lock to AccessExclusive */
+	if (!(lock_exclusive(conn2, conn, utoa(table->target_oid, buffer), false)))
+	{
+		elog(WARNING, "lock_exclusive() failed in conn2 for %s",
+			 table->target_name);
+		goto cleanup;
+	}
+	table->lock_wait_usec += lock_waited_usec;
+	lock_window_begin(&lw, "swap");
+
+	/* Drain the log, and either exchange the storage or attach the primary
+	 * key and rename the tables, in one server-side call, so no round trip
+	 * adds to the lock window.
+	 */
+	swap_params[0] = utoa(table->target_oid, buffer);
+	swap_params[1] = table->sql_peek;
+	swap_params[2] = table->sql_insert;
+	swap_params[3] = table->sql_delete;
+	swap_params[4] = table->sql_update;
+	swap_params[5] = table->sql_pop;
+	if (keep)
+	{
+		swap_params[6] = alter_actions;
+		swap_params[7] = table->target_name;
+		swap_res = pgut_execute_elevel(conn2,
+			"SELECT step, elapsed_ms FROM migrate.swap_storage($1, $2, $3, $4, $5, $6, $7, left(md5($8), 5))",
+			8, swap_params, WARNING);
+		if (PQresultStatus(swap_res) != PGRES_TUPLES_OK)
+		{
+			elog(WARNING, "could not swap the storage of %s", table->target_name);
+			CLEARPGRES(swap_res);
+			goto cleanup;
+		}
+	}
+	else
+	{
+		swap_params[6] = primary_key > 0 ? backing_index_name : NULL;
+		swap_res = pgut_execute(conn2,
+			"SELECT step, elapsed_ms FROM migrate.swap_table($1, $2, $3, $4, $5, $6, $7)",
+			7, swap_params);
+	}
+	for (j = 0; j < PQntuples(swap_res); j++)
+		lock_window_add(&lw, getstr(swap_res, j, 0), atof(getstr(swap_res, j, 1)));
+	CLEARPGRES(swap_res);
+	lock_window_step(&lw, "round trip");
+	if (lock_window_over(&lw))
+		goto over_budget;
+
+	// TODO why didn't this work?
+	// resetStringInfo(&sql);
+	// printfStringInfo(&sql, "DROP TABLE %s_pre_migrate_%u", table->target_name, table->target_oid);
+	// elog(DEBUG2, "--- %s", sql.data);
+	// pgut_command(conn2, sql.data, 0, NULL);
+
+	pgut_command(conn2, "COMMIT", 0, NULL);
+	lock_window_step(&lw, "commit");
+	lock_window_end(&lw, table, true);
+	timeline_end(table, "swap lock", -1, -1);
+
+	elog(DEBUG2, "---- validate foreign keys ----");
+	if (num > 0)
+		timeline_begin(table, "validate foreign keys", false);
+
+	// see https://travisofthenorth.com/blog/2017/2/2/postgres-adding-foreign-keys-with-zero-downtime
+	for (j = 0; j < num; j++)
+	{
+		resetStringInfo(&sql);
 		printfStringInfo(&sql,
-			"ALTER TABLE %s.%s DROP CONSTRAINT %s",
+			"ALTER TABLE %s.%s VALIDATE CONSTRAINT %s_%s",
 			foreign_keys[j].table_schema,
 			foreign_keys[j].table_name,
-			foreign_keys[j].constraint_name);
+			foreign_keys[j].constraint_name,
+			foreign_keys[j].hash);
 		elog(DEBUG2, "--- %s", sql.data);
 		pgut_command(conn2, sql.data, 0, NULL);
 	}
+	if (num > 0)
+		timeline_end(table, "validate foreign keys", -1, -1);
 
 	CLEARPGRES(res);
 
-	/* re-enable auto vacuum */
-	// TODO only if this matches the original table setting
-	printfStringInfo(&sql, "SELECT migrate.reset_autovacuum('migrate.table_%u')", table->target_oid);
-	pgut_command(conn2, sql.data, 0, NULL);
-
 	/*
-	 * 5. Swap: will be done with conn2, since it already holds an
-	 *    AccessShare lock.
+	 * 6. Drop.
 	 */
-	elog(DEBUG2, "---- swap ----");
-	/* Bump our existing AccessShare lock to AccessExclusive */
-	if (!(lock_exclusive(conn2, utoa(table->target_oid, buffer),
-						 table->lock_table, false)))
+	elog(DEBUG2, "---- drop ----");
+
+	timeline_begin(table, "drop lock", false);
+	pgut_command(conn, "BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+	if (!(lock_exclusive(conn, conn2, utoa(table->target_oid, buffer), false)))
 	{
-		elog(WARNING, "lock_exclusive() failed in conn2 for %s",
+		elog(WARNING, "lock_exclusive() failed in connection for %s",
 			 table->target_name);
 		goto cleanup;
 	}
+	table->lock_wait_usec += lock_waited_usec;
+	lock_window_begin(&lw, "drop");
+
+	params[0] = utoa(table->target_oid, buffer);
+	params[1] = utoa(table->temp_obj_num, indexbuffer);
+	pgut_command(conn, "SELECT migrate.migrate_drop($1, $2)", 2, params);
+	lock_window_step(&lw, "drop");
+	pgut_command(conn, "COMMIT", 0, NULL);
+	lock_window_step(&lw, "commit");
+	lock_window_end(&lw, table, true);
+	timeline_end(table, "drop lock", -1, -1);
+	table->temp_obj_num = 0; /* reset temporary object counter after cleanup */
+
+	/*
+	 * 7. Analyze.
+	 * Note that cleanup hook has been already uninstalled here because analyze
+	 * is not an important operation; No clean up even if failed.
+	 */
+	if (analyze)
+	{
+		elog(DEBUG2, "---- analyze ----");
+
+		timeline_begin(table, "analyze", false);
+		pgut_command(conn, "BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
+		printfStringInfo(&sql, "ANALYZE %s", table->target_name);
+		pgut_command(conn, sql.data, 0, NULL);
+		pgut_command(conn, "COMMIT", 0, NULL);
+		timeline_end(table, "analyze", -1, -1);
+	}
+
+	/* Release advisory lock on table. */
+	params[0] = MIGRATE_LOCK_PREFIX_STR;
+	params[1] = utoa(table->target_oid, buffer);
+
+	res = pgut_execute(conn, "SELECT pg_advisory_unlock($1, CAST(-2147483648 + $2::bigint AS integer))",
+			   2, params);
+	ret = true;
+	goto cleanup;
+
+over_budget:
+	/* Rolling back to the savepoint taken by lock_exclusive() releases the
+	 * AccessExclusive lock but keeps our AccessShare lock and the foreign
+	 * keys. Catch up with the log again without the lock and retry.
+	 */
+	lock_window_end(&lw, table, false);
+	if (table->part_parent && !keep)
+		pgut_command(conn2, "ROLLBACK TO SAVEPOINT migrate_sp0", 0, NULL);
+	else
+		pgut_command(conn2, "ROLLBACK TO SAVEPOINT migrate_sp1", 0, NULL);
+	timeline_end(table, "swap lock", -1, -1);
+	if (++attempts < LOCK_BUDGET_ATTEMPTS)
+	{
+		while (apply_log(conn2, table, APPLY_COUNT) > MIN_TUPLES_BEFORE_SWITCH)
+			;
+		goto relock;
+	}
+	elog(WARNING, "could not swap %s within --lock-budget in %d attempts",
+		 table->target_name, attempts);
+
+cleanup:
+	CLEARPGRES(res);
+	termStringInfo(&sql);
+	free(foreign_keys);
+	return ret;
+}
+
+/*
+ * Take 'table' out of the pipeline: roll back what its connections are
+ * still doing and, if it failed after the trigger was installed, drop the
+ * temporary objects.
+ */
+static void
+migrate_table_finish(migrate_table *table, bool success)
+{
+	int		i;
+
+	/* Rollback current transactions */
+	pgut_rollback(table->conn);
+	pgut_rollback(table->conn2);
+	PQsetnonblocking(table->conn2, 0);
+
+	/* XXX: distinguish between fatal and non-fatal errors via the first
+	 * arg to migrate_cleanup().
+	 */
+	if ((!success) && table->table_init)
+		migrate_cleanup(false, table);
+	pgut_atexit_pop(migrate_cleanup_callback, table);
+
+	/* don't clear indexes until after done accessing table->indexes or memory corrupts */
+	free(table->indexes);
+	table->indexes = NULL;
+	table->n_indexes = 0;
+	CLEARPGRES(table->indexres);
+	if (table->vxid)
+		free(table->vxid);
+	table->vxid = NULL;
+	free(table->index_oids);
+	table->index_oids = NULL;
+	table->phase = TABLE_DONE;
+
+	if (table->reported_phase)
+	{
+		const char *params[1];
+		char		buffer[12];
+		PGresult   *res;
+
+		params[0] = utoa(table->target_oid, buffer);
+		res = pgut_execute_elevel(progress_conn,
+			"DELETE FROM migrate.progress_state WHERE relid = $1", 1, params, DEBUG2);
+		CLEARPGRES(res);
+		table->reported_phase = NULL;
+		wait_profile_set(table->conn, NULL, false);
+		wait_profile_set(table->conn2, NULL, false);
+	}
+	free(table->copy_path);
+	table->copy_path = NULL;
+
+	if (execute_allowed)
+	{
+		StringInfoData	buf;
+
+		initStringInfo(&buf);
+		append_table_json(&buf, table, success);
+		if (report_file)
+		{
+			fprintf(report_file, "%s\n", buf.data);
+			fflush(report_file);
+		}
+		record_history(table, success, buf.data);
+		termStringInfo(&buf);
+	}
+	for (i = 0; i < table->n_timeline; i++)
+		free(table->timeline[i].name);
+	free(table->timeline);
+	table->timeline = NULL;
+	table->n_timeline = table->max_timeline = 0;
+}
+
+/*
+ * Publish the state of 'table' in migrate.progress: when it enters a new
+ * phase, and otherwise at most once every PROGRESS_INTERVAL_USEC. The view
+ * adds what the server knows better: the size of the copy so far, the
+ * index builds running and the log rows not applied yet. Reporting is best
+ * effort; a failure must not stop the migration.
+ */
+static void
+report_progress(migrate_table *table, const char *phase)
+{
+	PGresult   *res;
+	const char *params[12];
+	char		buffer[10][32];
+	int64		now = pgut_monotonic_usec();
+	int			indexes_done = 0;
+	int			i;
+
+	if (progress_conn == NULL)
+		return;
+	if (table->reported_phase == NULL || strcmp(phase, table->reported_phase) != 0)
+	{
+		table->phase_usec = now;
+		/* the copy and index builds run alone, idle time is not theirs */
+		wait_profile_set(table->conn, phase,
+						 strcmp(phase, "copy") != 0 && strcmp(phase, "index") != 0);
+		wait_profile_set(table->conn2, phase, false);
+	}
+	else if (now - table->reported_usec < PROGRESS_INTERVAL_USEC)
+		return;
+	table->reported_phase = phase;
+	table->reported_usec = now;
+
+	for (i = 0; i < table->n_indexes; i++)
+		indexes_done += (table->indexes[i].status == FINISHED);
+
+	params[0] = utoa(table->target_oid, buffer[0]);
+	snprintf(buffer[1], sizeof(buffer[1]), "%d", PQbackendPID(table->conn));
+	params[1] = buffer[1];
+	params[2] = phase;
+	snprintf(buffer[2], sizeof(buffer[2]), INT64_FORMAT, now - table->start_usec);
+	params[3] = buffer[2];
+	snprintf(buffer[3], sizeof(buffer[3]), INT64_FORMAT, now - table->phase_usec);
+	params[4] = buffer[3];
+	params[5] = table->copy_path;
+	snprintf(buffer[4], sizeof(buffer[4]), INT64_FORMAT, table->rows_copied);
+	params[6] = table->rows_copied >= 0 ? buffer[4] : NULL;
+	snprintf(buffer[5], sizeof(buffer[5]), "%d", indexes_done);
+	params[7] = buffer[5];
+	snprintf(buffer[6], sizeof(buffer[6]), "%d", table->n_indexes);
+	params[8] = buffer[6];
+	snprintf(buffer[7], sizeof(buffer[7]), INT64_FORMAT, table->rows_applied);
+	params[9] = buffer[7];
+	snprintf(buffer[8], sizeof(buffer[8]), "%.1f",
+			 table->rows_applied * 1000000.0 / Max(table->apply_usec, 1));
+	params[10] = table->apply_usec > 0 ? buffer[8] : NULL;
+	snprintf(buffer[9], sizeof(buffer[9]), INT64_FORMAT, table->lock_wait_usec);
+	params[11] = buffer[9];
+
+	res = pgut_execute_elevel(progress_conn, SQL_REPORT_PROGRESS, 12, params, DEBUG2);
+	CLEARPGRES(res);
+}
+
+/* WAL counters, and with PostgreSQL 16 on the I/O of all backends */
+#define SQL_SERVER_SAMPLE \
+	"SELECT (pg_current_wal_lsn() - '0/0')::bigint, w.wal_records, w.wal_fpi," \
+	"       w.wal_bytes::bigint, w.wal_buffers_full, NULL, NULL, NULL, NULL" \
+	"  FROM pg_stat_wal w"
+#define SQL_SERVER_SAMPLE_IO \
+	"SELECT (pg_current_wal_lsn() - '0/0')::bigint, w.wal_records, w.wal_fpi," \
+	"       w.wal_bytes::bigint, w.wal_buffers_full, io.*" \
+	"  FROM pg_stat_wal w," \
+	"       (SELECT sum(reads)::bigint, sum(writes)::bigint," \
+	"               sum(extends)::bigint, sum(hits)::bigint FROM pg_stat_io) io"
+
+/*
+ * Sample the server-wide counters of the --report timeline on the progress
+ * connection. The counters cover the whole cluster, and the statistics of
+ * other backends reach them with some delay; a failure leaves the sample
+ * invalid and the deltas out of the report.
+ */
+static void
+sample_server(server_sample *sample)
+{
+	PGresult   *res;
+
+	memset(sample, 0, sizeof(*sample));
+	if (progress_conn == NULL || report_file == NULL)
+		return;
+
+	res = pgut_execute_elevel(progress_conn,
+							  PQserverVersion(progress_conn) >= 160000 ?
+							  SQL_SERVER_SAMPLE_IO : SQL_SERVER_SAMPLE,
+							  0, NULL, DEBUG2);
+	if (PQresultStatus(res) == PGRES_TUPLES_OK && PQntuples(res) == 1)
+	{
+		sample->valid = true;
+		sample->wal_lsn = atoll(PQgetvalue(res, 0, 0));
+		sample->wal_records = atoll(PQgetvalue(res, 0, 1));
+		sample->wal_fpi = atoll(PQgetvalue(res, 0, 2));
+		sample->wal_bytes = atoll(PQgetvalue(res, 0, 3));
+		sample->wal_buffers_full = atoll(PQgetvalue(res, 0, 4));
+		sample->has_io = !PQgetisnull(res, 0, 5);
+		sample->io_reads = atoll(PQgetvalue(res, 0, 5));
+		sample->io_writes = atoll(PQgetvalue(res, 0, 6));
+		sample->io_extends = atoll(PQgetvalue(res, 0, 7));
+		sample->io_hits = atoll(PQgetvalue(res, 0, 8));
+	}
+	CLEARPGRES(res);
+}
+
+/* Append a new, closed phase to the timeline of 'table' */
+static timeline_phase *
+timeline_new(migrate_table *table, const char *name)
+{
+	timeline_phase *phase;
+
+	if (table->n_timeline == table->max_timeline)
+	{
+		table->max_timeline = Max(table->max_timeline * 2, 16);
+		table->timeline = pgut_realloc(table->timeline,
+									   sizeof(timeline_phase) * table->max_timeline);
+	}
+	phase = &table->timeline[table->n_timeline++];
+	memset(phase, 0, sizeof(*phase));
+	phase->name = pgut_strdup(name);
+	phase->rows = -1;
+	phase->bytes = -1;
+	return phase;
+}
+
+/*
+ * The last phase of 'table' called 'name', or with 'open' the last one
+ * which has not ended yet; NULL if there is none.
+ */
+static timeline_phase *
+timeline_find(migrate_table *table, const char *name, bool open)
+{
+	int		i;
+
+	for (i = table->n_timeline - 1; i >= 0; i--)
+		if ((table->timeline[i].open || !open) &&
+			strcmp(table->timeline[i].name, name) == 0)
+			return &table->timeline[i];
+	return NULL;
+}
+
+/*
+ * Begin a phase of 'table' in the timeline of migrate.history and
+ * --report. With 'aggregate', a round of a phase seen before adds to its
+ * entry, otherwise every call makes an entry of its own. Phases begin and
+ * end outside of the lock windows, so that sampling the server never
+ * lengthens them.
+ */
+static void
+timeline_begin(migrate_table *table, const char *name, bool aggregate)
+{
+	timeline_phase *phase = NULL;
+
+	if (!execute_allowed)
+		return;
+
+	if (aggregate)
+	{
+		phase = timeline_find(table, name, false);
+		if (phase && !phase->aggregate)
+			phase = NULL;
+	}
+	if (phase == NULL)
+	{
+		phase = timeline_new(table, name);
+		phase->aggregate = aggregate;
+		phase->start_usec = pgut_monotonic_usec();
+	}
+
+	sample_server(&phase->begin);
+	phase->open = true;
+	phase->iterations++;
+	phase->round_usec = pgut_monotonic_usec();
+	phase->wait_begin = table->lock_wait_usec;
+}
+
+/*
+ * End the open phase 'name' of 'table', adding 'rows' and 'bytes' when
+ * they are not negative. With --report-events, the phase is reported at
+ * once.
+ */
+static void
+timeline_end(migrate_table *table, const char *name, int64 rows, int64 bytes)
+{
+	timeline_phase *phase;
+	server_sample	end;
+
+	if (!execute_allowed || (phase = timeline_find(table, name, true)) == NULL)
+		return;
+
+	sample_server(&end);
+	phase->open = false;
+	phase->end_usec = pgut_monotonic_usec();
+	phase->active_usec += phase->end_usec - phase->round_usec;
+	phase->wait_usec += table->lock_wait_usec - phase->wait_begin;
+	if (rows >= 0)
+		phase->rows = Max(phase->rows, 0) + rows;
+	if (bytes >= 0)
+		phase->bytes = Max(phase->bytes, 0) + bytes;
+
+	if (phase->begin.valid && end.valid)
+	{
+		phase->delta.valid = true;
+		phase->delta.wal_lsn += end.wal_lsn - phase->begin.wal_lsn;
+		phase->delta.wal_records += end.wal_records - phase->begin.wal_records;
+		phase->delta.wal_fpi += end.wal_fpi - phase->begin.wal_fpi;
+		phase->delta.wal_bytes += end.wal_bytes - phase->begin.wal_bytes;
+		phase->delta.wal_buffers_full += end.wal_buffers_full - phase->begin.wal_buffers_full;
+		if (phase->begin.has_io && end.has_io)
+		{
+			phase->delta.has_io = true;
+			phase->delta.io_reads += end.io_reads - phase->begin.io_reads;
+			phase->delta.io_writes += end.io_writes - phase->begin.io_writes;
+			phase->delta.io_extends += end.io_extends - phase->begin.io_extends;
+			phase->delta.io_hits += end.io_hits - phase->begin.io_hits;
+		}
+	}
+
+	if (report_file && report_events)
+	{
+		StringInfoData	buf;
+
+		initStringInfo(&buf);
+		appendStringInfoString(&buf, "{\"type\":\"phase\",\"table\":");
+		append_json_string(&buf, table->target_name);
+		appendStringInfo(&buf, ",\"relid\":%u,", table->target_oid);
+		append_phase_json(&buf, table, phase);
+		appendStringInfoString(&buf, "}\n");
+		fputs(buf.data, report_file);
+		fflush(report_file);
+		termStringInfo(&buf);
+	}
+}
+
+/*
+ * Add a phase timed by the caller, without server counters: the index
+ * builds of a table overlap, so only their sum has meaningful deltas.
+ */
+static void
+timeline_add(migrate_table *table, const char *name, int64 start_usec,
+			 int64 end_usec, int64 bytes)
+{
+	timeline_phase *phase;
+
+	if (!execute_allowed)
+		return;
+
+	phase = timeline_new(table, name);
+	phase->iterations = 1;
+	phase->start_usec = phase->round_usec = start_usec;
+	phase->end_usec = end_usec;
+	phase->active_usec = end_usec - start_usec;
+	phase->bytes = bytes;
+}
+
+/* Append 'str' to 'buf' as a JSON string */
+static void
+append_json_string(StringInfo buf, const char *str)
+{
+	const char *p;
+
+	appendStringInfoChar(buf, '"');
+	for (p = str; *p; p++)
+	{
+		switch (*p)
+		{
+			case '"':
+				appendStringInfoString(buf, "\\\"");
+				break;
+			case '\\':
+				appendStringInfoString(buf, "\\\\");
+				break;
+			case '\n':
+				appendStringInfoString(buf, "\\n");
+				break;
+			case '\r':
+				appendStringInfoString(buf, "\\r");
+				break;
+			case '\t':
+				appendStringInfoString(buf, "\\t");
+				break;
+			default:
+				if ((unsigned char) *p < ' ')
+					appendStringInfo(buf, "\\u%04x", (unsigned char) *p);
+				else
+					appendStringInfoChar(buf, *p);
+				break;
+		}
+	}
+	appendStringInfoChar(buf, '"');
+}
+
+/*
+ * Append the members of a JSON object describing 'phase' to 'buf'. Times
+ * are in seconds since the migration of the table began; a phase still
+ * open, where the table failed, has no end.
+ */
+static void
+append_phase_json(StringInfo buf, const migrate_table *table,
+				  const timeline_phase *phase)
+{
+	appendStringInfoString(buf, "\"phase\":");
+	append_json_string(buf, phase->name);
+	appendStringInfo(buf, ",\"start_s\":%.3f",
+					 (phase->start_usec - table->start_usec) / 1000000.0);
+	if (phase->open)
+		appendStringInfoString(buf, ",\"end_s\":null");
+	else
+		appendStringInfo(buf, ",\"end_s\":%.3f",
+						 (phase->end_usec - table->start_usec) / 1000000.0);
+	appendStringInfo(buf, ",\"active_s\":%.3f,\"iterations\":%d",
+					 phase->active_usec / 1000000.0, phase->iterations);
+	if (phase->rows >= 0)
+		appendStringInfo(buf, ",\"rows\":" INT64_FORMAT, phase->rows);
+	if (phase->bytes >= 0)
+		appendStringInfo(buf, ",\"bytes\":" INT64_FORMAT, phase->bytes);
+	appendStringInfo(buf, ",\"lock_wait_s\":%.3f", phase->wait_usec / 1000000.0);
+	if (phase->hold_usec > 0)
+		appendStringInfo(buf, ",\"lock_hold_s\":%.3f", phase->hold_usec / 1000000.0);
+	if (phase->delta.valid)
+		appendStringInfo(buf, ",\"wal_lsn_bytes\":" INT64_FORMAT
+						 ",\"wal_records\":" INT64_FORMAT
+						 ",\"wal_fpi\":" INT64_FORMAT
+						 ",\"wal_bytes\":" INT64_FORMAT
+						 ",\"wal_buffers_full\":" INT64_FORMAT,
+						 phase->delta.wal_lsn, phase->delta.wal_records,
+						 phase->delta.wal_fpi, phase->delta.wal_bytes,
+						 phase->delta.wal_buffers_full);
+	if (phase->delta.has_io)
+		appendStringInfo(buf, ",\"io_reads\":" INT64_FORMAT
+						 ",\"io_writes\":" INT64_FORMAT
+						 ",\"io_extends\":" INT64_FORMAT
+						 ",\"io_hits\":" INT64_FORMAT,
+						 phase->delta.io_reads, phase->delta.io_writes,
+						 phase->delta.io_extends, phase->delta.io_hits);
+}
+
+/*
+ * Append the JSON object of 'table', once it is out of the pipeline: its
+ * outcome, totals and the timeline of its phases. This is its line in
+ * --report and its migrate.history.report.
+ */
+static void
+append_table_json(StringInfo buf, migrate_table *table, bool success)
+{
+	char	started[32];
+	int		i;
+
+	strftime(started, sizeof(started), "%Y-%m-%dT%H:%M:%SZ",
+			 gmtime(&table->start_time));
+
+	appendStringInfoString(buf, "{\"type\":\"table\",\"table\":");
+	append_json_string(buf, table->target_name);
+	appendStringInfo(buf, ",\"relid\":%u,\"result\":\"%s\",\"started\":\"%s\""
+					 ",\"elapsed_s\":%.3f",
+					 table->target_oid, success ? "success" : "failure", started,
+					 (pgut_monotonic_usec() - table->start_usec) / 1000000.0);
+	if (table->rows_copied >= 0)
+		appendStringInfo(buf, ",\"rows_copied\":" INT64_FORMAT, table->rows_copied);
+	appendStringInfo(buf, ",\"bytes\":" INT64_FORMAT ",\"rows_applied\":" INT64_FORMAT
+					 ",\"lock_wait_s\":%.3f,\"phases\":[",
+					 table->relsize, table->rows_applied,
+					 table->lock_wait_usec / 1000000.0);
+	for (i = 0; i < table->n_timeline; i++)
+	{
+		appendStringInfoString(buf, i > 0 ? ",{" : "{");
+		append_phase_json(buf, table, &table->timeline[i]);
+		appendStringInfoChar(buf, '}');
+	}
+	appendStringInfoString(buf, "]}");
+}
+
+#define SQL_RECORD_HISTORY \
+	"INSERT INTO migrate.history (relid, table_name, alter_actions, tablespace," \
+	"  result, started, size_before, size_after, index_size, rows_copied," \
+	"  rows_applied, copy_s, index_s, apply_s, lock_wait_s, setup_hold_s," \
+	"  swap_hold_s, report)" \
+	" VALUES ($1, $2, $3, $4, $5, to_timestamp($6), $7," \
+	"  CASE WHEN $5 = 'success' THEN pg_table_size(to_regclass($2)) END," \
+	"  $8, $9, $10, $11, $12, $13, $14, $15, $16, $17)" \
+	" RETURNING id"
+
+#define SQL_HISTORY_REGRESSIONS \
+	"SELECT metric, value, baseline, runs" \
+	"  FROM migrate.history_compare($1) WHERE regression"
+
+/*
+ * Record the run of 'table' in migrate.history and, with --compare-history,
+ * warn about the metrics which regressed against earlier runs on tables of
+ * a similar size. 'report' is the JSON object of the table.
+ */
+static void
+record_history(migrate_table *table, bool success, const char *report)
+{
+	static const char *const seconds[] = {
+		"copy", "index builds", "apply", NULL
+	};
+	static const char *const holds[] = {
+		"setup lock", "swap lock", NULL
+	};
+	PGresult	   *res;
+	PGresult	   *cmp;
+	const char	   *params[17];
+	char			buffer[13][32];
+	timeline_phase *phase;
+	int				i;
+
+	if (progress_conn == NULL)
+		return;
+
+	params[0] = utoa(table->target_oid, buffer[0]);
+	params[1] = table->target_name;
+	params[2] = alter_actions;
+	params[3] = tablespace;
+	params[4] = success ? "success" : "failure";
+	snprintf(buffer[1], sizeof(buffer[1]), "%ld", (long) table->start_time);
+	params[5] = buffer[1];
+	snprintf(buffer[2], sizeof(buffer[2]), INT64_FORMAT, table->relsize);
+	params[6] = buffer[2];
+	snprintf(buffer[12], sizeof(buffer[12]), INT64_FORMAT, table->index_size);
+	params[7] = buffer[12];
+	snprintf(buffer[3], sizeof(buffer[3]), INT64_FORMAT, table->rows_copied);
+	params[8] = table->rows_copied >= 0 ? buffer[3] : NULL;
+	snprintf(buffer[4], sizeof(buffer[4]), INT64_FORMAT, table->rows_applied);
+	params[9] = buffer[4];
+	for (i = 0; seconds[i]; i++)
+	{
+		phase = timeline_find(table, seconds[i], false);
+		snprintf(buffer[5 + i], sizeof(buffer[5 + i]), "%.6f",
+				 phase ? phase->active_usec / 1000000.0 : 0);
+		params[10 + i] = (phase && !phase->open) ? buffer[5 + i] : NULL;
+	}
+	snprintf(buffer[8], sizeof(buffer[8]), "%.6f", table->lock_wait_usec / 1000000.0);
+	params[13] = buffer[8];
+	for (i = 0; holds[i]; i++)
+	{
+		phase = timeline_find(table, holds[i], false);
+		snprintf(buffer[9 + i], sizeof(buffer[9 + i]), "%.6f",
+				 phase ? phase->hold_usec / 1000000.0 : 0);
+		params[14 + i] = phase ? buffer[9 + i] : NULL;
+	}
+	params[16] = report;
+
+	res = pgut_execute_elevel(progress_conn, SQL_RECORD_HISTORY, 17, params, WARNING);
+	if (PQresultStatus(res) != PGRES_TUPLES_OK || !compare_history)
+	{
+		CLEARPGRES(res);
+		return;
+	}
+
+	params[0] = getstr(res, 0, 0);
+	cmp = pgut_execute_elevel(progress_conn, SQL_HISTORY_REGRESSIONS, 1, params, WARNING);
+	if (PQresultStatus(cmp) == PGRES_TUPLES_OK)
+		for (i = 0; i < PQntuples(cmp); i++)
+			elog(WARNING, "%s: %s is %.3f, against a median of %.3f over %s similar runs",
+				 table->target_name, getstr(cmp, i, 0), atof(getstr(cmp, i, 1)),
+				 atof(getstr(cmp, i, 2)), getstr(cmp, i, 3));
+	CLEARPGRES(cmp);
+	CLEARPGRES(res);
+}
+
+/*
+ * --wait-profile: a thread samples the wait events of our own backends in
+ * pg_stat_activity every WAIT_SAMPLE_USEC, on a connection of its own, so
+ * that the samples keep coming while the main thread is blocked in a
+ * statement. The main thread tells it which backends to watch, and in
+ * which phase, with wait_profile_set(); the counts per phase and event
+ * belong to the thread until wait_profile_stop() has joined it.
+ */
+#define WAIT_SAMPLE_USEC	200000
+
+/* Events listed per phase in the profile; the rest are summed as "other" */
+#define WAIT_PROFILE_TOP	5
+
+/* A running backend has no wait event; it counts as CPU */
+#define SQL_WAIT_SAMPLE \
+	"SELECT pid, state = 'active'," \
+	"       coalesce(wait_event_type || ':' || wait_event," \
+	"                CASE WHEN state = 'active' THEN 'CPU' ELSE state END)" \
+	"  FROM pg_stat_activity WHERE pid = ANY ($1::integer[])"
+
+typedef struct wait_backend
+{
+	int				pid;
+	const char	   *phase;			/* a string constant, or NULL when done */
+	bool			count_idle;		/* count the samples where it waits for us */
+} wait_backend;
+
+typedef struct wait_count
+{
+	const char	   *phase;
+	char		   *event;			/* type:event, CPU, or the state */
+	int64			samples;
+} wait_count;
+
+static pthread_t		wait_thread;
+static bool				wait_running = false;
+static PGconn		   *wait_conn = NULL;
+
+/* Shared with the thread, under wait_mutex */
+static pthread_mutex_t	wait_mutex = PTHREAD_MUTEX_INITIALIZER;
+static bool				wait_stop = false;
+static wait_backend	   *wait_backends = NULL;
+static int				n_wait_backends = 0;
+static int				max_wait_backends = 0;
+
+/* The thread's, until it is joined */
+static wait_count	   *wait_counts = NULL;
+static int				n_wait_counts = 0;
+static int				max_wait_counts = 0;
+
+/*
+ * Count a sample of backend 'pid' in the phase 'backends' have it in.
+ * This runs in the sampler thread, which must not raise errors: a sample
+ * which does not fit in memory is dropped.
+ */
+static void
+wait_count_sample(const wait_backend *backends, int n_backends, int pid,
+				  bool active, const char *event)
+{
+	const wait_backend *backend = NULL;
+	int			i;
+
+	for (i = 0; i < n_backends; i++)
+		if (backends[i].pid == pid && backends[i].phase)
+			backend = &backends[i];
+	if (backend == NULL || (!active && !backend->count_idle))
+		return;
+
+	for (i = 0; i < n_wait_counts; i++)
+		if (strcmp(wait_counts[i].phase, backend->phase) == 0 &&
+			strcmp(wait_counts[i].event, event) == 0)
+			break;
+	if (i == n_wait_counts)
+	{
+		char	   *copy;
+
+		if (n_wait_counts == max_wait_counts)
+		{
+			int			max = Max(max_wait_counts * 2, 32);
+			wait_count *counts = realloc(wait_counts, sizeof(wait_count) * max);
+
+			if (counts == NULL)
+				return;
+			wait_counts = counts;
+			max_wait_counts = max;
+		}
+		if ((copy = strdup(event)) == NULL)
+			return;
+		wait_counts[i].phase = backend->phase;
+		wait_counts[i].event = copy;
+		wait_counts[i].samples = 0;
+		n_wait_counts++;
+	}
+	wait_counts[i].samples++;
+}
+
+/* Body of the sampler thread, see wait_profile_start() */
+static void *
+wait_sampler(void *arg)
+{
+	wait_backend   *backends = NULL;
+	int				n_backends = 0;
+	int				max_backends = 0;
+	StringInfoData	pids;
+	sigset_t		sigs;
+	int				i;
+
+	/* leave the signals, and the cancel handler, to the main thread */
+	sigfillset(&sigs);
+	pthread_sigmask(SIG_BLOCK, &sigs, NULL);
+	initStringInfo(&pids);
+
+	for (;;)
+	{
+		PGresult   *res;
+		const char *params[1];
+
+		pthread_mutex_lock(&wait_mutex);
+		if (wait_stop)
+		{
+			pthread_mutex_unlock(&wait_mutex);
+			break;
+		}
+		if (n_wait_backends > max_backends)
+		{
+			wait_backend *copy = realloc(backends, sizeof(wait_backend) * max_wait_backends);
 
-	apply_log(conn2, table, 0);
+			if (copy != NULL)
+			{
+				backends = copy;
+				max_backends = max_wait_backends;
+			}
+		}
+		n_backends = Min(n_wait_backends, max_backends);
+		if (n_backends > 0)
+			memcpy(backends, wait_backends, sizeof(wait_backend) * n_backends);
+		pthread_mutex_unlock(&wait_mutex);
+
+		resetStringInfo(&pids);
+		for (i = 0; i < n_backends; i++)
+			if (backends[i].phase)
+				appendStringInfo(&pids, "%s%d", pids.len > 0 ? "," : "{",
+								 backends[i].pid);
+		if (pids.len > 0)
+		{
+			appendStringInfoChar(&pids, '}');
+			params[0] = pids.data;
+			res = PQexecParams(wait_conn, SQL_WAIT_SAMPLE, 1, NULL, params,
+							   NULL, NULL, 0);
+			if (PQresultStatus(res) == PGRES_TUPLES_OK)
+				for (i = 0; i < PQntuples(res); i++)
+					wait_count_sample(backends, n_backends,
+									  atoi(PQgetvalue(res, i, 0)),
+									  PQgetvalue(res, i, 1)[0] == 't',
+									  PQgetvalue(res, i, 2));
+			PQclear(res);
+		}
 
-	if (primary_key > 0) {
-		resetStringInfo(&sql);
-		printfStringInfo(&sql, "ALTER TABLE migrate.table_%u ADD PRIMARY KEY USING INDEX %s", table->target_oid, backing_index_name);
-		elog(DEBUG2, "--- %s", sql.data);
-		pgut_command(conn2, sql.data, 0, NULL);
+		usleep(WAIT_SAMPLE_USEC);
 	}
 
-	resetStringInfo(&sql);
-	printfStringInfo(&sql, "ALTER TABLE %s RENAME TO %s_pre_migrate_%u", table->target_name, table_without_namespace, table->target_oid);
-	elog(DEBUG2, "--- %s", sql.data);
-	pgut_command(conn2, sql.data, 0, NULL);
+	termStringInfo(&pids);
+	free(backends);
+	return NULL;
+}
 
-	resetStringInfo(&sql);
-	printfStringInfo(&sql, "ALTER TABLE migrate.table_%u RENAME TO %s", table->target_oid, table_without_namespace);
-	elog(DEBUG2, "--- %s", sql.data);
-	pgut_command(conn2, sql.data, 0, NULL);
+/* Start sampling with --wait-profile; failing to is only a warning. */
+static void
+wait_profile_start(void)
+{
+	int			err;
 
-	resetStringInfo(&sql);
-	printfStringInfo(&sql, "ALTER TABLE migrate.%s SET SCHEMA %s", table_without_namespace, schema);
-	elog(DEBUG2, "--- %s", sql.data);
-	pgut_command(conn2, sql.data, 0, NULL);
+	if (!wait_profile || wait_running)
+		return;
+	if ((wait_conn = open_connection(WARNING)) == NULL)
+		return;
 
-	// TODO why didn't this work?
-	// resetStringInfo(&sql);
-	// printfStringInfo(&sql, "DROP TABLE %s_pre_migrate_%u", table->target_name, table->target_oid);
-	// elog(DEBUG2, "--- %s", sql.data);
-	// pgut_command(conn2, sql.data, 0, NULL);
+	wait_stop = false;
+	if ((err = pthread_create(&wait_thread, NULL, wait_sampler, NULL)) != 0)
+	{
+		elog(WARNING, "could not start the wait event sampler: %s", strerror(err));
+		pgut_disconnect(wait_conn);
+		wait_conn = NULL;
+		return;
+	}
+	wait_running = true;
 
-	pgut_command(conn2, "COMMIT", 0, NULL);
+	/* an error exit closes wait_conn: the thread must be gone by then */
+	pgut_atexit_push(wait_profile_finish, NULL);
+}
 
-	elog(DEBUG2, "---- validate foreign keys ----");
+/*
+ * Sample the backend of 'conn' as being in 'phase' from now on, or stop
+ * sampling it if 'phase' is NULL. With 'count_idle', the samples where it
+ * is idle count too, as time the phase spent waiting for the client.
+ */
+static void
+wait_profile_set(PGconn *conn, const char *phase, bool count_idle)
+{
+	int			pid;
+	int			i;
 
-	// see https://travisofthenorth.com/blog/2017/2/2/postgres-adding-foreign-keys-with-zero-downtime
-	for (j = 0; j < num; j++)
+	if (!wait_running || conn == NULL)
+		return;
+	pid = PQbackendPID(conn);
+
+	pthread_mutex_lock(&wait_mutex);
+	for (i = 0; i < n_wait_backends; i++)
+		if (wait_backends[i].pid == pid)
+			break;
+	if (i == n_wait_backends && phase != NULL)
 	{
-		resetStringInfo(&sql);
-		printfStringInfo(&sql,
-			"ALTER TABLE %s.%s VALIDATE CONSTRAINT %s_%s",
-			foreign_keys[j].table_schema,
-			foreign_keys[j].table_name,
-			foreign_keys[j].constraint_name,
-			foreign_keys[j].hash);
-		elog(DEBUG2, "--- %s", sql.data);
-		pgut_command(conn2, sql.data, 0, NULL);
+		if (n_wait_backends == max_wait_backends)
+		{
+			max_wait_backends = Max(max_wait_backends * 2, 16);
+			wait_backends = pgut_realloc(wait_backends,
+										 sizeof(wait_backend) * max_wait_backends);
+		}
+		n_wait_backends++;
 	}
-
-	/*
-	 * 6. Drop.
-	 */
-	elog(DEBUG2, "---- drop ----");
-
-	command("BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
-	if (!(lock_exclusive(connection, utoa(table->target_oid, buffer),
-						 table->lock_table, false)))
+	if (i < n_wait_backends)
 	{
-		elog(WARNING, "lock_exclusive() failed in connection for %s",
-			 table->target_name);
-		goto cleanup;
+		wait_backends[i].pid = pid;
+		wait_backends[i].phase = phase;
+		wait_backends[i].count_idle = count_idle;
 	}
+	pthread_mutex_unlock(&wait_mutex);
+}
 
-	params[0] = utoa(table->target_oid, buffer);
-	params[1] = utoa(temp_obj_num, indexbuffer);
-	command("SELECT migrate.migrate_drop($1, $2)", 2, params);
-	command("COMMIT", 0, NULL);
-	temp_obj_num = 0; /* reset temporary object counter after cleanup */
+/* qsort comparator: most samples first */
+static int
+wait_count_cmp(const void *a, const void *b)
+{
+	const wait_count *ca = (const wait_count *) a;
+	const wait_count *cb = (const wait_count *) b;
 
-	/*
-	 * 7. Analyze.
-	 * Note that cleanup hook has been already uninstalled here because analyze
-	 * is not an important operation; No clean up even if failed.
-	 */
-	if (analyze)
-	{
-		elog(DEBUG2, "---- analyze ----");
+	if (ca->samples != cb->samples)
+		return (ca->samples > cb->samples) ? -1 : 1;
+	return strcmp(ca->event, cb->event);
+}
 
-		command("BEGIN ISOLATION LEVEL READ COMMITTED", 0, NULL);
-		printfStringInfo(&sql, "ANALYZE %s", table->target_name);
-		command(sql.data, 0, NULL);
-		command("COMMIT", 0, NULL);
-	}
+/* Stop the sampler at the end of migrate_tables(), see wait_profile_finish() */
+static void
+wait_profile_stop(void)
+{
+	if (!wait_running)
+		return;
+	pgut_atexit_pop(wait_profile_finish, NULL);
+	wait_profile_finish(false, NULL);
+}
 
-	/* Release advisory lock on table. */
-	params[0] = MIGRATE_LOCK_PREFIX_STR;
-	params[1] = utoa(table->target_oid, buffer);
+/*
+ * Stop the sampler and print the profile of each phase, in the order the
+ * phases were first sampled: the share of the samples of its backends
+ * spent in each wait event, "CPU" when running and "Client:ClientRead"
+ * when waiting for us. This is also the pgut_atexit callback which stops
+ * the thread before an error exit disconnects its connection.
+ */
+static void
+wait_profile_finish(bool fatal, void *userdata)
+{
+	wait_count	   *phase_counts;
+	bool		   *done;
+	int				i;
+	int				j;
 
-	res = pgut_execute(connection, "SELECT pg_advisory_unlock($1, CAST(-2147483648 + $2::bigint AS integer))",
-			   2, params);
-	ret = true;
+	if (!wait_running)
+		return;
 
-cleanup:
-	CLEARPGRES(res);
-	termStringInfo(&sql);
-	if (vxid)
-		free(vxid);
+	pthread_mutex_lock(&wait_mutex);
+	wait_stop = true;
+	pthread_mutex_unlock(&wait_mutex);
+	pthread_join(wait_thread, NULL);
+	wait_running = false;
+	pgut_disconnect(wait_conn);
+	wait_conn = NULL;
+	free(wait_backends);
+	wait_backends = NULL;
+	n_wait_backends = max_wait_backends = 0;
+
+	phase_counts = pgut_newarray(wait_count, Max(n_wait_counts, 1));
+	done = pgut_newarray(bool, Max(n_wait_counts, 1));
+	memset(done, 0, sizeof(bool) * Max(n_wait_counts, 1));
+	for (i = 0; i < n_wait_counts; i++)
+	{
+		StringInfoData	line;
+		int				n = 0;
+		int64			total = 0;
+		int64			other = 0;
 
-	/* Rollback current transactions */
-	pgut_rollback(connection);
-	pgut_rollback(conn2);
+		if (done[i])
+			continue;
+		for (j = i; j < n_wait_counts; j++)
+		{
+			if (done[j] || strcmp(wait_counts[j].phase, wait_counts[i].phase) != 0)
+				continue;
+			done[j] = true;
+			phase_counts[n++] = wait_counts[j];
+			total += wait_counts[j].samples;
+		}
+		qsort(phase_counts, n, sizeof(wait_count), wait_count_cmp);
 
-	/* XXX: distinguish between fatal and non-fatal errors via the first
-	 * arg to migrate_cleanup().
-	 */
-	if ((!ret) && table_init)
-		migrate_cleanup(false, table);
+		initStringInfo(&line);
+		for (j = 0; j < n; j++)
+		{
+			if (j >= WAIT_PROFILE_TOP)
+			{
+				other += phase_counts[j].samples;
+				continue;
+			}
+			appendStringInfo(&line, "%s%.0f%% %s", j > 0 ? ", " : "",
+							 100.0 * phase_counts[j].samples / total,
+							 phase_counts[j].event);
+		}
+		if (other > 0)
+			appendStringInfo(&line, ", %.0f%% other", 100.0 * other / total);
+		elog(INFO, "wait profile of %s (" INT64_FORMAT " samples): %s",
+			 wait_counts[i].phase, total, line.data);
+		termStringInfo(&line);
+	}
+
+	for (i = 0; i < n_wait_counts; i++)
+		free(wait_counts[i].event);
+	free(wait_counts);
+	free(phase_counts);
+	free(done);
+	wait_counts = NULL;
+	n_wait_counts = max_wait_counts = 0;
 }
 
 /* Kill off any concurrent DDL (or any transaction attempting to take
@@ -1952,17 +4429,22 @@ cleanup:
  * Returns true if no problems encountered, false otherwise.
  */
 static bool
-kill_ddl(PGconn *conn, Oid relid, bool terminate)
+kill_ddl(PGconn *conn, PGconn *partner, Oid relid, bool terminate)
 {
 	bool			ret = true;
 	PGresult	   *res;
 	StringInfoData	sql;
+	char			pids[64];
 	int				n_tuples;
 
 	initStringInfo(&sql);
 
+	/* Only DDL queued behind conn or its partner is in our way */
+	snprintf(pids, sizeof(pids), "{%d,%d}", PQbackendPID(conn),
+			 partner ? PQbackendPID(partner) : 0);
+
 	/* Check the number of backends competing AccessExclusiveLock */
-	printfStringInfo(&sql, COUNT_COMPETING_LOCKS, relid);
+	printfStringInfo(&sql, COUNT_COMPETING_LOCKS, relid, pids);
 	res = pgut_execute(conn, sql.data, 0, NULL);
 	n_tuples = PQntuples(res);
 
@@ -1980,7 +4462,7 @@ kill_ddl(PGconn *conn, Oid relid, bool terminate)
 		else
 		{
 			resetStringInfo(&sql);
-			printfStringInfo(&sql, CANCEL_COMPETING_LOCKS, relid);
+			printfStringInfo(&sql, CANCEL_COMPETING_LOCKS, relid, pids);
 			res = pgut_execute(conn, sql.data, 0, NULL);
 			if (PQresultStatus(res) != PGRES_TUPLES_OK)
 			{
@@ -1995,7 +4477,7 @@ kill_ddl(PGconn *conn, Oid relid, bool terminate)
 					 PQntuples(res));
 
 				CLEARPGRES(res);
-				printfStringInfo(&sql, KILL_COMPETING_LOCKS, relid);
+				printfStringInfo(&sql, KILL_COMPETING_LOCKS, relid, pids);
 				res = pgut_execute(conn, sql.data, 0, NULL);
 				if (PQresultStatus(res) != PGRES_TUPLES_OK)
 				{
@@ -2026,19 +4508,18 @@ kill_ddl(PGconn *conn, Oid relid, bool terminate)
  * Arguments:
  *
  *  conn: connection to use
+ *  partner: the other connection of the pair, which may hold locks
+ *           the DDL is waiting behind
  *  relid: OID of relation
  *  target_name: name of table
  */
 static bool
-lock_access_share(PGconn *conn, Oid relid, const char *target_name)
+lock_access_share(PGconn *conn, PGconn *partner, Oid relid, const char *target_name)
 {
-	StringInfoData	sql;
 	time_t			start = time(NULL);
 	int				i;
 	bool			ret = true;
 
-	initStringInfo(&sql);
-
 	for (i = 1; ; i++)
 	{
 		time_t		duration;
@@ -2055,44 +4536,39 @@ lock_access_share(PGconn *conn, Oid relid, const char *target_name)
 		 * already.
 		 */
 		if (duration > (wait_timeout * 2))
-			ret = kill_ddl(conn, relid, true);
+			ret = kill_ddl(conn, partner, relid, true);
 		else
-			ret = kill_ddl(conn, relid, false);
+			ret = kill_ddl(conn, partner, relid, false);
 
 		if (!ret)
 			break;
 
 		/* wait for a while to lock the table. */
 		wait_msec = Min(1000, i * 100);
-		printfStringInfo(&sql, "SET LOCAL statement_timeout = %d", wait_msec);
-		pgut_command(conn, sql.data, 0, NULL);
-
-		printfStringInfo(&sql, "LOCK TABLE %s IN ACCESS SHARE MODE", target_name);
-		res = pgut_execute_elevel(conn, sql.data, 0, NULL, DEBUG2);
-		if (PQresultStatus(res) == PGRES_COMMAND_OK)
+		res = try_lock_table(conn, relid, "ACCESS SHARE", wait_msec);
+		if (PQresultStatus(res) == PGRES_TUPLES_OK &&
+			strcmp(getstr(res, 0, 0), "t") == 0)
 		{
 			CLEARPGRES(res);
 			break;
 		}
-		else if (sqlstate_equals(res, SQLSTATE_QUERY_CANCELED))
+		else if (PQresultStatus(res) == PGRES_TUPLES_OK)
 		{
 			/* retry if lock conflicted */
+			elog(DEBUG2, "could not lock %s within %d ms", target_name, wait_msec);
 			CLEARPGRES(res);
-			pgut_rollback(conn);
 			continue;
 		}
 		else
 		{
 			/* exit otherwise */
-			elog(WARNING, "%s", PQerrorMessage(connection));
+			elog(WARNING, "%s", PQerrorMessage(conn));
 			CLEARPGRES(res);
 			ret = false;
 			break;
 		}
 	}
 
-	termStringInfo(&sql);
-	pgut_command(conn, "RESET statement_timeout", 0, NULL);
 	return ret;
 }
 
@@ -2125,6 +4601,153 @@ apply_alter_statement(PGconn *conn, Oid relid, const char *alter_sql)
 	return ret;
 }
 
+/*
+ * Whether the ALTER TABLE actions may scan the table to validate it, which
+ * alter_in_place() and the --keep-oid replay must not do under their
+ * AccessExclusive lock: SET NOT NULL, validated constraints, new unique
+ * indexes and the like. Rewrites
+ * need not be recognized here; migrate.forbid_rewrite() refuses them. A
+ * keyword inside a string constant counts too, which only costs a copy.
+ */
+static bool
+alter_may_scan(const char *actions)
+{
+	static const char *const scanning[] = {
+		"SET NOT NULL", "PRIMARY KEY", "UNIQUE", "EXCLUDE", "SET TABLESPACE",
+		"VALIDATE CONSTRAINT", "ATTACH PARTITION", "DETACH PARTITION", NULL
+	};
+	static const char *const unless_not_valid[] = {
+		"CHECK", "REFERENCES", "FOREIGN KEY", NULL
+	};
+	char	   *clause = pgut_malloc(strlen(actions) + 1);
+	const char *p = actions;
+	bool		ret = false;
+
+	while (!ret && *p)
+	{
+		int			depth = 0;
+		char		quote = 0;
+		char	   *q = clause;
+		int			i;
+
+		/* one top-level clause, upper-cased with whitespace collapsed */
+		for (; *p && (quote || depth > 0 || *p != ','); p++)
+		{
+			if (quote)
+				quote = (*p == quote) ? 0 : quote;
+			else if (*p == '\'' || *p == '"')
+				quote = *p;
+			else if (*p == '(')
+				depth++;
+			else if (*p == ')')
+				depth--;
+
+			if (isspace((unsigned char) *p))
+			{
+				if (q > clause && q[-1] != ' ')
+					*q++ = ' ';
+			}
+			else
+				*q++ = toupper((unsigned char) *p);
+		}
+		*q = '\0';
+		if (*p == ',')
+			p++;
+
+		for (i = 0; scanning[i] && !ret; i++)
+			ret = (strpos(clause, scanning[i]) >= 0);
+		for (i = 0; unless_not_valid[i] && !ret; i++)
+			ret = (strpos(clause, unless_not_valid[i]) >= 0 &&
+				   strpos(clause, "NOT VALID") < 0);
+	}
+
+	free(clause);
+	return ret;
+}
+
+/*
+ * Fast path: try the ALTER on the original table itself, for changes such
+ * as ADD COLUMN with a constant default, widening a varchar, a binary
+ * coercible type change or DROP NOT NULL, which PostgreSQL makes in the
+ * catalogs alone. The AccessExclusive lock is taken like the swap takes
+ * it; the ALTER then runs with halo_migrate.forbid_rewrite on, and under a
+ * statement_timeout against anything scanning the table that
+ * alter_may_scan() did not foresee.
+ *
+ * Returns 1 if the table was altered, 0 if it needs the copy after all,
+ * and -1 if the ALTER failed otherwise.
+ */
+static int
+alter_in_place(migrate_table *table)
+{
+	PGconn		   *conn = table->conn;
+	PGresult	   *res;
+	const char	   *params[2];
+	char			buffer[12];
+	StringInfoData	sql;
+	lock_window		lw;
+	int				ret;
+
+	if (!advisory_lock(conn, utoa(table->target_oid, buffer)))
+		return -1;
+
+	timeline_begin(table, "alter lock", false);
+	if (!lock_exclusive(conn, table->conn2, buffer, true))
+	{
+		elog(WARNING, "lock_exclusive() failed for %s", table->target_name);
+		ret = -1;
+		goto unlock;
+	}
+	table->lock_wait_usec += lock_waited_usec;
+	lock_window_begin(&lw, "alter");
+
+	initStringInfo(&sql);
+	printfStringInfo(&sql, "SET LOCAL statement_timeout = %d",
+					 lock_budget > 0 ? lock_budget : ALTER_IN_PLACE_TIMEOUT_MS);
+	pgut_command(conn, sql.data, 0, NULL);
+	pgut_command(conn, "SET LOCAL halo_migrate.forbid_rewrite = on", 0, NULL);
+
+	printfStringInfo(&sql, "ALTER TABLE %s %s", table->target_name, alter_actions);
+	res = pgut_execute_elevel(conn, sql.data, 0, NULL, DEBUG2);
+	lock_window_step(&lw, "alter");
+
+	if (PQresultStatus(res) == PGRES_COMMAND_OK)
+	{
+		pgut_command(conn, "COMMIT", 0, NULL);
+		lock_window_step(&lw, "commit");
+		lock_window_end(&lw, table, true);
+		elog(INFO, "altered table \"%s\" in place: %s", table->target_name, alter_actions);
+		ret = 1;
+	}
+	else
+	{
+		ret = (sqlstate_equals(res, SQLSTATE_OBJECT_NOT_IN_PREREQUISITE_STATE) ||
+			   sqlstate_equals(res, SQLSTATE_QUERY_CANCELED)) ? 0 : -1;
+		if (ret < 0)
+			ereport(WARNING,
+					(errcode(E_PG_COMMAND),
+					 errmsg("not able to apply the alter statement, received error \"%s\"", PQerrorMessage(conn)),
+					 errdetail("please debug and provide a valid alter statement")));
+		else
+			elog(DEBUG2, "the alter statement needs a copy of %s: %s",
+				 table->target_name, PQerrorMessage(conn));
+		pgut_rollback(conn);
+		lock_window_step(&lw, "rollback");
+		lock_window_end(&lw, table, true);
+	}
+	timeline_end(table, "alter lock", -1, -1);
+	CLEARPGRES(res);
+	termStringInfo(&sql);
+
+unlock:
+	params[0] = MIGRATE_LOCK_PREFIX_STR;
+	params[1] = buffer;
+	res = pgut_execute(conn, "SELECT pg_advisory_unlock($1, CAST(-2147483648 + $2::bigint AS integer))",
+					   2, params);
+	CLEARPGRES(res);
+	return ret;
+}
+
 /* Obtain an advisory lock on the table's OID, to make sure no other
  * halo_migrate is working on the table.
  */
@@ -2146,7 +4769,7 @@ static bool advisory_lock(PGconn *conn, const char *relid)
 			   2, params);
 
 	if (PQresultStatus(res) != PGRES_TUPLES_OK) {
-		elog(ERROR, "%s",  PQerrorMessage(connection));
+		elog(ERROR, "%s",  PQerrorMessage(conn));
 	}
 	else if (strcmp(getstr(res, 0, 0), "t") != 0) {
 		elog(ERROR, "Another halo_migrate command may be running on the table. Please try again later.");
@@ -2160,27 +4783,28 @@ static bool advisory_lock(PGconn *conn, const char *relid)
 
 /*
  * Try acquire an ACCESS EXCLUSIVE table lock, avoiding deadlocks and long
- * waits by killing off other sessions.
+ * waits by killing off the sessions blocking us once wait_timeout expires.
  * Arguments:
  *
  *  conn: connection to use
+ *  observer: idle connection used to watch and cancel the sessions which
+ *            block conn; a temporary one is opened if NULL
  *  relid: OID of relation
- *  lock_query: LOCK TABLE ... IN ACCESS EXCLUSIVE query to be executed
  *  start_xact: whether we will issue a BEGIN ourselves. If not, we will
  *              use a SAVEPOINT and ROLLBACK TO SAVEPOINT if our query
  *              times out, to avoid leaving the transaction in error state.
  */
 static bool
-lock_exclusive(PGconn *conn, const char *relid, const char *lock_query, bool start_xact)
+lock_exclusive(PGconn *conn, PGconn *observer, const char *relid, bool start_xact)
 {
 	time_t		start = time(NULL);
+	int64		start_usec = pgut_monotonic_usec();
 	int			i;
 	bool		ret = true;
 
 	for (i = 1; ; i++)
 	{
 		time_t		duration;
-		char		sql[1024];
 		PGresult   *res;
 		int			wait_msec;
 
@@ -2206,43 +4830,47 @@ lock_exclusive(PGconn *conn, const char *relid, const char *lock_query, bool sta
 			}
 			else
 			{
-				const char *cancel_query;
-				if (PQserverVersion(conn) >= 80400 &&
-					duration > wait_timeout * 2)
-				{
-					elog(WARNING, "terminating conflicted backends");
-					cancel_query =
-						"SELECT pg_terminate_backend(pid) FROM pg_locks"
-						" WHERE locktype = 'relation'"
-						"   AND relation = $1 AND pid <> pg_backend_pid()";
-				}
+				int		locked;
+
+				/* Queue for the lock ourselves so that pg_blocking_pids()
+				 * names exactly the sessions in our way, and cancel those
+				 * alone; everyone else merely holding a lock on the table
+				 * is left to finish.
+				 */
+				locked = lock_cancel_blockers(conn, observer, relid,
+											  Min(1000, i * 100),
+											  duration > wait_timeout * 2);
+				if (locked > 0)
+					break;
+
+				if (start_xact)
+					pgut_rollback(conn);
 				else
+					pgut_command(conn, "ROLLBACK TO SAVEPOINT migrate_sp1", 0, NULL);
+
+				if (locked < 0)
 				{
-					elog(WARNING, "canceling conflicted backends");
-					cancel_query =
-						"SELECT pg_cancel_backend(pid) FROM pg_locks"
-						" WHERE locktype = 'relation'"
-						"   AND relation = $1 AND pid <> pg_backend_pid()";
+					ret = false;
+					break;
 				}
-
-				pgut_command(conn, cancel_query, 1, &relid);
+				continue;
 			}
 		}
 
 		/* wait for a while to lock the table. */
 		wait_msec = Min(1000, i * 100);
-		snprintf(sql, lengthof(sql), "SET LOCAL statement_timeout = %d", wait_msec);
-		pgut_command(conn, sql, 0, NULL);
-
-		res = pgut_execute_elevel(conn, lock_query, 0, NULL, DEBUG2);
-		if (PQresultStatus(res) == PGRES_COMMAND_OK)
+		pgut_label = "lock_exclusive attempt";
+		res = try_lock_table(conn, atooid(relid), "ACCESS EXCLUSIVE", wait_msec);
+		if (PQresultStatus(res) == PGRES_TUPLES_OK &&
+			strcmp(getstr(res, 0, 0), "t") == 0)
 		{
 			CLEARPGRES(res);
 			break;
 		}
-		else if (sqlstate_equals(res, SQLSTATE_QUERY_CANCELED))
+		else if (PQresultStatus(res) == PGRES_TUPLES_OK)
 		{
 			/* retry if lock conflicted */
+			elog(DEBUG2, "could not lock relation %s within %d ms", relid, wait_msec);
 			CLEARPGRES(res);
 			if (start_xact)
 				pgut_rollback(conn);
@@ -2253,17 +4881,165 @@ lock_exclusive(PGconn *conn, const char *relid, const char *lock_query, bool sta
 		else
 		{
 			/* exit otherwise */
-			printf("%s", PQerrorMessage(connection));
+			printf("%s", PQerrorMessage(conn));
 			CLEARPGRES(res);
 			ret = false;
 			break;
 		}
 	}
 
-	pgut_command(conn, "RESET statement_timeout", 0, NULL);
+	lock_waited_usec = pgut_monotonic_usec() - start_usec;
+	return ret;
+}
+
+/*
+ * Wait for an ACCESS EXCLUSIVE lock with a plain LOCK TABLE bounded by
+ * wait_msec, and meanwhile cancel the sessions which pg_blocking_pids()
+ * reports in front of us, one at a time and cheapest first (see
+ * SQL_LOCK_BLOCKERS). Idle-in-transaction sessions ignore a cancel, so they
+ * are always terminated; the others are only when "terminate" is set.
+ *
+ * conn must be inside a transaction or savepoint which the caller rolls
+ * back unless we got the lock. Returns 1 if the lock was acquired, 0 if we
+ * timed out, and -1 on any other error.
+ */
+static int
+lock_cancel_blockers(PGconn *conn, PGconn *observer, const char *relid,
+					 int wait_msec, bool terminate)
+{
+	PGconn		   *own_observer = NULL;
+	PGresult	   *res;
+	StringInfoData	sql;
+	char			backend_pid[32];
+	const char	   *params[2];
+	char		   *own_pids = NULL;
+	char		   *last_pid = NULL;
+	int				ret = 1;
+
+	if (observer == NULL)
+	{
+		observer = own_observer = open_connection(WARNING);
+		if (observer == NULL)
+			return -1;
+	}
+
+	initStringInfo(&sql);
+	printfStringInfo(&sql, "SET LOCAL lock_timeout = %d", wait_msec);
+	pgut_command(conn, sql.data, 0, NULL);
+
+	/* ONLY: a partitioned parent is locked alone, as migrate.lock_table() does */
+	res = pgut_execute(conn, "SELECT $1::regclass", 1, &relid);
+	printfStringInfo(&sql, "LOCK TABLE ONLY %s IN ACCESS EXCLUSIVE MODE",
+					 getstr(res, 0, 0));
+	CLEARPGRES(res);
+
+	if (!pgut_send(conn, sql.data, 0, NULL))
+	{
+		elog(WARNING, "%s", PQerrorMessage(conn));
+		ret = -1;
+		goto done;
+	}
+
+	snprintf(backend_pid, sizeof(backend_pid), "%d", PQbackendPID(conn));
+	own_pids = own_backend_pids();
+
+	for (;;)
+	{
+		struct timeval	timeout = { 0, 50000 };		/* 50 ms */
+		const char	   *blocker;
+		const char	   *state;
+		bool			kill;
+
+		if (wait_for_socket(PQsocket(conn), &timeout) > 0 &&
+			!PQconsumeInput(conn))
+			break;
+		if (!PQisBusy(conn))
+			break;
+
+		params[0] = backend_pid;
+		params[1] = own_pids;
+		res = pgut_execute_elevel(observer, SQL_LOCK_BLOCKERS, 2, params, DEBUG2);
+		if (PQresultStatus(res) != PGRES_TUPLES_OK || PQntuples(res) == 0)
+		{
+			CLEARPGRES(res);
+			continue;
+		}
+
+		/* Give the session we signalled last time a chance to go away */
+		blocker = getstr(res, 0, 0);
+		if (last_pid && strcmp(last_pid, blocker) == 0)
+		{
+			CLEARPGRES(res);
+			continue;
+		}
+
+		state = getstr(res, 0, 1);
+		kill = terminate ||
+			strncmp(state, "idle in transaction", strlen("idle in transaction")) == 0;
+		elog(WARNING, "%s backend %s blocking the lock on %s (%s, transaction age %s)",
+			 kill ? "terminating" : "canceling", blocker, relid, state,
+			 getstr(res, 0, 2));
+
+		free(last_pid);
+		last_pid = pgut_strdup(blocker);
+		CLEARPGRES(res);
+
+		params[0] = last_pid;
+		res = pgut_execute_elevel(observer,
+								  kill ? "SELECT pg_terminate_backend($1)"
+									   : "SELECT pg_cancel_backend($1)",
+								  1, params, WARNING);
+		CLEARPGRES(res);
+	}
+
+	while ((res = PQgetResult(conn)) != NULL)
+	{
+		if (PQresultStatus(res) != PGRES_COMMAND_OK && ret > 0)
+		{
+			if (sqlstate_equals(res, SQLSTATE_LOCK_NOT_AVAILABLE))
+				ret = 0;
+			else
+			{
+				elog(WARNING, "%s", PQerrorMessage(conn));
+				ret = -1;
+			}
+		}
+		CLEARPGRES(res);
+	}
+
+	if (ret > 0)
+		pgut_command(conn, "RESET lock_timeout", 0, NULL);
+
+done:
+	free(own_pids);
+	free(last_pid);
+	termStringInfo(&sql);
+	pgut_disconnect(own_observer);
 	return ret;
 }
 
+/*
+ * Run migrate.lock_table(), which takes the lock without joining the lock
+ * queue while long transactions hold conflicting locks, so that a waiting
+ * lock request of ours does not stall the other sessions. Returns its
+ * result, true if the lock was granted within budget_ms.
+ */
+static PGresult *
+try_lock_table(PGconn *conn, Oid relid, const char *lockmode, int budget_ms)
+{
+	const char *params[3];
+	char		relid_buf[12];
+	char		budget_buf[12];
+
+	params[0] = utoa(relid, relid_buf);
+	params[1] = lockmode;
+	params[2] = utoa(budget_ms, budget_buf);
+
+	return pgut_execute_elevel(conn,
+							   "SELECT migrate.lock_table($1, $2, $3)",
+							   3, params, DEBUG2);
+}
+
 static int
 strpos(const char *hay, const char *needle)
 {
@@ -2476,15 +5252,15 @@ parse_indexdef(IndexDef *stmt, char *sql, const char *idxname, const char *tblna
 void
 migrate_cleanup_callback(bool fatal, void *userdata)
 {
-	Oid			target_table = *(Oid *) userdata;
+	migrate_table *table = (migrate_table *) userdata;
 	const char *params[2];
 	char		buffer[12];
 	char		num_buff[12];
 
 	if(fatal)
 	{
-		params[0] = utoa(target_table, buffer);
-		params[1] = utoa(temp_obj_num, num_buff);
+		params[0] = utoa(table->target_oid, buffer);
+		params[1] = utoa(table->temp_obj_num, num_buff);
 
 		/* testing PQstatus() of connection and conn2, as we do
 		 * in migrate_cleanup(), doesn't seem to work here,
@@ -2492,7 +5268,7 @@ migrate_cleanup_callback(bool fatal, void *userdata)
 		 */
 		reconnect(ERROR);
 		command("SELECT migrate.migrate_drop($1, $2)", 2, params);
-		temp_obj_num = 0; /* reset temporary object counter after cleanup */
+		table->temp_obj_num = 0; /* reset temporary object counter after cleanup */
 	}
 }
 
@@ -2501,7 +5277,7 @@ migrate_cleanup_callback(bool fatal, void *userdata)
  * objects before the program exits.
  */
 static void
-migrate_cleanup(bool fatal, const migrate_table *table)
+migrate_cleanup(bool fatal, migrate_table *table)
 {
 	if (fatal)
 	{
@@ -2513,16 +5289,17 @@ migrate_cleanup(bool fatal, const migrate_table *table)
 		char		num_buff[12];
 		const char *params[2];
 
-		/* Try reconnection if not available. */
-		if (PQstatus(connection) != CONNECTION_OK ||
-			PQstatus(conn2) != CONNECTION_OK)
-			reconnect(ERROR);
+		/* Try reconnection if not available. The table's connections
+		 * are reset in place, as the next table in the slot uses them.
+		 */
+		reset_connection(table->conn);
+		reset_connection(table->conn2);
 
 		/* do cleanup */
 		params[0] = utoa(table->target_oid, buffer);
-		params[1] =  utoa(temp_obj_num, num_buff);
-		command("SELECT migrate.migrate_drop($1, $2)", 2, params);
-		temp_obj_num = 0; /* reset temporary object counter after cleanup */
+		params[1] =  utoa(table->temp_obj_num, num_buff);
+		pgut_command(table->conn, "SELECT migrate.migrate_drop($1, $2)", 2, params);
+		table->temp_obj_num = 0; /* reset temporary object counter after cleanup */
 	}
 }
 
@@ -2665,10 +5442,7 @@ repack_table_indexes(PGresult *index_details)
 	}
 
 	/* take an exclusive lock on table before calling migrate_index_swap() */
-	resetStringInfo(&sql);
-	appendStringInfo(&sql, "LOCK TABLE %s IN ACCESS EXCLUSIVE MODE",
-					 table_name);
-	if (!(lock_exclusive(connection, params[1], sql.data, true)))
+	if (!(lock_exclusive(connection, conn2, params[1], true)))
 	{
 		elog(WARNING, "lock_exclusive() failed in connection for %s",
 			 table_name);
@@ -2846,6 +5620,7 @@ pgut_help(bool details)
 
 	printf("Options:\n");
 	printf("  -t, --table=TABLE         table to target\n");
+	printf("  -I, --parent-table=TABLE  target the partitions or inheritors of TABLE\n");
 	printf("  -d, --database=DATABASE   database in which the table lives\n");
 	printf("  -s, --tablespace=TBLSPC   move table to a new tablespace\n");
 	printf("  -a, --alter=ALTER         SQL of the alter statement\n");
@@ -2854,4 +5629,23 @@ pgut_help(bool details)
 	printf("  -T, --wait-timeout=SECS   timeout to cancel other backends on conflict\n");
 	printf("  -D, --no-kill-backend     don't kill other backends when timed out\n");
 	printf("  -k, --no-superuser-check  skip superuser checks in client\n");
+	printf("  --index-memory=MB         maintenance_work_mem shared by concurrent index builds\n");
+	printf("  --index-parallel-workers=NUM  parallel maintenance workers shared by index builds\n");
+	printf("  --tables-in-flight=NUM    copy the next tables while earlier ones build indexes\n");
+	printf("  --swap-window=HH:MM-HH:MM only swap tables within this local time window\n");
+	printf("  --swap-max-sessions=NUM   delay the swap while more sessions use the table\n");
+	printf("  --swap-max-tps=NUM        delay the swap while the table changes more rows/s\n");
+	printf("  --lock-budget=MS          roll back and retry any exclusive lock held longer\n");
+	printf("  --keep-oid                swap the table's storage, keeping its OID and dependents\n");
+	printf("  --max-connections=NUM     server connections of all tables and index workers\n");
+	printf("  --max-copies=NUM          copy at most this many tables at a time\n");
+	printf("  --copy-rate=MB            space copy starts by table size at MB/s\n");
+	printf("  --estimate-sample=ROWS    calibrate the dry run estimate by copying ROWS rows\n");
+	printf("  --always-copy             copy the table even if the ALTER needs no rewrite\n");
+	printf("  --report=FILE             append a JSON timeline of each table to FILE (- for stdout)\n");
+	printf("  --report-events           also report each phase in --report as it ends\n");
+	printf("  --compare-history         warn about runs slower than similar ones in migrate.history\n");
+	printf("  --wait-profile            print where the backends of each phase waited\n");
+	printf("  --slow-statement=MS       log statements taking MS milliseconds or longer\n");
+	printf("  --statement-stats         log a latency histogram of each kind of statement at exit\n");
 }
@@ -32,6 +32,7 @@ PGconn	   *connection = NULL;
 PGconn     *conn2      = NULL;
 
 worker_conns workers   = {
+	.max_num_workers = 0,
 	.num_workers     = 0,
 	.conns           = NULL
 };
@@ -41,88 +42,245 @@ static bool parse_pair(const char buffer[], char key[], char value[]);
 static char *get_username(void);
 
 
+/* Append the connection options given on the command line to 'buf'. */
+static void
+append_conninfo(StringInfo buf)
+{
+	if (dbname && dbname[0])
+		appendStringInfo(buf, "dbname=%s ", dbname);
+	if (host && host[0])
+		appendStringInfo(buf, "host=%s ", host);
+	if (port && port[0])
+		appendStringInfo(buf, "port=%s ", port);
+	if (username && username[0])
+		appendStringInfo(buf, "user=%s ", username);
+	if (password && password[0])
+		appendStringInfo(buf, "password=%s ", password);
+}
+
+/*
+ * Open 'count' connections at once with PQconnectStart() and PQconnectPoll(),
+ * so that the pool grows in about one connection round-trip instead of one
+ * per worker. Connections which are established are stored in conns[] and
+ * the failed ones are set to NULL.
+ */
+static void
+connect_workers_async(const char *conninfo, PGconn **conns, int count)
+{
+	PostgresPollingStatusType  *state;
+	int			pending = 0;
+	int			i;
+
+	state = pgut_newarray(PostgresPollingStatusType, count);
+
+	for (i = 0; i < count; i++)
+	{
+		/* Don't prompt for password again; we should have gotten
+		 * it already from reconnect(). Don't confuse pgut_connections
+		 * by using pgut_connect() either.
+		 */
+		conns[i] = PQconnectStart(conninfo);
+		if (conns[i] == NULL || PQstatus(conns[i]) == CONNECTION_BAD)
+			state[i] = PGRES_POLLING_FAILED;
+		else
+		{
+			state[i] = PGRES_POLLING_WRITING;
+			pending++;
+		}
+	}
+
+	while (pending > 0)
+	{
+		fd_set		rmask;
+		fd_set		wmask;
+		int			maxsock = -1;
+		struct timeval timeout;
+
+		CHECK_FOR_INTERRUPTS();
+
+		FD_ZERO(&rmask);
+		FD_ZERO(&wmask);
+		for (i = 0; i < count; i++)
+		{
+			int		sock;
+
+			if (state[i] != PGRES_POLLING_READING &&
+				state[i] != PGRES_POLLING_WRITING)
+				continue;
+
+			sock = PQsocket(conns[i]);
+			if (state[i] == PGRES_POLLING_READING)
+				FD_SET(sock, &rmask);
+			else
+				FD_SET(sock, &wmask);
+			if (sock > maxsock)
+				maxsock = sock;
+		}
+
+		/* timeout to check interrupts periodically */
+		timeout.tv_sec = 1;
+		timeout.tv_usec = 0;
+		if (select(maxsock + 1, &rmask, &wmask, NULL, &timeout) < 0)
+		{
+			if (errno == EINTR)
+				continue;
+			elog(ERROR, "select failed: %s", strerror(errno));
+		}
+
+		for (i = 0; i < count; i++)
+		{
+			if (state[i] != PGRES_POLLING_READING &&
+				state[i] != PGRES_POLLING_WRITING)
+				continue;
+			if (!FD_ISSET(PQsocket(conns[i]), &rmask) &&
+				!FD_ISSET(PQsocket(conns[i]), &wmask))
+				continue;
+
+			state[i] = PQconnectPoll(conns[i]);
+			if (state[i] == PGRES_POLLING_OK ||
+				state[i] == PGRES_POLLING_FAILED)
+				pending--;
+		}
+	}
+
+	for (i = 0; i < count; i++)
+	{
+		if (state[i] == PGRES_POLLING_OK)
+			continue;
+
+		elog(WARNING, "Unable to set up worker conn: %s",
+			 conns[i] ? PQerrorMessage(conns[i]) : "out of memory");
+		if (conns[i])
+			PQfinish(conns[i]);
+		conns[i] = NULL;
+	}
+
+	free(state);
+}
+
 /*
- * Set up worker conns which will be used for concurrent index rebuilds.
- * 'num_workers' is the desired number of worker connections, i.e. from
- * --jobs flag. Due to max_connections we might not actually be able to
- * set up that many workers, but don't treat that as a fatal error.
+ * Resize the pool of worker conns which are used for concurrent index
+ * rebuilds. 'num_workers' is the desired number of worker connections, i.e.
+ * from --jobs flag; the pool is shut down if it is 1 or less. The pool is
+ * kept open across tables, so this may be called again to grow or shrink
+ * it. Due to max_connections we might not actually be able to set up that
+ * many workers, but don't treat that as a fatal error.
  */
 void
 setup_workers(int num_workers)
 {
- 	StringInfoData	buf;
- 	int i;
- 	PGconn *conn;
+	StringInfoData	buf;
+	PGconn		  **new_conns;
+	int				num_new;
+	int				i;
 
- 	elog(DEBUG2, "In setup_workers(), target num_workers = %d", num_workers);
+	elog(DEBUG2, "In setup_workers(), target num_workers = %d, have %d",
+		 num_workers, workers.num_workers);
 
- 	if (num_workers > 1 && num_workers > workers.num_workers)
- 	{
- 		initStringInfo(&buf);
- 		if (dbname && dbname[0])
- 			appendStringInfo(&buf, "dbname=%s ", dbname);
- 		if (host && host[0])
- 			appendStringInfo(&buf, "host=%s ", host);
- 		if (port && port[0])
- 			appendStringInfo(&buf, "port=%s ", port);
- 		if (username && username[0])
- 			appendStringInfo(&buf, "user=%s ", username);
- 		if (password && password[0])
- 			appendStringInfo(&buf, "password=%s ", password);
-
- 		if (workers.conns == NULL)
- 		{
- 			elog(NOTICE, "Setting up workers.conns");
- 			workers.conns = (PGconn **) pgut_malloc(sizeof(PGconn *) * num_workers);
- 		}
- 		else
- 		{
- 			elog(ERROR, "TODO: Implement pool resizing.");
- 		}
+	if (num_workers <= 1)
+	{
+		disconnect_workers();
+		return;
+	}
 
- 		for (i = 0; i < num_workers; i++)
- 		{
- 			/* Don't prompt for password again; we should have gotten
- 			 * it already from reconnect().
- 			 */
- 			elog(DEBUG2, "Setting up worker conn %d", i);
-
- 			/* Don't confuse pgut_connections by using pgut_connect()
-			 *
-			 * XXX: could use PQconnectStart() and PQconnectPoll() to
-			 * open these connections in non-blocking manner.
-			 */
- 			conn = PQconnectdb(buf.data);
- 			if (PQstatus(conn) == CONNECTION_OK)
- 			{
- 				workers.conns[i] = conn;
- 			}
-			else
-			{
-				elog(WARNING, "Unable to set up worker conn #%d: %s", i,
-					 PQerrorMessage(conn));
-				break;
-			}
+	/* Shrink: close the connections we no longer want. */
+	while (workers.num_workers > num_workers)
+	{
+		workers.num_workers--;
+		elog(DEBUG2, "Disconnecting worker %d.", workers.num_workers);
+		PQfinish(workers.conns[workers.num_workers]);
+		workers.conns[workers.num_workers] = NULL;
+	}
 
-			/* Hardcode a search path to avoid injections into public or pg_temp */
-			pgut_command(conn, "SET search_path TO pg_catalog, pg_temp, public", 0, NULL);
+	if (workers.num_workers == num_workers)
+		return;
 
-            /* Make sure each worker connection can work in non-blocking
-             * mode.
-             */
-            if (PQsetnonblocking(workers.conns[i], 1))
-			{
-				elog(ERROR, "Unable to set worker connection %d "
-					 "non-blocking.", i);
-			}
- 		}
-		/* In case we bailed out of setting up all workers, record
-		 * how many successful worker conns we actually have.
+	/* Grow */
+	if (num_workers > workers.max_num_workers)
+	{
+		workers.conns = (PGconn **) pgut_realloc(workers.conns,
+											sizeof(PGconn *) * num_workers);
+		workers.max_num_workers = num_workers;
+	}
+
+	initStringInfo(&buf);
+	append_conninfo(&buf);
+
+	num_new = num_workers - workers.num_workers;
+	new_conns = pgut_newarray(PGconn *, num_new);
+	connect_workers_async(buf.data, new_conns, num_new);
+
+	for (i = 0; i < num_new; i++)
+	{
+		PGconn *conn = new_conns[i];
+
+		if (conn == NULL)
+			continue;
+
+		/* Hardcode a search path to avoid injections into public or pg_temp */
+		pgut_command(conn, "SET search_path TO pg_catalog, pg_temp, public", 0, NULL);
+
+		/* Make sure each worker connection can work in non-blocking
+		 * mode.
 		 */
- 		workers.num_workers = i;
+		if (PQsetnonblocking(conn, 1))
+		{
+			elog(ERROR, "Unable to set worker connection %d "
+				 "non-blocking.", workers.num_workers);
+		}
 
- 		termStringInfo(&buf);
- 	}
+		elog(DEBUG2, "Set up worker conn %d", workers.num_workers);
+		workers.conns[workers.num_workers++] = conn;
+	}
+
+	/* In case we bailed out of setting up all workers, say how many
+	 * successful worker conns we actually have.
+	 */
+	if (workers.num_workers < num_workers)
+		elog(WARNING, "Using %d of %d requested worker conns",
+			 workers.num_workers, num_workers);
+
+	free(new_conns);
+	termStringInfo(&buf);
+}
+
+/*
+ * Replace worker conns which are broken or were left in the middle of a
+ * command, e.g. by an index build which failed. Returns the number of
+ * usable workers.
+ */
+int
+check_workers(void)
+{
+	int		dropped = 0;
+	int		i;
+
+	for (i = 0; i < workers.num_workers; i++)
+	{
+		PGconn *conn = workers.conns[i];
+
+		/* PQconsumeInput() notices a connection closed by the server */
+		if (PQstatus(conn) == CONNECTION_OK &&
+			PQconsumeInput(conn) &&
+			!PQisBusy(conn) &&
+			PQtransactionStatus(conn) == PQTRANS_IDLE)
+			continue;
+
+		elog(WARNING, "Replacing worker conn %d: %s", i,
+			 PQstatus(conn) == CONNECTION_OK ?
+			 "connection is not idle" : PQerrorMessage(conn));
+		PQfinish(conn);
+		workers.conns[i] = workers.conns[workers.num_workers - 1];
+		workers.conns[workers.num_workers - 1] = NULL;
+		workers.num_workers--;
+		dropped++;
+		i--;
+	}
+
+	if (dropped > 0)
+		setup_workers(workers.num_workers + dropped);
+
+	return workers.num_workers;
 }
 
 /* Disconnect all our worker conns. */
@@ -148,9 +306,10 @@ void disconnect_workers(void)
  			}
  		}
  		workers.num_workers = 0;
- 		free(workers.conns);
-		workers.conns = NULL;
  	}
+	free(workers.conns);
+	workers.conns = NULL;
+	workers.max_num_workers = 0;
 }
 
 
@@ -163,18 +322,21 @@ reconnect(int elevel)
 	StringInfoData	buf;
 	char		   *new_password;
 
-	disconnect();
+	/* The worker pool stays open; it does not depend on the state
+	 * of the primary connections.
+	 */
+	if (connection)
+	{
+		pgut_disconnect(connection);
+		connection = NULL;
+	}
+	if (conn2)
+	{
+		pgut_disconnect(conn2);
+		conn2 = NULL;
+	}
 	initStringInfo(&buf);
-	if (dbname && dbname[0])
-		appendStringInfo(&buf, "dbname=%s ", dbname);
-	if (host && host[0])
-		appendStringInfo(&buf, "host=%s ", host);
-	if (port && port[0])
-		appendStringInfo(&buf, "port=%s ", port);
-	if (username && username[0])
-		appendStringInfo(&buf, "user=%s ", username);
-	if (password && password[0])
-		appendStringInfo(&buf, "password=%s ", password);
+	append_conninfo(&buf);
 
 	connection = pgut_connect(buf.data, prompt_password, elevel);
 	conn2      = pgut_connect(buf.data, prompt_password, elevel);
@@ -194,6 +356,41 @@ reconnect(int elevel)
 	termStringInfo(&buf);
 }
 
+/*
+ * Open one more connection with the options of the primary one, e.g. for
+ * tables migrated concurrently. Call after reconnect(), so that the
+ * password is known and not prompted for again.
+ */
+PGconn *
+open_connection(int elevel)
+{
+	StringInfoData	buf;
+	PGconn		   *conn;
+
+	initStringInfo(&buf);
+	append_conninfo(&buf);
+	conn = pgut_connect(buf.data, NO, elevel);
+	termStringInfo(&buf);
+
+	return conn;
+}
+
+/*
+ * Re-establish 'conn' in place if it was lost.
+ */
+void
+reset_connection(PGconn *conn)
+{
+	if (conn == NULL || PQstatus(conn) == CONNECTION_OK)
+		return;
+
+	PQreset(conn);
+	if (PQstatus(conn) == CONNECTION_OK)
+		pgut_command(conn, "SET search_path TO pg_catalog, pg_temp, public", 0, NULL);
+	else
+		elog(ERROR, "could not reconnect to database: %s", PQerrorMessage(conn));
+}
+
 void
 disconnect(void)
 {
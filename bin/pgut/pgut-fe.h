@@ -50,8 +50,8 @@ typedef void (*pgut_optfn) (pgut_option *opt, const char *arg);
 
 typedef struct worker_conns
 {
-    int      max_num_workers;
-    int      num_workers;
+    int      max_num_workers;	/* allocated length of conns */
+    int      num_workers;		/* open connections, conns[0 .. num_workers-1] */
     PGconn **conns;
 } worker_conns;
 
@@ -73,7 +73,10 @@ extern void help(bool details);
 
 extern void disconnect(void);
 extern void reconnect(int elevel);
+extern PGconn *open_connection(int elevel);
+extern void reset_connection(PGconn *conn);
 extern void setup_workers(int num_workers);
+extern int check_workers(void);
 extern void disconnect_workers(void);
 extern PGresult *execute(const char *query, int nParams, const char **params);
 extern PGresult *execute_elevel(const char *query, int nParams, const char **params, int elevel);
@@ -47,6 +47,28 @@ int			pgut_log_level = INFO;
 int			pgut_abort_level = ERROR;
 bool		pgut_echo = false;
 
+/* statement timing, see pgut_execute_elevel() */
+const char *pgut_label = NULL;
+int			pgut_slow_statement_ms = -1;
+bool		pgut_statement_stats = false;
+
+#define STATEMENT_LABEL_LEN		64
+#define STATEMENT_BUCKETS		32	/* up to 2^32 us, over an hour */
+
+/* Latencies of the statements run under one label */
+typedef struct pgutStatementStats
+{
+	char		label[STATEMENT_LABEL_LEN];
+	int64		count;
+	int64		total_usec;
+	int64		max_usec;
+	int64		buckets[STATEMENT_BUCKETS];	/* [i]: below 2^(i + 1) us */
+} pgutStatementStats;
+
+static pgutStatementStats *statement_stats = NULL;
+static int	n_statement_stats = 0;
+static int	max_statement_stats = 0;
+
 /* Database connections */
 typedef struct pgutConn	pgutConn;
 struct pgutConn
@@ -65,6 +87,9 @@ static void on_after_exec(pgutConn *conn);
 static void on_interrupt(void);
 static void on_cleanup(void);
 static void exit_or_abort(int exitcode, int elevel);
+static void statement_label(const char *query, char *label);
+static void record_statement(const char *query, const char *label, int64 usec);
+static void print_statement_stats(void);
 
 void
 pgut_init(int argc, char **argv)
@@ -579,6 +604,20 @@ pgut_disconnect_all(void)
 	pgut_conn_unlock();
 }
 
+/* Append the backend PIDs of the open connections, comma separated. */
+void
+pgut_append_backend_pids(StringInfo buf)
+{
+	pgutConn   *c;
+
+	pgut_conn_lock();
+	for (c = pgut_connections; c; c = c->next)
+		if (PQstatus(c->conn) == CONNECTION_OK)
+			appendStringInfo(buf, "%s%d", buf->len > 0 ? "," : "",
+							 PQbackendPID(c->conn));
+	pgut_conn_unlock();
+}
+
 static void
 echo_query(const char *query, int nParams, const char **params)
 {
@@ -598,11 +637,162 @@ pgut_execute(PGconn* conn, const char *query, int nParams, const char **params)
 	return pgut_execute_elevel(conn, query, nParams, params, ERROR);
 }
 
+/*
+ * Derive the label of a statement run without pgut_label: its first three
+ * words, up to the first parenthesis, such as "SELECT migrate.migrate_apply"
+ * or "ROLLBACK TO SAVEPOINT".
+ */
+static void
+statement_label(const char *query, char *label)
+{
+	int		words = 0;
+	int		len = 0;
+
+	while (isspace((unsigned char) *query))
+		query++;
+	for (; *query && *query != '(' && *query != ';' &&
+		 len < STATEMENT_LABEL_LEN - 1; query++)
+	{
+		if (isspace((unsigned char) *query))
+		{
+			if (++words == 3)
+				break;
+			while (isspace((unsigned char) query[1]))
+				query++;
+			label[len++] = ' ';
+		}
+		else
+			label[len++] = *query;
+	}
+	label[len] = '\0';
+}
+
+/*
+ * Account for a statement which took 'usec': log it if it is over
+ * pgut_slow_statement_ms, and add it to the latency histogram of its label
+ * with pgut_statement_stats.
+ */
+static void
+record_statement(const char *query, const char *label, int64 usec)
+{
+	char				derived[STATEMENT_LABEL_LEN];
+	pgutStatementStats *stats;
+	int					bucket;
+	int					i;
+
+	if (label == NULL)
+	{
+		statement_label(query, derived);
+		label = derived;
+	}
+
+	if (pgut_slow_statement_ms >= 0 && usec >= pgut_slow_statement_ms * INT64CONST(1000))
+		ereport(LOG,
+			(errmsg("slow statement %s: %.3f ms", label, usec / 1000.0),
+			 errdetail("query was: %s", query)));
+
+	if (!pgut_statement_stats)
+		return;
+
+	for (i = 0; i < n_statement_stats; i++)
+		if (strncmp(statement_stats[i].label, label, STATEMENT_LABEL_LEN - 1) == 0)
+			break;
+	if (i == n_statement_stats)
+	{
+		if (n_statement_stats == max_statement_stats)
+		{
+			max_statement_stats = Max(max_statement_stats * 2, 32);
+			statement_stats = pgut_realloc(statement_stats,
+				sizeof(pgutStatementStats) * max_statement_stats);
+		}
+		memset(&statement_stats[i], 0, sizeof(pgutStatementStats));
+		strlcpy(statement_stats[i].label, label, STATEMENT_LABEL_LEN);
+		n_statement_stats++;
+	}
+	stats = &statement_stats[i];
+
+	for (bucket = 0; bucket < STATEMENT_BUCKETS - 1 &&
+		 usec >= (INT64CONST(2) << bucket); bucket++)
+		;
+	stats->count++;
+	stats->total_usec += usec;
+	stats->max_usec = Max(stats->max_usec, usec);
+	stats->buckets[bucket]++;
+}
+
+/* qsort comparator: most total time first */
+static int
+statement_stats_cmp(const void *a, const void *b)
+{
+	const pgutStatementStats *sa = (const pgutStatementStats *) a;
+	const pgutStatementStats *sb = (const pgutStatementStats *) b;
+
+	if (sa->total_usec != sb->total_usec)
+		return (sa->total_usec > sb->total_usec) ? -1 : 1;
+	return strcmp(sa->label, sb->label);
+}
+
+/*
+ * Dump the latency histograms of pgut_statement_stats, the labels taking
+ * the most time first. Each bucket is counted under its upper bound; the
+ * percentiles are the upper bounds of the buckets they fall in.
+ */
+static void
+print_statement_stats(void)
+{
+	int		i;
+	int		j;
+
+	if (n_statement_stats == 0)
+		return;
+
+	qsort(statement_stats, n_statement_stats, sizeof(pgutStatementStats),
+		  statement_stats_cmp);
+	for (i = 0; i < n_statement_stats; i++)
+	{
+		pgutStatementStats *stats = &statement_stats[i];
+		PQExpBufferData		buckets;
+		int64				seen = 0;
+		double				p50 = 0;
+		double				p99 = 0;
+
+		initPQExpBuffer(&buckets);
+		for (j = 0; j < STATEMENT_BUCKETS; j++)
+		{
+			double		bound = (INT64CONST(2) << j) / 1000.0;
+
+			if (stats->buckets[j] == 0)
+				continue;
+			if (seen < (stats->count + 1) / 2 &&
+				seen + stats->buckets[j] >= (stats->count + 1) / 2)
+				p50 = bound;
+			if (seen < stats->count - stats->count / 100 &&
+				seen + stats->buckets[j] >= stats->count - stats->count / 100)
+				p99 = bound;
+			seen += stats->buckets[j];
+			appendPQExpBuffer(&buckets, "%s<%g:" INT64_FORMAT,
+							  buckets.len > 0 ? " " : "", bound, stats->buckets[j]);
+		}
+
+		elog(LOG, "statement %s: " INT64_FORMAT " calls, %.3f s, avg %.3f ms, p50 < %g ms, p99 < %g ms, max %.3f ms",
+			 stats->label, stats->count, stats->total_usec / 1000000.0,
+			 stats->total_usec / 1000.0 / stats->count, p50, p99,
+			 stats->max_usec / 1000.0);
+		elog(LOG, "statement %s histogram (ms): %s", stats->label, buckets.data);
+		termPQExpBuffer(&buckets);
+	}
+}
+
 PGresult *
 pgut_execute_elevel(PGconn* conn, const char *query, int nParams, const char **params, int elevel)
 {
 	PGresult   *res;
 	pgutConn   *c;
+	const char *label = pgut_label;
+	int64		start_usec = 0;
+
+	/* the label is for this statement only */
+	pgut_label = NULL;
 
 	CHECK_FOR_INTERRUPTS();
 
@@ -627,10 +817,14 @@ pgut_execute_elevel(PGconn* conn, const char *query, int nParams, const char **p
 
 	if (c)
 		on_before_exec(c);
+	if (pgut_statement_stats || pgut_slow_statement_ms >= 0)
+		start_usec = pgut_monotonic_usec();
 	if (nParams == 0)
 		res = PQexec(conn, query);
 	else
 		res = PQexecParams(conn, query, nParams, NULL, params, NULL, NULL, 0);
+	if (pgut_statement_stats || pgut_slow_statement_ms >= 0)
+		record_statement(query, label, pgut_monotonic_usec() - start_usec);
 	if (c)
 		on_after_exec(c);
 
@@ -1219,6 +1413,8 @@ on_cleanup(void)
 	in_cleanup = true;
 	interrupted = false;
 	call_atexit_callbacks(false);
+	if (pgut_statement_stats)
+		print_statement_stats();
 	pgut_disconnect_all();
 }
 
@@ -1576,6 +1772,26 @@ wait_for_sockets(int nfds, fd_set *fds, struct timeval *timeout)
 	}
 }
 
+/*
+ * Returns a monotonic timestamp in microseconds. Only differences between
+ * two values are meaningful; use it to measure durations, never wall time.
+ */
+int64
+pgut_monotonic_usec(void)
+{
+#ifndef WIN32
+	struct timespec	ts;
+
+	if (clock_gettime(CLOCK_MONOTONIC, &ts) != 0)
+		ereport(ERROR,
+			(errcode_errno(),
+			 errmsg("clock_gettime failed: ")));
+	return (int64) ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+#else
+	return (int64) GetTickCount64() * 1000;
+#endif
+}
+
 #ifndef WIN32
 static void
 handle_sigint(SIGNAL_ARGS)
@@ -53,6 +53,17 @@ extern int		pgut_log_level;
 extern int		pgut_abort_level;
 extern bool		pgut_echo;	
 
+/*
+ * Statement timing: every statement of pgut_execute_elevel() is timed under
+ * pgut_label, which applies to the next statement only, or else under its
+ * first words. Those over pgut_slow_statement_ms (if not negative) are
+ * logged, and with pgut_statement_stats a latency histogram per label is
+ * logged at exit.
+ */
+extern const char *pgut_label;
+extern int		pgut_slow_statement_ms;
+extern bool		pgut_statement_stats;
+
 extern void pgut_init(int argc, char **argv);
 extern void pgut_atexit_push(pgut_atexit_callback callback, void *userdata);
 extern void pgut_atexit_pop(pgut_atexit_callback callback, void *userdata);
@@ -158,6 +169,7 @@ extern bool pgut_appendStringInfoVA(StringInfo str, const char *fmt, va_list arg
 __attribute__((format(printf, 2, 0)));
 extern int appendStringInfoFile(StringInfo str, FILE *fp);
 extern int appendStringInfoFd(StringInfo str, int fd);
+extern void pgut_append_backend_pids(StringInfo buf);
 
 extern bool parse_bool(const char *value, bool *result);
 extern bool parse_bool_with_len(const char *value, size_t len, bool *result);
@@ -199,6 +211,11 @@ extern size_t simple_string_list_size(SimpleStringList list);
 extern int wait_for_socket(int sock, struct timeval *timeout);
 extern int wait_for_sockets(int nfds, fd_set *fds, struct timeval *timeout);
 
+/*
+ * time operations
+ */
+extern int64 pgut_monotonic_usec(void);
+
 #ifdef WIN32
 extern int sleep(unsigned int seconds);
 extern int usleep(unsigned int usec);
@@ -33,21 +33,56 @@
 /*
  * catalog/pg_foo_fn.h headers was merged back into pg_foo.h headers
  */
+#include "catalog/partition.h"
+#include "catalog/pg_attrdef.h"
+#include "catalog/pg_depend.h"
+#include "catalog/pg_index.h"
 #include "catalog/pg_inherits.h"
 #include "catalog/pg_namespace.h"
 #include "catalog/pg_opclass.h"
+#include "catalog/pg_rewrite.h"
 #include "catalog/pg_type.h"
 #include "commands/tablecmds.h"
+#include "commands/tablespace.h"
 #include "commands/trigger.h"
+#include "funcapi.h"
 #include "miscadmin.h"
+#include "parser/scansup.h"
+#include "portability/instr_time.h"
 #include "storage/lmgr.h"
+#include "storage/proc.h"
+#include "storage/procarray.h"
+#if PG_VERSION_NUM < 170000
+#include "storage/sinvaladt.h"
+#endif
 #include "utils/array.h"
 #include "utils/builtins.h"
+#include "utils/fmgroids.h"
 #include "utils/guc.h"
 #include "utils/lsyscache.h"
+#include "utils/memutils.h"
+#include "utils/partcache.h"
 #include "utils/rel.h"
 #include "utils/relcache.h"
+#include "utils/resowner.h"
 #include "utils/syscache.h"
+#include "utils/tuplestore.h"
+
+#if PG_VERSION_NUM >= 150000
+#include "common/pg_prng.h"
+#define random_fraction()	pg_prng_double(&pg_global_prng_state)
+#else
+#define random_fraction()	((double) random() / ((double) MAX_RANDOM_VALUE + 1))
+#endif
+
+/* virtual transaction ids name a ProcNumber instead of a BackendId in 17 */
+#if PG_VERSION_NUM >= 170000
+#define VXID_BACKEND(vxid)		((vxid).procNumber)
+#define VXID_GET_PROC(vxid)		ProcNumberGetProc((vxid).procNumber)
+#else
+#define VXID_BACKEND(vxid)		((vxid).backendId)
+#define VXID_GET_PROC(vxid)		BackendIdGetProc((vxid).backendId)
+#endif
 
 #include "migrate.h"
 #include "pgut/pgut-spi.h"
@@ -72,6 +107,14 @@ extern Datum PGUT_EXPORT migrate_disable_autovacuum(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT migrate_reset_autovacuum(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT migrate_index_swap(PG_FUNCTION_ARGS);
 extern Datum PGUT_EXPORT migrate_get_table_and_inheritors(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_lock_table(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_swap_table(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_swap_storage(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_vxid_snapshot(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_wait_vxids(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_table_metadata(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_bench_trigger(PG_FUNCTION_ARGS);
+extern Datum PGUT_EXPORT migrate_bench_apply(PG_FUNCTION_ARGS);
 
 PG_FUNCTION_INFO_V1(migrate_version);
 PG_FUNCTION_INFO_V1(migrate_trigger);
@@ -84,12 +127,28 @@ PG_FUNCTION_INFO_V1(migrate_disable_autovacuum);
 PG_FUNCTION_INFO_V1(migrate_reset_autovacuum);
 PG_FUNCTION_INFO_V1(migrate_index_swap);
 PG_FUNCTION_INFO_V1(migrate_get_table_and_inheritors);
+PG_FUNCTION_INFO_V1(migrate_lock_table);
+PG_FUNCTION_INFO_V1(migrate_swap_table);
+PG_FUNCTION_INFO_V1(migrate_swap_storage);
+PG_FUNCTION_INFO_V1(migrate_vxid_snapshot);
+PG_FUNCTION_INFO_V1(migrate_wait_vxids);
+PG_FUNCTION_INFO_V1(migrate_table_metadata);
+PG_FUNCTION_INFO_V1(migrate_bench_trigger);
+PG_FUNCTION_INFO_V1(migrate_bench_apply);
 
 static void	migrate_init(void);
 static SPIPlanPtr migrate_prepare(const char *src, int nargs, Oid *argtypes);
 static const char *get_quoted_relname(Oid oid);
 static const char *get_quoted_nspname(Oid oid);
 static void swap_heap_or_index_files(Oid r1, Oid r2);
+static void swap_table_files(Oid oid);
+static bool wait_lock_timeout(Oid relid, LOCKMODE lockmode,
+							  const VirtualTransactionId *vxid, int timeout_ms);
+static uint32 apply_log(const char *sql_peek, const char *sql_insert,
+						const char *sql_delete, const char *sql_update,
+						const char *sql_pop, int32 count);
+static void swap_step_done(Tuplestorestate *tupstore, TupleDesc tupdesc,
+						   const char *step, instr_time *last);
 
 #define copy_tuple(tuple, desc) \
 	PointerGetDatum(SPI_returntuple((tuple), (desc)))
@@ -227,14 +286,36 @@ migrate_trigger(PG_FUNCTION_ARGS)
 Datum
 migrate_apply(PG_FUNCTION_ARGS)
 {
-#define DEFAULT_PEEK_COUNT	1000
-
 	const char *sql_peek = PG_GETARG_CSTRING(0);
 	const char *sql_insert = PG_GETARG_CSTRING(1);
 	const char *sql_delete = PG_GETARG_CSTRING(2);
 	const char *sql_update = PG_GETARG_CSTRING(3);
-	/* sql_pop, the fourth arg, will be used in the loop below */
+	const char *sql_pop = PG_GETARG_CSTRING(4);
 	int32		count = PG_GETARG_INT32(5);
+	uint32		n;
+
+	/* authority check */
+	must_be_superuser("migrate_apply");
+
+	/* connect to SPI manager */
+	migrate_init();
+
+	n = apply_log(sql_peek, sql_insert, sql_delete, sql_update, sql_pop, count);
+
+	SPI_finish();
+
+	PG_RETURN_INT32(n);
+}
+
+/*
+ * Body of migrate_apply(), also used by migrate_swap_table(). The caller
+ * must be connected to SPI. Returns the number of performed operations.
+ */
+static uint32
+apply_log(const char *sql_peek, const char *sql_insert, const char *sql_delete,
+		  const char *sql_update, const char *sql_pop, int32 count)
+{
+#define DEFAULT_PEEK_COUNT	1000
 
 	SPIPlanPtr		plan_peek = NULL;
 	SPIPlanPtr		plan_insert = NULL;
@@ -244,15 +325,9 @@ migrate_apply(PG_FUNCTION_ARGS)
 	Oid				argtypes_peek[1] = { INT4OID };
 	Datum			values_peek[1];
 	const char			nulls_peek[1] = { 0 };
-	StringInfoData		sql_pop;
-
-	initStringInfo(&sql_pop);
-
-	/* authority check */
-	must_be_superuser("migrate_apply");
+	StringInfoData		sql_pop_ids;
 
-	/* connect to SPI manager */
-	migrate_init();
+	initStringInfo(&sql_pop_ids);
 
 	/* peek tuple in log */
 	plan_peek = migrate_prepare(sql_peek, 1, argtypes_peek);
@@ -284,8 +359,8 @@ migrate_apply(PG_FUNCTION_ARGS)
 		argtypes[1] = SPI_gettypeid(desc, 2);	/* pk */
 		argtypes[2] = SPI_gettypeid(desc, 3);	/* row */
 
-		resetStringInfo(&sql_pop);
-		appendStringInfoString(&sql_pop, PG_GETARG_CSTRING(4));
+		resetStringInfo(&sql_pop_ids);
+		appendStringInfoString(&sql_pop_ids, sql_pop);
 
 		for (i = 0; i < ntuples; i++, n++)
 		{
@@ -328,26 +403,26 @@ migrate_apply(PG_FUNCTION_ARGS)
 			 * can delete all the rows we have processed at-once.
 			 */
 			if (i == 0)
-				appendStringInfoString(&sql_pop, pkid);
+				appendStringInfoString(&sql_pop_ids, pkid);
 			else
-				appendStringInfo(&sql_pop, ",%s", pkid);
+				appendStringInfo(&sql_pop_ids, ",%s", pkid);
 			pfree(pkid);
 		}
 		/* i must be > 0 (and hence we must have some rows to delete)
 		 * since SPI_processed > 0
 		 */
 		Assert(i > 0);
-		appendStringInfoString(&sql_pop, ");");
+		appendStringInfoString(&sql_pop_ids, ");");
 
 		/* Bulk delete of processed rows from the log table */
-		execute(SPI_OK_DELETE, sql_pop.data);
+		execute(SPI_OK_DELETE, sql_pop_ids.data);
 
 		SPI_freetuptable(tuptable);
 	}
 
-	SPI_finish();
+	pfree(sql_pop_ids.data);
 
-	PG_RETURN_INT32(n);
+	return n;
 }
 
 static char *
@@ -816,6 +891,70 @@ migrate_swap(PG_FUNCTION_ARGS)
 	uint32			records;
 	uint32			i;
 
+	/* authority check */
+	must_be_superuser("migrate_swap");
+
+	/* connect to SPI manager */
+	migrate_init();
+
+	swap_table_files(oid);
+
+	/* swap indexes. */
+	values[0] = ObjectIdGetDatum(oid);
+	execute_with_args(SPI_OK_SELECT,
+		"SELECT X.oid, Y.oid"
+		"  FROM pg_catalog.pg_index I,"
+		"       pg_catalog.pg_class X,"
+		"       pg_catalog.pg_class Y"
+		" WHERE I.indrelid = $1"
+		"   AND I.indexrelid = X.oid"
+		"   AND I.indisvalid"
+		"   AND Y.oid = ('migrate.index_' || X.oid)::regclass",
+		1, argtypes, values, nulls);
+
+	tuptable = SPI_tuptable;
+	desc = tuptable->tupdesc;
+	records = SPI_processed;
+
+	for (i = 0; i < records; i++)
+	{
+		Oid		idx1, idx2;
+
+		tuple = tuptable->vals[i];
+		idx1 = getoid(tuple, desc, 1);
+		idx2 = getoid(tuple, desc, 2);
+		swap_heap_or_index_files(idx1, idx2);
+
+		CommandCounterIncrement();
+	}
+
+	/* drop migrate trigger */
+	execute_with_format(
+		SPI_OK_UTILITY,
+		"DROP TRIGGER IF EXISTS migrate_trigger ON %s.%s CASCADE",
+		nspname, relname);
+
+	SPI_finish();
+
+	PG_RETURN_VOID();
+}
+
+/*
+ * Swap the relfilenodes of table 'oid' and migrate.table_<oid>, along with
+ * their TOAST relations, and give the new storage the original owner.
+ * Indexes are left to the caller. Must be connected to SPI.
+ */
+static void
+swap_table_files(Oid oid)
+{
+	Oid 			argtypes[1] = { OIDOID };
+	bool	 		nulls[1] = { 0 };
+	Datum	 		values[1];
+	SPITupleTable  *tuptable;
+	TupleDesc		desc;
+	HeapTuple		tuple;
+	uint32			records;
+
 	Oid				reltoastrelid1;
 	Oid				reltoastidxid1;
 	Oid				oid2;
@@ -824,12 +963,6 @@ migrate_swap(PG_FUNCTION_ARGS)
 	Oid				owner1;
 	Oid				owner2;
 
-	/* authority check */
-	must_be_superuser("migrate_swap");
-
-	/* connect to SPI manager */
-	migrate_init();
-
 	/* swap relfilenode and dependencies for tables. */
 	values[0] = ObjectIdGetDatum(oid);
 	execute_with_args(SPI_OK_SELECT,
@@ -871,35 +1004,6 @@ migrate_swap(PG_FUNCTION_ARGS)
 	swap_heap_or_index_files(oid, oid2);
 	CommandCounterIncrement();
 
-	/* swap indexes. */
-	values[0] = ObjectIdGetDatum(oid);
-	execute_with_args(SPI_OK_SELECT,
-		"SELECT X.oid, Y.oid"
-		"  FROM pg_catalog.pg_index I,"
-		"       pg_catalog.pg_class X,"
-		"       pg_catalog.pg_class Y"
-		" WHERE I.indrelid = $1"
-		"   AND I.indexrelid = X.oid"
-		"   AND I.indisvalid"
-		"   AND Y.oid = ('migrate.index_' || X.oid)::regclass",
-		1, argtypes, values, nulls);
-
-	tuptable = SPI_tuptable;
-	desc = tuptable->tupdesc;
-	records = SPI_processed;
-
-	for (i = 0; i < records; i++)
-	{
-		Oid		idx1, idx2;
-
-		tuple = tuptable->vals[i];
-		idx1 = getoid(tuple, desc, 1);
-		idx2 = getoid(tuple, desc, 2);
-		swap_heap_or_index_files(idx1, idx2);
-
-		CommandCounterIncrement();
-	}
-
 	/* swap names for toast tables and toast indexes */
 	if (reltoastrelid1 == InvalidOid && reltoastrelid2 == InvalidOid)
 	{
@@ -967,16 +1071,6 @@ migrate_swap(PG_FUNCTION_ARGS)
 		RENAME_INDEX(reltoastidxid1, name);
 		CommandCounterIncrement();
 	}
-
-	/* drop migrate trigger */
-	execute_with_format(
-		SPI_OK_UTILITY,
-		"DROP TRIGGER IF EXISTS migrate_trigger ON %s.%s CASCADE",
-		nspname, relname);
-
-	SPI_finish();
-
-	PG_RETURN_VOID();
 }
 
 /**
@@ -1426,3 +1520,1563 @@ migrate_get_table_and_inheritors(PG_FUNCTION_ARGS)
 
 	PG_RETURN_ARRAYTYPE_P(result);
 }
+
+/* Longest pause between two conditional lock attempts, in milliseconds */
+#define LOCK_MAX_BACKOFF_MS		100
+
+/**
+ * @fn      Datum migrate_lock_table(PG_FUNCTION_ARGS)
+ * @brief   Lock a table within a time budget without stalling other sessions.
+ *
+ * migrate_lock_table(relid, lockmode, budget_ms)
+ *
+ * A request waiting in the lock queue blocks every later request which
+ * conflicts with it, so a queued ACCESS EXCLUSIVE request stalls all the
+ * readers of the table. Instead, try the lock conditionally and back off
+ * with jitter while other sessions hold conflicting locks. Join the queue
+ * only when none of the holders seen at the previous try is left, i.e.
+ * they are short transactions and the lock should be granted soon, and
+ * then wait no longer than the rest of the budget, using lock_timeout.
+ * Time is measured on the monotonic clock.
+ *
+ * @param	relid		Oid of the table.
+ * @param	lockmode	"ACCESS EXCLUSIVE" or "ACCESS SHARE".
+ * @param	budget_ms	Time to spend, in milliseconds.
+ * @retval				True if the lock is held until the end of the transaction.
+ */
+Datum
+migrate_lock_table(PG_FUNCTION_ARGS)
+{
+	Oid			relid = PG_GETARG_OID(0);
+	char	   *mode = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int32		budget_ms = PG_GETARG_INT32(2);
+	LOCKMODE	lockmode;
+	LOCKTAG		tag;
+	instr_time	start;
+	VirtualTransactionId *holders = NULL;
+	int			nholders = 0;
+	double		backoff_ms = 1;
+
+	/* Check user privileges */
+	must_be_superuser("migrate_lock_table");
+
+	if (pg_strcasecmp(mode, "ACCESS EXCLUSIVE") == 0)
+		lockmode = AccessExclusiveLock;
+	else if (pg_strcasecmp(mode, "ACCESS SHARE") == 0)
+		lockmode = AccessShareLock;
+	else
+		elog(ERROR, "unsupported lock mode: %s", mode);
+
+	SET_LOCKTAG_RELATION(tag, MyDatabaseId, relid);
+	INSTR_TIME_SET_CURRENT(start);
+
+	for (;;)
+	{
+		VirtualTransactionId *conflicts;
+		instr_time	elapsed;
+		double		remaining_ms;
+		bool		persisting = false;
+		int			nconflicts;
+		int			i;
+		int			j;
+
+		if (ConditionalLockRelationOid(relid, lockmode))
+			PG_RETURN_BOOL(true);
+
+		INSTR_TIME_SET_CURRENT(elapsed);
+		INSTR_TIME_SUBTRACT(elapsed, start);
+		remaining_ms = budget_ms - INSTR_TIME_GET_MILLISEC(elapsed);
+		if (remaining_ms <= 0)
+			break;
+
+		/* Does any session which blocked the previous try still hold a
+		 * conflicting lock?
+		 */
+		conflicts = GetLockConflicts(&tag, lockmode, &nconflicts);
+		for (i = 0; i < nconflicts && !persisting; i++)
+		{
+			for (j = 0; j < nholders; j++)
+			{
+				if (VirtualTransactionIdEquals(conflicts[i], holders[j]))
+				{
+					persisting = true;
+					break;
+				}
+			}
+		}
+
+		if (holders != NULL && !persisting)
+		{
+			pfree(holders);
+			pfree(conflicts);
+			PG_RETURN_BOOL(wait_lock_timeout(relid, lockmode, NULL,
+												 (int) remaining_ms));
+		}
+
+		if (holders != NULL)
+			pfree(holders);
+		holders = conflicts;
+		nholders = nconflicts;
+
+		/* Sleep between half and all of the backoff, within the budget */
+		pg_usleep((long) (Min(backoff_ms * (0.5 + random_fraction() / 2),
+							  remaining_ms) * 1000));
+		CHECK_FOR_INTERRUPTS();
+		backoff_ms = Min(backoff_ms * 2, LOCK_MAX_BACKOFF_MS);
+	}
+
+	PG_RETURN_BOOL(false);
+}
+
+/*
+ * Wait in the lock queue for at most timeout_ms. Returns false instead of
+ * raising an error if the lock was not granted in time. With a vxid, wait
+ * for that virtual transaction to end instead of locking relid.
+ */
+static bool
+wait_lock_timeout(Oid relid, LOCKMODE lockmode,
+				  const VirtualTransactionId *vxid, int timeout_ms)
+{
+	MemoryContext	oldcontext = CurrentMemoryContext;
+	ResourceOwner	oldowner = CurrentResourceOwner;
+	volatile bool	granted = false;
+	int				save_nestlevel;
+	char			buf[16];
+
+	save_nestlevel = NewGUCNestLevel();
+	snprintf(buf, sizeof(buf), "%d", Max(timeout_ms, 1));
+	(void) set_config_option("lock_timeout", buf,
+							 PGC_USERSET, PGC_S_SESSION,
+							 GUC_ACTION_SAVE, true, 0, false);
+
+	/* The lock is taken in a subtransaction, so that a timeout can be
+	 * caught; releasing the subtransaction hands the lock to the caller's
+	 * transaction.
+	 */
+	BeginInternalSubTransaction(NULL);
+	MemoryContextSwitchTo(oldcontext);
+
+	PG_TRY();
+	{
+		if (vxid)
+			VirtualXactLock(*vxid, true);
+		else
+			LockRelationOid(relid, lockmode);
+
+		ReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+		granted = true;
+	}
+	PG_CATCH();
+	{
+		ErrorData  *edata;
+
+		MemoryContextSwitchTo(oldcontext);
+		edata = CopyErrorData();
+		FlushErrorState();
+
+		RollbackAndReleaseCurrentSubTransaction();
+		MemoryContextSwitchTo(oldcontext);
+		CurrentResourceOwner = oldowner;
+
+		if (edata->sqlerrcode != ERRCODE_LOCK_NOT_AVAILABLE)
+			ReThrowError(edata);
+		FreeErrorData(edata);
+	}
+	PG_END_TRY();
+
+	AtEOXact_GUC(true, save_nestlevel);
+
+	return granted;
+}
+
+/* Append one (step, elapsed_ms) row to the result of migrate_swap_table() */
+static void
+swap_step_done(Tuplestorestate *tupstore, TupleDesc tupdesc,
+			   const char *step, instr_time *last)
+{
+	instr_time	now;
+	Datum		values[2];
+	bool		nulls[2] = { false, false };
+
+	INSTR_TIME_SET_CURRENT(now);
+	values[0] = CStringGetTextDatum(step);
+	values[1] = Float8GetDatum((double) (INSTR_TIME_GET_MICROSEC(now) -
+										 INSTR_TIME_GET_MICROSEC(*last)) / 1000.0);
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+	*last = now;
+}
+
+/**
+ * @fn      Datum migrate_swap_table(PG_FUNCTION_ARGS)
+ * @brief   Put the rebuilt table in place of the original one.
+ *
+ * migrate_swap_table(relid, sql_peek, sql_insert, sql_delete, sql_update,
+ *                    sql_pop, pkey_index)
+ *
+ * Runs the statements of the swap in a single call, so that the time the
+ * caller holds the ACCESS EXCLUSIVE lock does not include a network round
+ * trip per statement: apply the rest of the log, attach the primary key,
+ * rename the original table to <name>_pre_migrate_<relid>, and give
+ * migrate.table_<relid> the original name and schema. A partition is first
+ * detached from its parent, which the caller has locked too, and the new
+ * table is attached with the same bound.
+ *
+ * @param	relid		Oid of the original table, locked by the caller.
+ * @param	sql_peek..sql_pop	As for migrate_apply().
+ * @param	pkey_index	Index of the new table to back the primary key, or NULL.
+ * @retval				One row per step with its duration in milliseconds.
+ */
+Datum
+migrate_swap_table(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Oid				relid;
+	const char	   *relname;
+	const char	   *nspname;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	oldcontext;
+	instr_time		last;
+	Oid				parent = InvalidOid;
+	const char	   *partbound = NULL;
+	int				i;
+
+	/* authority check */
+	must_be_superuser("migrate_swap_table");
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	for (i = 0; i < 6; i++)
+		if (PG_ARGISNULL(i))
+			elog(ERROR, "migrate_swap_table : argument %d must not be null", i + 1);
+
+	relid = PG_GETARG_OID(0);
+	relname = get_rel_name(relid);
+	nspname = get_quoted_nspname(relid);
+	if (relname == NULL || nspname == NULL)
+		elog(ERROR, "migrate_swap_table : relation %u not found", relid);
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	/* connect to SPI manager */
+	migrate_init();
+
+	INSTR_TIME_SET_CURRENT(last);
+
+	apply_log(PG_GETARG_CSTRING(1), PG_GETARG_CSTRING(2), PG_GETARG_CSTRING(3),
+			  PG_GETARG_CSTRING(4), PG_GETARG_CSTRING(5), 0);
+	swap_step_done(tupstore, tupdesc, "apply log", &last);
+
+	if (!PG_ARGISNULL(6))
+	{
+		execute_with_format(SPI_OK_UTILITY,
+			"ALTER TABLE migrate.table_%u ADD PRIMARY KEY USING INDEX %s",
+			relid, text_to_cstring(PG_GETARG_TEXT_PP(6)));
+		swap_step_done(tupstore, tupdesc, "primary key", &last);
+	}
+
+	/*
+	 * A partition is detached for the renames and the rebuilt table attached
+	 * in its place. The migrate_partition_check constraint the client put on
+	 * migrate.table_<relid> implies the partition bound, so the attach does
+	 * not scan the table; only a default partition of the parent is scanned.
+	 */
+	if (get_rel_relispartition(relid))
+	{
+		parent = get_partition_parent(relid, false);
+		execute_with_format(SPI_OK_SELECT,
+			"SELECT pg_get_expr(relpartbound, oid) FROM pg_class WHERE oid = %u",
+			relid);
+		partbound = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+		execute_with_format(SPI_OK_UTILITY,
+			"ALTER TABLE %s.%s DETACH PARTITION %s.%s",
+			get_quoted_nspname(parent), get_quoted_relname(parent),
+			nspname, quote_identifier(relname));
+		swap_step_done(tupstore, tupdesc, "detach", &last);
+	}
+
+	execute_with_format(SPI_OK_UTILITY,
+		"ALTER TABLE %s.%s RENAME TO %s",
+		nspname, quote_identifier(relname),
+		quote_identifier(psprintf("%s_pre_migrate_%u", relname, relid)));
+	swap_step_done(tupstore, tupdesc, "rename old", &last);
+
+	execute_with_format(SPI_OK_UTILITY,
+		"ALTER TABLE migrate.table_%u RENAME TO %s",
+		relid, quote_identifier(relname));
+	swap_step_done(tupstore, tupdesc, "rename new", &last);
+
+	execute_with_format(SPI_OK_UTILITY,
+		"ALTER TABLE migrate.%s SET SCHEMA %s",
+		quote_identifier(relname), nspname);
+	swap_step_done(tupstore, tupdesc, "set schema", &last);
+
+	if (OidIsValid(parent))
+	{
+		execute_with_format(SPI_OK_UTILITY,
+			"ALTER TABLE %s.%s ATTACH PARTITION %s.%s %s",
+			get_quoted_nspname(parent), get_quoted_relname(parent),
+			nspname, quote_identifier(relname), partbound);
+		execute_with_format(SPI_OK_UTILITY,
+			"ALTER TABLE %s.%s DROP CONSTRAINT IF EXISTS migrate_partition_check",
+			nspname, quote_identifier(relname));
+		swap_step_done(tupstore, tupdesc, "attach", &last);
+	}
+
+	SPI_finish();
+
+	return (Datum) 0;
+}
+
+/**
+ * @fn      Datum migrate_swap_storage(PG_FUNCTION_ARGS)
+ * @brief   Move the rebuilt storage under the original table, keeping its OID.
+ *
+ * migrate_swap_storage(relid, sql_peek, sql_insert, sql_delete, sql_update,
+ *                      sql_pop, alter_sql, hash)
+ *
+ * Instead of renaming migrate.table_<relid> into place, replay the ALTER on
+ * the original table, where it must only change the catalogs, check that the
+ * original's columns now match those of the rebuilt table exactly, and
+ * exchange the relfilenodes of the tables, their TOAST relations and their
+ * indexes. Views, foreign keys, grants and dependent functions stay attached
+ * to the original OID. migrate.table_<relid> is left with the old storage,
+ * to be dropped by migrate_drop().
+ *
+ * The replayed ALTER runs with halo_migrate.forbid_rewrite on, which makes
+ * migrate.forbid_rewrite() refuse any table rewrite. It must not add indexes
+ * or scan the table either, which the client checks (alter_may_scan()):
+ * every index of the original needs a rebuilt counterpart, or the swap is
+ * refused.
+ *
+ * @param	relid		Oid of the original table, locked by the caller.
+ * @param	sql_peek..sql_pop	As for migrate_apply().
+ * @param	alter_sql	The ALTER TABLE actions applied to the rebuilt table, or NULL.
+ * @param	hash		Suffix of the rebuilt indexes' names.
+ * @retval				One row per step with its duration in milliseconds.
+ */
+Datum
+migrate_swap_storage(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Oid				relid;
+	const char	   *relname;
+	const char	   *nspname;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	oldcontext;
+	instr_time		last;
+	Oid				argtypes[2] = { OIDOID, TEXTOID };
+	Datum			values[2];
+	bool			nulls[2] = { false, false };
+	SPITupleTable  *tuptable;
+	uint32			records;
+	uint32			i;
+	Oid			   *pairs;
+	char		   *hash;
+	Oid				migrate_nsp;
+
+	/* authority check */
+	must_be_superuser("migrate_swap_storage");
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	for (i = 0; i < 8; i++)
+		if (PG_ARGISNULL(i) && i != 6)
+			elog(ERROR, "migrate_swap_storage : argument %d must not be null", i + 1);
+
+	relid = PG_GETARG_OID(0);
+	relname = get_quoted_relname(relid);
+	nspname = get_quoted_nspname(relid);
+	if (relname == NULL || nspname == NULL)
+		elog(ERROR, "migrate_swap_storage : relation %u not found", relid);
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	/* connect to SPI manager */
+	migrate_init();
+
+	INSTR_TIME_SET_CURRENT(last);
+
+	apply_log(PG_GETARG_CSTRING(1), PG_GETARG_CSTRING(2), PG_GETARG_CSTRING(3),
+			  PG_GETARG_CSTRING(4), PG_GETARG_CSTRING(5), 0);
+	swap_step_done(tupstore, tupdesc, "apply log", &last);
+
+	if (!PG_ARGISNULL(6))
+	{
+		execute(SPI_OK_UTILITY, "SET LOCAL halo_migrate.forbid_rewrite = on");
+		execute_with_format(SPI_OK_UTILITY, "ALTER TABLE %s.%s %s",
+			nspname, relname, text_to_cstring(PG_GETARG_TEXT_PP(6)));
+		execute(SPI_OK_UTILITY, "SET LOCAL halo_migrate.forbid_rewrite = off");
+		CommandCounterIncrement();
+		swap_step_done(tupstore, tupdesc, "replay alter", &last);
+	}
+
+	values[0] = ObjectIdGetDatum(relid);
+	values[1] = BoolGetDatum(true);
+	argtypes[1] = BOOLOID;
+	execute_with_args(SPI_OK_SELECT, "SELECT migrate.storage_mismatch($1, $2)",
+					  2, argtypes, values, nulls);
+	if (SPI_processed > 0)
+	{
+		char   *mismatch = SPI_getvalue(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1);
+
+		if (mismatch != NULL)
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("table \"%s\" does not match its rebuilt copy after the alter: %s",
+							relname, mismatch)));
+	}
+	swap_step_done(tupstore, tupdesc, "check layout", &last);
+
+	/*
+	 * Pair every index of the original with the one built as <name>_<hash>,
+	 * truncated like the server truncates identifiers, before touching any
+	 * storage. An index left out, such as one added by the replayed ALTER,
+	 * would keep pointing at the old heap; refuse the swap instead.
+	 */
+	execute_with_args(SPI_OK_SELECT,
+		"SELECT I.indexrelid, X.relname"
+		"  FROM pg_catalog.pg_index I"
+		"  JOIN pg_catalog.pg_class X ON X.oid = I.indexrelid"
+		" WHERE I.indrelid = $1",
+		1, argtypes, values, nulls);
+	tuptable = SPI_tuptable;
+	records = SPI_processed;
+	pairs = palloc(sizeof(Oid) * 2 * Max(records, 1));
+	hash = text_to_cstring(PG_GETARG_TEXT_PP(7));
+	migrate_nsp = get_namespace_oid("migrate", false);
+
+	for (i = 0; i < records; i++)
+	{
+		HeapTuple	tuple = tuptable->vals[i];
+		char	   *indexname = SPI_getvalue(tuple, tuptable->tupdesc, 2);
+		char	   *rebuilt = psprintf("%s_%s", indexname, hash);
+
+		truncate_identifier(rebuilt, strlen(rebuilt), false);
+		pairs[i * 2] = getoid(tuple, tuptable->tupdesc, 1);
+		pairs[i * 2 + 1] = get_relname_relid(rebuilt, migrate_nsp);
+		if (!OidIsValid(pairs[i * 2 + 1]))
+			ereport(ERROR,
+					(errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+					 errmsg("index \"%s\" of table \"%s\" has no rebuilt counterpart \"migrate.%s\"",
+							indexname, relname, rebuilt)));
+	}
+	swap_step_done(tupstore, tupdesc, "pair indexes", &last);
+
+	swap_table_files(relid);
+	swap_step_done(tupstore, tupdesc, "swap table", &last);
+
+	for (i = 0; i < records; i++)
+	{
+		swap_heap_or_index_files(pairs[i * 2], pairs[i * 2 + 1]);
+		CommandCounterIncrement();
+	}
+	swap_step_done(tupstore, tupdesc, "swap indexes", &last);
+
+	/* drop migrate trigger */
+	execute_with_format(
+		SPI_OK_UTILITY,
+		"DROP TRIGGER IF EXISTS migrate_trigger ON %s.%s CASCADE",
+		nspname, relname);
+	swap_step_done(tupstore, tupdesc, "drop trigger", &last);
+
+	SPI_finish();
+
+	return (Datum) 0;
+}
+
+/**
+ * @fn      Datum migrate_vxid_snapshot(PG_FUNCTION_ARGS)
+ * @brief   Virtual transactions running in this database right now.
+ *
+ * migrate_vxid_snapshot(exclude_pids)
+ *
+ * Reads the proc array like GetCurrentVirtualXIDs() does, instead of
+ * pg_locks, which takes every lock manager partition lock. Vacuum and
+ * autovacuum processes, our own backend and the backends in exclude_pids
+ * are left out. These are matched by the PID of the backend owning each
+ * virtual transaction, so that a transaction they start meanwhile is left
+ * out too.
+ *
+ * @param	exclude_pids	Backends to ignore, or NULL.
+ * @retval					Array of virtual transaction ids, as "backend/lxid".
+ */
+Datum
+migrate_vxid_snapshot(PG_FUNCTION_ARGS)
+{
+	VirtualTransactionId *vxids;
+	int		   *exclude = NULL;
+	int			nvxids;
+	int			nexclude = 0;
+	Datum	   *result;
+	int			nresult = 0;
+	int			i, j;
+
+	/* authority check */
+	must_be_superuser("migrate_vxid_snapshot");
+
+	if (!PG_ARGISNULL(0))
+	{
+		Datum	   *pids;
+		bool	   *pidnulls;
+		int			npids;
+
+		deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), INT4OID, sizeof(int32),
+						  true, TYPALIGN_INT, &pids, &pidnulls, &npids);
+		exclude = palloc(Max(npids, 1) * sizeof(int));
+		for (i = 0; i < npids; i++)
+			if (!pidnulls[i])
+				exclude[nexclude++] = DatumGetInt32(pids[i]);
+	}
+
+	vxids = GetCurrentVirtualXIDs(InvalidTransactionId, false, false,
+								  PROC_IN_VACUUM | PROC_IS_AUTOVACUUM, &nvxids);
+	result = palloc(Max(nvxids, 1) * sizeof(Datum));
+
+	for (i = 0; i < nvxids; i++)
+	{
+		PGPROC	   *proc = VXID_GET_PROC(vxids[i]);
+
+		for (j = 0; proc != NULL && j < nexclude; j++)
+			if (proc->pid == exclude[j])
+				break;
+		if (proc != NULL && j < nexclude)
+			continue;
+
+		result[nresult++] = CStringGetTextDatum(psprintf("%d/%u",
+			(int) VXID_BACKEND(vxids[i]), vxids[i].localTransactionId));
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(result, nresult, TEXTOID, -1, false,
+										  TYPALIGN_INT));
+}
+
+/**
+ * @fn      Datum migrate_wait_vxids(PG_FUNCTION_ARGS)
+ * @brief   Wait for virtual transactions to end.
+ *
+ * migrate_wait_vxids(vxids, timeout_ms)
+ *
+ * Sleeps on the virtual transaction locks like VirtualXactLock() does, so
+ * it returns as soon as the last of them ends rather than at the next poll.
+ *
+ * @param	vxids		Virtual transaction ids from migrate_vxid_snapshot().
+ * @param	timeout_ms	Longest time to wait, in milliseconds; 0 only checks.
+ * @retval				PIDs of the transactions still running.
+ */
+Datum
+migrate_wait_vxids(PG_FUNCTION_ARGS)
+{
+	int			timeout_ms = PG_GETARG_INT32(1);
+	Datum	   *elems;
+	bool	   *nulls;
+	int			nelems;
+	Datum	   *alive;
+	int			nalive = 0;
+	instr_time	start;
+	int			i;
+
+	/* authority check */
+	must_be_superuser("migrate_wait_vxids");
+
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), TEXTOID, -1, false,
+					  TYPALIGN_INT, &elems, &nulls, &nelems);
+	alive = palloc(Max(nelems, 1) * sizeof(Datum));
+
+	INSTR_TIME_SET_CURRENT(start);
+
+	for (i = 0; i < nelems; i++)
+	{
+		VirtualTransactionId vxid;
+		int			backend;
+		instr_time	now;
+		int			remaining_ms;
+		PGPROC	   *proc;
+
+		if (nulls[i] ||
+			sscanf(TextDatumGetCString(elems[i]), "%d/%u",
+				   &backend, &vxid.localTransactionId) != 2)
+			continue;
+		VXID_BACKEND(vxid) = backend;
+
+		if (VirtualXactLock(vxid, false))
+			continue;		/* already ended */
+
+		INSTR_TIME_SET_CURRENT(now);
+		INSTR_TIME_SUBTRACT(now, start);
+		remaining_ms = timeout_ms - (int) INSTR_TIME_GET_MILLISEC(now);
+		if (remaining_ms > 0 &&
+			wait_lock_timeout(InvalidOid, NoLock, &vxid, remaining_ms))
+			continue;
+
+		/* still running: report its backend, if we can tell */
+		proc = VXID_GET_PROC(vxid);
+		alive[nalive++] = Int32GetDatum(proc ? proc->pid : 0);
+	}
+
+	PG_RETURN_ARRAYTYPE_P(construct_array(alive, nalive, INT4OID, sizeof(int32),
+										  true, TYPALIGN_INT));
+}
+
+/* A table's columns, read once from the syscache */
+typedef struct table_meta
+{
+	Oid			relid;
+	const char *relname;		/* schema-qualified and quoted */
+	int			natts;
+	Form_pg_attribute *atts;	/* atts[i] is attnum i + 1 */
+	char	  **attoptions;		/* "opt=val, ...", or NULL */
+	char	  **defaults;		/* deparsed DEFAULT expression, or NULL */
+} table_meta;
+
+/* "opt=val, opt=val" from a text[] of options */
+static void
+append_options(StringInfo buf, Datum options, const char *prefix)
+{
+	Datum	   *elems;
+	int			nelems;
+	int			i;
+
+	deconstruct_array(DatumGetArrayTypeP(options), TEXTOID, -1, false,
+					  TYPALIGN_INT, &elems, NULL, &nelems);
+	for (i = 0; i < nelems; i++)
+	{
+		if (buf->len > 0)
+			appendStringInfoString(buf, ", ");
+		appendStringInfo(buf, "%s%s", prefix, TextDatumGetCString(elems[i]));
+	}
+}
+
+static void
+read_table_columns(table_meta *meta, int natts)
+{
+	Relation	rel;
+	ScanKeyData key;
+	SysScanDesc scan;
+	HeapTuple	tup;
+	int			i;
+
+	meta->natts = natts;
+	meta->atts = palloc0(Max(natts, 1) * sizeof(Form_pg_attribute));
+	meta->attoptions = palloc0(Max(natts, 1) * sizeof(char *));
+	meta->defaults = palloc0(Max(natts, 1) * sizeof(char *));
+
+	for (i = 0; i < natts; i++)
+	{
+		Datum		options;
+		bool		isnull;
+
+		tup = SearchSysCache2(ATTNUM, ObjectIdGetDatum(meta->relid),
+							  Int16GetDatum(i + 1));
+		if (!HeapTupleIsValid(tup))
+			elog(ERROR, "cache lookup failed for attribute %d of relation %u",
+				 i + 1, meta->relid);
+		meta->atts[i] = palloc(ATTRIBUTE_FIXED_PART_SIZE);
+		memcpy(meta->atts[i], GETSTRUCT(tup), ATTRIBUTE_FIXED_PART_SIZE);
+
+		options = SysCacheGetAttr(ATTNUM, tup, Anum_pg_attribute_attoptions, &isnull);
+		if (!isnull && !meta->atts[i]->attisdropped)
+		{
+			StringInfoData	buf;
+
+			initStringInfo(&buf);
+			append_options(&buf, options, "");
+			meta->attoptions[i] = buf.data;
+		}
+		ReleaseSysCache(tup);
+	}
+
+	/* column defaults, deparsed like pg_get_expr() does */
+	ScanKeyInit(&key, Anum_pg_attrdef_adrelid, BTEqualStrategyNumber,
+				F_OIDEQ, ObjectIdGetDatum(meta->relid));
+	rel = table_open(AttrDefaultRelationId, AccessShareLock);
+	scan = systable_beginscan(rel, AttrDefaultIndexId, true, NULL, 1, &key);
+	while (HeapTupleIsValid(tup = systable_getnext(scan)))
+	{
+		Form_pg_attrdef	def = (Form_pg_attrdef) GETSTRUCT(tup);
+		Datum		adbin;
+		bool		isnull;
+
+		if (def->adnum < 1 || def->adnum > natts ||
+			meta->atts[def->adnum - 1]->attisdropped)
+			continue;
+		adbin = heap_getattr(tup, Anum_pg_attrdef_adbin, RelationGetDescr(rel), &isnull);
+		if (isnull)
+			continue;
+		meta->defaults[def->adnum - 1] = deparse_expression(
+			stringToNode(TextDatumGetCString(adbin)),
+			deparse_context_for(get_rel_name(meta->relid), meta->relid),
+			false, false);
+	}
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+}
+
+/* key columns of an index, as attnums */
+static int
+get_index_keys(Oid indexid, AttrNumber **keys)
+{
+	HeapTuple	tup;
+	Form_pg_index index;
+	int			i;
+
+	tup = SearchSysCache1(INDEXRELID, ObjectIdGetDatum(indexid));
+	if (!HeapTupleIsValid(tup))
+		elog(ERROR, "cache lookup failed for index %u", indexid);
+	index = (Form_pg_index) GETSTRUCT(tup);
+	*keys = palloc(Max(index->indnatts, 1) * sizeof(AttrNumber));
+	for (i = 0; i < index->indnatts; i++)
+		(*keys)[i] = index->indkey.values[i];
+	i = index->indnatts;
+	ReleaseSysCache(tup);
+
+	return i;
+}
+
+/* the given columns, each prefixed with sep but the first */
+static void
+append_key_columns(StringInfo buf, const table_meta *meta,
+				   const AttrNumber *keys, int nkeys, const char *sep)
+{
+	int			i;
+
+	for (i = 0; i < nkeys; i++)
+		appendStringInfo(buf, "%s%s", i > 0 ? sep : "",
+						 quote_identifier(NameStr(meta->atts[keys[i] - 1]->attname)));
+}
+
+/* "(k1, k2) = (row.k1, row.k2)", like get_compare_pkey() and get_assign() */
+static char *
+compare_pkey(const table_meta *meta, const AttrNumber *keys, int nkeys,
+			 const char *row)
+{
+	StringInfoData	buf;
+	char	   *sep = psprintf(", %s.", row);
+
+	initStringInfo(&buf);
+	appendStringInfoChar(&buf, '(');
+	append_key_columns(&buf, meta, keys, nkeys, ", ");
+	appendStringInfo(&buf, ") = (%s.", row);
+	append_key_columns(&buf, meta, keys, nkeys, sep);
+	appendStringInfoChar(&buf, ')');
+
+	return buf.data;
+}
+
+/*
+ * The primary key to replay the log by, i.e. a valid unique index on NOT
+ * NULL columns only, as the migrate.primary_keys view picks it, and the
+ * btree index the table is clustered on. With meta->natts = 0 and no ckid,
+ * e.g. for a TOAST table, pkid is the lowest valid index.
+ */
+static void
+find_table_keys(const table_meta *meta, Oid *pkid, Oid *ckid)
+{
+	Relation	rel;
+	ScanKeyData key;
+	SysScanDesc scan;
+	HeapTuple	tup;
+
+	*pkid = InvalidOid;
+	if (ckid)
+		*ckid = InvalidOid;
+
+	ScanKeyInit(&key, Anum_pg_index_indrelid, BTEqualStrategyNumber,
+				F_OIDEQ, ObjectIdGetDatum(meta->relid));
+	rel = table_open(IndexRelationId, AccessShareLock);
+	scan = systable_beginscan(rel, IndexIndrelidIndexId, true, NULL, 1, &key);
+	while (HeapTupleIsValid(tup = systable_getnext(scan)))
+	{
+		Form_pg_index index = (Form_pg_index) GETSTRUCT(tup);
+		bool		eligible;
+		int			i;
+
+		if (!index->indisvalid)
+			continue;
+
+		if (ckid && index->indisclustered)
+		{
+			HeapTuple	reltup;
+
+			reltup = SearchSysCache1(RELOID, ObjectIdGetDatum(index->indexrelid));
+			if (HeapTupleIsValid(reltup))
+			{
+				if (((Form_pg_class) GETSTRUCT(reltup))->relam == BTREE_AM_OID)
+					*ckid = index->indexrelid;
+				ReleaseSysCache(reltup);
+			}
+		}
+
+		eligible = meta->natts == 0 ||
+				   (index->indisunique &&
+					heap_attisnull(tup, Anum_pg_index_indpred, NULL));
+		for (i = 0; eligible && meta->natts > 0 && i < index->indnatts; i++)
+		{
+			AttrNumber	attnum = index->indkey.values[i];
+
+			eligible = attnum > 0 && attnum <= meta->natts &&
+					   meta->atts[attnum - 1]->attnotnull;
+		}
+		if (eligible && (!OidIsValid(*pkid) || index->indexrelid < *pkid))
+			*pkid = index->indexrelid;
+	}
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+}
+
+/* the number of views whose rules reference the table */
+static int
+count_dependent_views(Oid relid, Relation rewrite_rel)
+{
+	Relation	rel;
+	ScanKeyData key[2];
+	SysScanDesc scan;
+	HeapTuple	tup;
+	List	   *views = NIL;
+
+	ScanKeyInit(&key[0], Anum_pg_depend_refclassid, BTEqualStrategyNumber,
+				F_OIDEQ, ObjectIdGetDatum(RelationRelationId));
+	ScanKeyInit(&key[1], Anum_pg_depend_refobjid, BTEqualStrategyNumber,
+				F_OIDEQ, ObjectIdGetDatum(relid));
+	rel = table_open(DependRelationId, AccessShareLock);
+	scan = systable_beginscan(rel, DependReferenceIndexId, true, NULL, 2, key);
+	while (HeapTupleIsValid(tup = systable_getnext(scan)))
+	{
+		Form_pg_depend dep = (Form_pg_depend) GETSTRUCT(tup);
+		ScanKeyData rulekey;
+		SysScanDesc rulescan;
+		HeapTuple	ruletup;
+
+		if (dep->classid != RewriteRelationId || dep->deptype != DEPENDENCY_NORMAL)
+			continue;
+
+		ScanKeyInit(&rulekey, Anum_pg_rewrite_oid, BTEqualStrategyNumber,
+					F_OIDEQ, ObjectIdGetDatum(dep->objid));
+		rulescan = systable_beginscan(rewrite_rel, RewriteOidIndexId, true,
+									  NULL, 1, &rulekey);
+		if (HeapTupleIsValid(ruletup = systable_getnext(rulescan)))
+		{
+			Oid			view = ((Form_pg_rewrite) GETSTRUCT(ruletup))->ev_class;
+
+			if (get_rel_relkind(view) == RELKIND_VIEW)
+				views = list_append_unique_oid(views, view);
+		}
+		systable_endscan(rulescan);
+	}
+	systable_endscan(scan);
+	table_close(rel, AccessShareLock);
+
+	return list_length(views);
+}
+
+/* Columns of migrate_table_metadata() */
+#define TABLE_METADATA_COLS		30
+
+/**
+ * @fn      Datum migrate_table_metadata(PG_FUNCTION_ARGS)
+ * @brief   Everything the client needs to migrate each of the given tables.
+ *
+ * migrate_table_metadata(relids)
+ *
+ * Returns the columns of the migrate.tables view, which is defined on top
+ * of it, followed by the CREATE TABLE statement with defaults and NOT NULL
+ * settings, the ALTER TABLE setting the column options, and the number of
+ * dependent views. The catalogs are read through the syscache and index
+ * scans in one pass, rather than with a dozen SQL functions per table, so
+ * planning a schema with thousands of tables stays cheap. OIDs of missing
+ * relations and of tables that cannot be migrated are skipped. No lock is
+ * taken on the tables but on partitions, to read the partition constraint.
+ *
+ * @param	relids	Oids of the candidate tables.
+ * @retval			One row per table.
+ */
+Datum
+migrate_table_metadata(PG_FUNCTION_ARGS)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	TupleDesc		tupdesc;
+	Tuplestorestate *tupstore;
+	MemoryContext	oldcontext;
+	MemoryContext	rowcontext;
+	Relation		rewrite_rel;
+	Datum		   *relids;
+	bool		   *relnulls;
+	int				nrelids;
+	int				r;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	deconstruct_array(PG_GETARG_ARRAYTYPE_P(0), OIDOID, sizeof(Oid), true,
+					  TYPALIGN_INT, &relids, &relnulls, &nrelids);
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, &tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	rowcontext = AllocSetContextCreate(CurrentMemoryContext,
+									   "migrate_table_metadata",
+									   ALLOCSET_DEFAULT_SIZES);
+
+	rewrite_rel = table_open(RewriteRelationId, AccessShareLock);
+
+	for (r = 0; r < nrelids; r++)
+	{
+		Oid			relid;
+		HeapTuple	tup;
+		Form_pg_class classForm;
+		char	   *nspname;
+		table_meta	meta;
+		Oid			pkid;
+		Oid			ckid;
+		AttrNumber *pkeys = NULL;
+		int			npkeys = 0;
+		Datum		values[TABLE_METADATA_COLS];
+		bool		nulls[TABLE_METADATA_COLS];
+		StringInfoData	buf;
+		StringInfoData	storage;
+		StringInfoData	insert_cols;
+		StringInfoData	create_cols;
+		StringInfoData	col_storage;
+		StringInfoData	col_options;
+		StringInfoData	drop_cols;
+		NameData	schemaname;
+		Datum		datum;
+		bool		isnull;
+		int			c = 0;
+		int			i;
+
+		if (relnulls[r])
+			continue;
+		relid = DatumGetObjectId(relids[r]);
+
+		MemoryContextReset(rowcontext);
+		oldcontext = MemoryContextSwitchTo(rowcontext);
+
+		tup = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+		if (!HeapTupleIsValid(tup))
+		{
+			MemoryContextSwitchTo(oldcontext);
+			continue;
+		}
+		classForm = (Form_pg_class) GETSTRUCT(tup);
+		nspname = get_namespace_name(classForm->relnamespace);
+		if (classForm->relkind != RELKIND_RELATION ||
+			classForm->relpersistence != RELPERSISTENCE_PERMANENT ||
+			nspname == NULL ||
+			classForm->relnamespace == PG_CATALOG_NAMESPACE ||
+			strcmp(nspname, "information_schema") == 0 ||
+			isAnyTempNamespace(classForm->relnamespace))
+		{
+			ReleaseSysCache(tup);
+			MemoryContextSwitchTo(oldcontext);
+			continue;
+		}
+
+		memset(nulls, 0, sizeof(nulls));
+		meta.relid = relid;
+		meta.relname = quote_qualified_identifier(nspname, NameStr(classForm->relname));
+
+		/* storage parameters, those of the TOAST table included */
+		initStringInfo(&storage);
+		datum = SysCacheGetAttr(RELOID, tup, Anum_pg_class_reloptions, &isnull);
+		if (!isnull)
+			append_options(&storage, datum, "");
+		if (OidIsValid(classForm->reltoastrelid))
+		{
+			HeapTuple	toasttup;
+
+			toasttup = SearchSysCache1(RELOID, ObjectIdGetDatum(classForm->reltoastrelid));
+			if (HeapTupleIsValid(toasttup))
+			{
+				datum = SysCacheGetAttr(RELOID, toasttup, Anum_pg_class_reloptions, &isnull);
+				if (!isnull)
+					append_options(&storage, datum, "toast.");
+				ReleaseSysCache(toasttup);
+			}
+		}
+		/* as migrate.get_storage_param() has it; there is no WITH OIDS since 12 */
+		appendStringInfo(&storage, "%soids = false", storage.len > 0 ? ", " : "");
+
+		/* relname .. ckid */
+		values[c++] = CStringGetTextDatum(meta.relname);
+		values[c++] = ObjectIdGetDatum(relid);
+		values[c++] = ObjectIdGetDatum(classForm->reltoastrelid);
+		values[c] = ObjectIdGetDatum(InvalidOid);
+		if (OidIsValid(classForm->reltoastrelid))
+		{
+			table_meta	toast;
+			Oid			toastidx;
+
+			toast.relid = classForm->reltoastrelid;
+			toast.natts = 0;
+			find_table_keys(&toast, &toastidx, NULL);
+			values[c] = ObjectIdGetDatum(toastidx);
+		}
+		c++;
+		namestrcpy(&schemaname, nspname);
+		values[c++] = NameGetDatum(&schemaname);
+
+		read_table_columns(&meta, classForm->relnatts);
+		find_table_keys(&meta, &pkid, &ckid);
+		if (OidIsValid(pkid))
+			npkeys = get_index_keys(pkid, &pkeys);
+		values[c] = ObjectIdGetDatum(pkid);
+		nulls[c++] = !OidIsValid(pkid);
+		values[c] = ObjectIdGetDatum(ckid);
+		nulls[c++] = !OidIsValid(ckid);
+
+		/* create_pktype */
+		initStringInfo(&buf);
+		appendStringInfo(&buf, "CREATE TYPE migrate.pk_%u AS (", relid);
+		for (i = 0; i < npkeys; i++)
+		{
+			Form_pg_attribute att = meta.atts[pkeys[i] - 1];
+
+			appendStringInfo(&buf, "%s%s %s", i > 0 ? ", " : "",
+							 quote_identifier(NameStr(att->attname)),
+							 format_type_with_typemod(att->atttypid, att->atttypmod));
+		}
+		appendStringInfoChar(&buf, ')');
+		values[c] = CStringGetTextDatum(buf.data);
+		nulls[c++] = !OidIsValid(pkid);
+
+		/* create_log */
+		values[c++] = CStringGetTextDatum(psprintf(
+			"CREATE TABLE migrate.log_%u (id bigserial PRIMARY KEY, pk migrate.pk_%u, row %s)",
+			relid, relid, meta.relname));
+
+		/* create_trigger */
+		resetStringInfo(&buf);
+		appendStringInfo(&buf,
+			"CREATE TRIGGER migrate_trigger"
+			" AFTER INSERT OR DELETE OR UPDATE ON %s"
+			" FOR EACH ROW EXECUTE PROCEDURE migrate.migrate_trigger("
+			"'INSERT INTO migrate.log_%u(pk, row) VALUES("
+			" CASE WHEN $1 IS NULL THEN NULL ELSE (ROW($1.",
+			meta.relname, relid);
+		append_key_columns(&buf, &meta, pkeys, npkeys, ", $1.");
+		appendStringInfo(&buf, ")::migrate.pk_%u) END, $2)')", relid);
+		values[c] = CStringGetTextDatum(buf.data);
+		nulls[c++] = !OidIsValid(pkid);
+
+		/* enable_trigger */
+		values[c++] = CStringGetTextDatum(psprintf(
+			"ALTER TABLE %s ENABLE ALWAYS TRIGGER migrate_trigger", meta.relname));
+
+		/* create_table_1, tablespace_orig, create_table_2, copy_data */
+		values[c++] = CStringGetTextDatum(psprintf(
+			"CREATE TABLE migrate.table_%u WITH (%s) TABLESPACE ", relid, storage.data));
+		values[c++] = CStringGetTextDatum(OidIsValid(classForm->reltablespace) ?
+			quote_identifier(get_tablespace_name(classForm->reltablespace)) :
+			"pg_default");
+
+		resetStringInfo(&buf);
+		initStringInfo(&insert_cols);
+		initStringInfo(&create_cols);
+		initStringInfo(&col_storage);
+		initStringInfo(&col_options);
+		initStringInfo(&drop_cols);
+		for (i = 0; i < meta.natts; i++)
+		{
+			Form_pg_attribute att = meta.atts[i];
+			const char *attname = quote_identifier(NameStr(att->attname));
+			const char *storage_name = NULL;
+
+			/* dropped columns are NULLs of integer type, types are not important */
+			if (att->attisdropped)
+			{
+				appendStringInfo(&buf, "%sNULL::integer AS %s",
+								 buf.len > 0 ? "," : "", attname);
+				appendStringInfo(&drop_cols, "%sDROP COLUMN %s",
+								 drop_cols.len > 0 ? ", " : "", attname);
+				continue;
+			}
+
+			appendStringInfo(&buf, "%s%s", buf.len > 0 ? "," : "", attname);
+			appendStringInfo(&insert_cols, "%s%s", insert_cols.len > 0 ? "," : "", attname);
+			appendStringInfo(&create_cols, "%s\n    %s %s %s%s %s",
+							 create_cols.len > 0 ? "," : "", attname,
+							 format_type_with_typemod(att->atttypid, att->atttypmod),
+							 meta.defaults[i] ? "DEFAULT " : "",
+							 meta.defaults[i] ? meta.defaults[i] : "",
+							 att->attnotnull ? "NOT NULL" : "NULL");
+
+			if (att->attstorage != get_typstorage(att->atttypid))
+			{
+				switch (att->attstorage)
+				{
+					case 'p': storage_name = "PLAIN"; break;
+					case 'm': storage_name = "MAIN"; break;
+					case 'e': storage_name = "EXTERNAL"; break;
+					case 'x': storage_name = "EXTENDED"; break;
+				}
+			}
+			if (storage_name)
+				appendStringInfo(&col_storage, "%s ALTER %s SET STORAGE %s",
+								 col_storage.len > 0 ? "," : "", attname, storage_name);
+
+			if (meta.attoptions[i])
+				appendStringInfo(&col_options, "%s ALTER %s SET (%s)",
+								 col_options.len > 0 ? "," : "", attname,
+								 meta.attoptions[i]);
+		}
+		values[c++] = CStringGetTextDatum(psprintf(" AS SELECT %s FROM ONLY %s",
+												   buf.data, meta.relname));
+		values[c++] = CStringGetTextDatum(psprintf(
+			"INSERT INTO migrate.table_%u SELECT %s FROM ONLY %s",
+			relid, insert_cols.data, meta.relname));
+
+		/* alter_col_storage, drop_columns */
+		values[c] = CStringGetTextDatum(psprintf("ALTER TABLE migrate.table_%u%s",
+												 relid, col_storage.data));
+		nulls[c++] = col_storage.len == 0;
+		values[c] = CStringGetTextDatum(psprintf("ALTER TABLE migrate.table_%u %s",
+												 relid, drop_cols.data));
+		nulls[c++] = drop_cols.len == 0;
+
+		/* delete_log, lock_table, ckey */
+		values[c++] = CStringGetTextDatum(psprintf("DELETE FROM migrate.log_%u", relid));
+		values[c++] = CStringGetTextDatum(psprintf(
+			"LOCK TABLE %s IN ACCESS EXCLUSIVE MODE", meta.relname));
+		if (OidIsValid(ckid))
+			values[c] = DirectFunctionCall2(migrate_get_order_by,
+											ObjectIdGetDatum(ckid),
+											ObjectIdGetDatum(relid));
+		nulls[c++] = !OidIsValid(ckid);
+
+		/* sql_peek .. sql_pop */
+		values[c++] = CStringGetTextDatum(psprintf(
+			"SELECT * FROM migrate.log_%u ORDER BY id LIMIT $1", relid));
+		values[c++] = CStringGetTextDatum(psprintf(
+			"INSERT INTO migrate.table_%u VALUES ($1.*)", relid));
+		if (OidIsValid(pkid))
+		{
+			const char *where = compare_pkey(&meta, pkeys, npkeys, "$1");
+			AttrNumber *cols = palloc(Max(meta.natts, 1) * sizeof(AttrNumber));
+			int			ncols = 0;
+
+			/* get_assign(): all the columns but the dropped ones */
+			for (i = 0; i < meta.natts; i++)
+				if (!meta.atts[i]->attisdropped)
+					cols[ncols++] = i + 1;
+
+			values[c++] = CStringGetTextDatum(psprintf(
+				"DELETE FROM migrate.table_%u WHERE %s", relid, where));
+			values[c++] = CStringGetTextDatum(psprintf(
+				"UPDATE migrate.table_%u SET %s WHERE %s", relid,
+				compare_pkey(&meta, cols, ncols, "$2"), where));
+		}
+		else
+		{
+			nulls[c++] = true;
+			nulls[c++] = true;
+		}
+		values[c++] = CStringGetTextDatum(psprintf(
+			"DELETE FROM migrate.log_%u WHERE id IN (", relid));
+
+		/* partparent, partcheck */
+		nulls[c] = nulls[c + 1] = true;
+		if (classForm->relispartition)
+		{
+			Expr	   *qual;
+
+			values[c] = ObjectIdGetDatum(get_partition_parent(relid, true));
+			nulls[c] = false;
+			qual = (Expr *) get_partition_qual_relid(relid);
+			if (qual)
+			{
+				values[c + 1] = CStringGetTextDatum(deparse_expression((Node *) qual,
+					deparse_context_for(NameStr(classForm->relname), relid),
+					false, false));
+				nulls[c + 1] = false;
+			}
+		}
+		c += 2;
+
+		/* create_table, alter_col_options, dependent_views */
+		values[c++] = CStringGetTextDatum(psprintf(
+			"CREATE TABLE migrate.table_%u (%s)  WITH (%s) TABLESPACE ",
+			relid, create_cols.data, storage.data));
+		values[c] = CStringGetTextDatum(psprintf("ALTER TABLE migrate.table_%u%s",
+												 relid, col_options.data));
+		nulls[c++] = col_options.len == 0;
+		values[c++] = Int32GetDatum(count_dependent_views(relid, rewrite_rel));
+
+		Assert(c == TABLE_METADATA_COLS);
+		ReleaseSysCache(tup);
+
+		tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+		MemoryContextSwitchTo(oldcontext);
+	}
+
+	table_close(rewrite_rel, AccessShareLock);
+	MemoryContextDelete(rowcontext);
+
+	return (Datum) 0;
+}
+
+/*
+ * Microbenchmarks of the two hot paths of a migration: the capture of row
+ * changes by migrate_trigger() and their replay by apply_log(). They run
+ * on a throwaway table, migrate.bench_<pid>, with the log, key type and
+ * target table migrate.table_metadata() describes for it, exactly as for
+ * a real migration, and drop everything when done.
+ *
+ * bytes_per_op is the memory an operation leaves allocated: in its
+ * caller's context for the trigger, which the AFTER trigger machinery
+ * frees per row, and in the SPI context for the apply, which is freed
+ * per batch. The allocator keeps no count of palloc calls.
+ */
+#define BENCH_RESULT_COLS	4
+#define BENCH_RESET_EVERY	1000	/* operations between context resets */
+
+typedef struct bench_objects
+{
+	Oid			relid;
+	char	   *relname;		/* migrate.bench_<pid> */
+	char	   *sql_peek;
+	char	   *sql_insert;
+	char	   *sql_delete;
+	char	   *sql_update;
+	char	   *sql_pop;
+} bench_objects;
+
+static Tuplestorestate *
+bench_result(FunctionCallInfo fcinfo, TupleDesc *tupdesc)
+{
+	ReturnSetInfo  *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+	Tuplestorestate *tupstore;
+	MemoryContext	oldcontext;
+
+	if (rsinfo == NULL || !IsA(rsinfo, ReturnSetInfo) ||
+		(rsinfo->allowedModes & SFRM_Materialize) == 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+				 errmsg("set-valued function called in context that cannot accept a set")));
+
+	oldcontext = MemoryContextSwitchTo(rsinfo->econtext->ecxt_per_query_memory);
+	if (get_call_result_type(fcinfo, NULL, tupdesc) != TYPEFUNC_COMPOSITE)
+		elog(ERROR, "return type must be a row type");
+	tupstore = tuplestore_begin_heap(true, false, work_mem);
+	rsinfo->returnMode = SFRM_Materialize;
+	rsinfo->setResult = tupstore;
+	rsinfo->setDesc = *tupdesc;
+	MemoryContextSwitchTo(oldcontext);
+
+	return tupstore;
+}
+
+static void
+bench_put(Tuplestorestate *tupstore, TupleDesc tupdesc, const char *operation,
+		  int64 ops, instr_time duration, double bytes)
+{
+	Datum	values[BENCH_RESULT_COLS];
+	bool	nulls[BENCH_RESULT_COLS] = { false, false, false, false };
+
+	values[0] = CStringGetTextDatum(operation);
+	values[1] = Int64GetDatum(ops);
+	values[2] = Float8GetDatum(INSTR_TIME_GET_DOUBLE(duration) * 1e9 / Max(ops, 1));
+	values[3] = Float8GetDatum(bytes / Max(ops, 1));
+	tuplestore_putvalues(tupstore, tupdesc, values, nulls);
+}
+
+/*
+ * Create the bench table and the objects of its migration. The caller
+ * must be connected to SPI.
+ */
+static void
+bench_setup(bench_objects *bench)
+{
+	SPITupleTable  *tuptable;
+	int				i;
+
+	bench->relname = psprintf("migrate.bench_%d", MyProcPid);
+	execute_with_format(SPI_OK_UTILITY,
+		"CREATE TABLE %s (id bigint PRIMARY KEY, pad text NOT NULL)", bench->relname);
+	bench->relid = get_relname_relid(bench->relname + strlen("migrate."),
+									 get_namespace_oid("migrate", false));
+
+	execute_with_format(SPI_OK_SELECT,
+		"SELECT create_pktype, create_log, create_trigger, sql_peek, sql_insert,"
+		"       sql_delete, sql_update, sql_pop"
+		"  FROM migrate.table_metadata(ARRAY[%u::oid])", bench->relid);
+	if (SPI_processed != 1)
+		elog(ERROR, "no metadata for %s", bench->relname);
+	tuptable = SPI_tuptable;
+	bench->sql_peek = SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, 4);
+	bench->sql_insert = SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, 5);
+	bench->sql_delete = SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, 6);
+	bench->sql_update = SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, 7);
+	bench->sql_pop = SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, 8);
+
+	/* CREATE TYPE pk, CREATE TABLE log, CREATE TRIGGER */
+	for (i = 1; i <= 3; i++)
+		execute(SPI_OK_UTILITY, SPI_getvalue(tuptable->vals[0], tuptable->tupdesc, i));
+	SPI_freetuptable(tuptable);
+
+	execute_with_format(SPI_OK_UTILITY,
+		"CREATE TABLE migrate.table_%u (LIKE %s INCLUDING INDEXES)",
+		bench->relid, bench->relname);
+}
+
+static void
+bench_cleanup(bench_objects *bench)
+{
+	execute_with_format(SPI_OK_UTILITY,
+		"DROP TABLE %s, migrate.log_%u, migrate.table_%u",
+		bench->relname, bench->relid, bench->relid);
+	execute_with_format(SPI_OK_UTILITY, "DROP TYPE migrate.pk_%u", bench->relid);
+}
+
+/*
+ * Memory held by the transaction, which SPI contexts are created under; a
+ * signed value, so that what a call frees shows as a negative growth.
+ */
+static int64
+bench_memory(void)
+{
+	return (int64) MemoryContextMemAllocated(TopTransactionContext, true);
+}
+
+/*
+ * Capture 'rows' row changes of kind 'event' by calling migrate_trigger()
+ * the way an AFTER ROW trigger is fired. Returns the time spent in the
+ * trigger, and adds the growth of the transaction's memory across the calls
+ * to *bytes: migrate_trigger() allocates in SPI contexts of its own, which
+ * are gone when it returns, so only what it leaves behind counts.
+ */
+static instr_time
+bench_capture(Relation rel, Trigger *trigger, TriggerEvent event,
+			  int32 rows, int32 width, double *bytes)
+{
+	LOCAL_FCINFO(fcinfo, 0);
+	TupleDesc		desc = RelationGetDescr(rel);
+	TriggerData		trigdata;
+	MemoryContext	op_cxt;
+	MemoryContext	oldcontext;
+	Datum			values[2];
+	bool			nulls[2] = { false, false };
+	char		   *pad;
+	instr_time		start;
+	instr_time		end;
+	instr_time		duration;
+	int64			before;
+	int32			i;
+
+	pad = palloc(width + 1);
+	memset(pad, 'x', width);
+	pad[width] = '\0';
+	values[0] = Int64GetDatum(1);
+	values[1] = CStringGetTextDatum(pad);
+
+	memset(&trigdata, 0, sizeof(trigdata));
+	trigdata.type = T_TriggerData;
+	trigdata.tg_event = event | TRIGGER_EVENT_ROW | TRIGGER_EVENT_AFTER;
+	trigdata.tg_relation = rel;
+	trigdata.tg_trigger = trigger;
+	trigdata.tg_trigtuple = heap_form_tuple(desc, values, nulls);
+	if (TRIGGER_FIRED_BY_UPDATE(trigdata.tg_event))
+		trigdata.tg_newtuple = heap_form_tuple(desc, values, nulls);
+
+	op_cxt = AllocSetContextCreate(CurrentMemoryContext, "migrate_bench",
+								   ALLOCSET_DEFAULT_SIZES);
+	INSTR_TIME_SET_ZERO(duration);
+	for (i = 0; i < rows; i++)
+	{
+		CHECK_FOR_INTERRUPTS();
+		if (i % BENCH_RESET_EVERY == 0)
+			MemoryContextReset(op_cxt);
+
+		oldcontext = MemoryContextSwitchTo(op_cxt);
+		InitFunctionCallInfoData(*fcinfo, NULL, 0, InvalidOid, (Node *) &trigdata, NULL);
+		before = bench_memory();
+		INSTR_TIME_SET_CURRENT(start);
+		migrate_trigger(fcinfo);
+		INSTR_TIME_SET_CURRENT(end);
+		*bytes += bench_memory() - before;
+		INSTR_TIME_ACCUM_DIFF(duration, end, start);
+		MemoryContextSwitchTo(oldcontext);
+	}
+	MemoryContextDelete(op_cxt);
+
+	return duration;
+}
+
+/**
+ * @fn      Datum migrate_bench_trigger(PG_FUNCTION_ARGS)
+ * @brief   Time the capture of row changes by migrate_trigger().
+ *
+ * migrate_bench_trigger(rows, width)
+ *
+ * @param	rows	Number of inserts, updates and deletes to capture each.
+ * @param	width	Width of the text column of the rows, in bytes.
+ * @retval			operation, ops, ns_per_op, bytes_per_op for each kind.
+ */
+Datum
+migrate_bench_trigger(PG_FUNCTION_ARGS)
+{
+	int32			rows = PG_GETARG_INT32(0);
+	int32			width = PG_GETARG_INT32(1);
+	static const struct
+	{
+		const char	   *operation;
+		TriggerEvent	event;
+	}				kinds[] = {
+		{ "insert", TRIGGER_EVENT_INSERT },
+		{ "update", TRIGGER_EVENT_UPDATE },
+		{ "delete", TRIGGER_EVENT_DELETE },
+	};
+	Tuplestorestate *tupstore;
+	TupleDesc		tupdesc;
+	bench_objects	bench;
+	Relation		rel;
+	Trigger		   *trigger = NULL;
+	int				i;
+
+	must_be_superuser("migrate_bench_trigger");
+	if (rows <= 0 || width < 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rows must be positive and width not negative")));
+
+	tupstore = bench_result(fcinfo, &tupdesc);
+
+	migrate_init();
+	bench_setup(&bench);
+
+	rel = table_open(bench.relid, AccessShareLock);
+	for (i = 0; rel->trigdesc && i < rel->trigdesc->numtriggers; i++)
+		if (strcmp(rel->trigdesc->triggers[i].tgname, "migrate_trigger") == 0)
+			trigger = &rel->trigdesc->triggers[i];
+	if (trigger == NULL)
+		elog(ERROR, "migrate_trigger not found on %s", bench.relname);
+
+	for (i = 0; i < lengthof(kinds); i++)
+	{
+		double		bytes = 0;
+		instr_time	duration;
+
+		duration = bench_capture(rel, trigger, kinds[i].event, rows, width, &bytes);
+		bench_put(tupstore, tupdesc, kinds[i].operation, rows, duration, bytes);
+	}
+	table_close(rel, AccessShareLock);
+
+	bench_cleanup(&bench);
+	SPI_finish();
+
+	return (Datum) 0;
+}
+
+/**
+ * @fn      Datum migrate_bench_apply(PG_FUNCTION_ARGS)
+ * @brief   Time the replay of a log by apply_log(), as migrate_apply() does.
+ *
+ * migrate_bench_apply(rows, mix)
+ *
+ * @param	rows	Number of log rows to apply.
+ * @param	mix		Percentages of inserts, updates and deletes, as "60,30,10".
+ * @retval			operation, ops, ns_per_op, bytes_per_op of the apply.
+ */
+Datum
+migrate_bench_apply(PG_FUNCTION_ARGS)
+{
+	int32			rows = PG_GETARG_INT32(0);
+	char		   *mix = text_to_cstring(PG_GETARG_TEXT_PP(1));
+	int				inserts;
+	int				updates;
+	int				deletes;
+	char			junk;
+	Tuplestorestate *tupstore;
+	TupleDesc		tupdesc;
+	bench_objects	bench;
+	instr_time		start;
+	instr_time		duration;
+	int64			before;
+	uint32			n;
+
+	must_be_superuser("migrate_bench_apply");
+	if (rows <= 0)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("rows must be positive")));
+	if (sscanf(mix, "%d,%d,%d%c", &inserts, &updates, &deletes, &junk) != 3 ||
+		inserts < 0 || updates < 0 || deletes < 0 ||
+		inserts + updates + deletes != 100)
+		ereport(ERROR,
+				(errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+				 errmsg("invalid mix \"%s\"", mix),
+				 errhint("Give the percentages of inserts, updates and deletes, adding up to 100, as in \"60,30,10\".")));
+
+	tupstore = bench_result(fcinfo, &tupdesc);
+
+	migrate_init();
+	bench_setup(&bench);
+
+	/* The target holds the rows the updates and deletes find by key; the
+	 * operations are interleaved, g * 37 % 100 going through 0..99 every
+	 * hundred rows.
+	 */
+	execute_with_format(SPI_OK_INSERT,
+		"INSERT INTO migrate.table_%u SELECT g, repeat('x', 100) FROM generate_series(1, %d) g",
+		bench.relid, rows);
+	execute_with_format(SPI_OK_INSERT,
+		"INSERT INTO migrate.log_%u (pk, row)"
+		" SELECT CASE WHEN o.op = 'i' THEN NULL ELSE ROW(g)::migrate.pk_%u END,"
+		"        CASE WHEN o.op = 'd' THEN NULL"
+		"             ELSE ROW(CASE WHEN o.op = 'i' THEN %d + g ELSE g END, repeat('y', 100))::%s END"
+		"   FROM generate_series(1, %d) g,"
+		"        LATERAL (SELECT CASE WHEN g * 37 %% 100 < %d THEN 'i'"
+		"                             WHEN g * 37 %% 100 < %d THEN 'u'"
+		"                             ELSE 'd' END AS op) o"
+		"  ORDER BY g",
+		bench.relid, bench.relid, rows, bench.relname, rows,
+		inserts, inserts + updates);
+
+	before = bench_memory();
+	INSTR_TIME_SET_CURRENT(start);
+	n = apply_log(bench.sql_peek, bench.sql_insert, bench.sql_delete,
+				  bench.sql_update, bench.sql_pop, 0);
+	INSTR_TIME_SET_CURRENT(duration);
+	INSTR_TIME_SUBTRACT(duration, start);
+	bench_put(tupstore, tupdesc, "apply", n, duration,
+			  (double) (bench_memory() - before));
+
+	bench_cleanup(&bench);
+	SPI_finish();
+
+	return (Datum) 0;
+}
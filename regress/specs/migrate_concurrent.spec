@@ -0,0 +1,116 @@
+# Row changes from concurrent sessions in every phase of a migration: the
+# migration is driven through the server functions halo_migrate calls, in
+# the same order, while other sessions write to the table and to a copy of
+# it, stress_ref. At the end the migrated table must match the copy.
+
+setup
+{
+  CREATE EXTENSION IF NOT EXISTS halo_migrate;
+  CREATE TABLE stress_t (id integer PRIMARY KEY, v integer NOT NULL, pad text);
+  INSERT INTO stress_t SELECT g, g, repeat('x', g % 50) FROM generate_series(1, 1000) g;
+  CREATE TABLE stress_ref AS TABLE stress_t;
+  CREATE SEQUENCE stress_seq START 2001;
+  CREATE TABLE stress_state AS SELECT 'stress_t'::regclass::oid AS relid;
+}
+
+setup
+{
+  CREATE PROCEDURE stress_migrate(phase text) LANGUAGE plpgsql AS $$
+  DECLARE
+    r oid := (SELECT relid FROM stress_state);
+    m record;
+  BEGIN
+    SELECT * INTO m FROM migrate.table_metadata(ARRAY[r]);
+    IF phase = 'setup' THEN
+      EXECUTE m.create_pktype;
+      EXECUTE m.create_log;
+      EXECUTE m.create_trigger;
+      EXECUTE m.enable_trigger;
+      EXECUTE m.create_table || 'pg_default';
+      EXECUTE format('ALTER TABLE migrate.table_%s ALTER COLUMN v TYPE bigint', r);
+    ELSIF phase = 'copy' THEN
+      EXECUTE m.delete_log;
+      EXECUTE m.copy_data;
+    ELSIF phase = 'index' THEN
+      EXECUTE format('CREATE UNIQUE INDEX ON migrate.table_%s (id)', r);
+    ELSIF phase = 'apply' THEN
+      EXECUTE format('SELECT migrate.migrate_apply(%L, %L, %L, %L, %L, 0)',
+                     m.sql_peek, m.sql_insert, m.sql_delete, m.sql_update, m.sql_pop);
+    ELSIF phase = 'swap' THEN
+      EXECUTE format('SELECT count(*) FROM migrate.swap_table(%s, %L, %L, %L, %L, %L, NULL)',
+                     r, m.sql_peek, m.sql_insert, m.sql_delete, m.sql_update, m.sql_pop);
+      PERFORM migrate.migrate_drop(r, 4);
+    END IF;
+  END
+  $$;
+}
+
+setup
+{
+  CREATE PROCEDURE stress_check() LANGUAGE plpgsql AS $$
+  DECLARE
+    d bigint;
+  BEGIN
+    IF to_regclass('stress_t')::oid = (SELECT relid FROM stress_state) THEN
+      RAISE EXCEPTION 'stress_t was not swapped';
+    END IF;
+    SELECT count(*) INTO d
+      FROM ((TABLE stress_t EXCEPT ALL TABLE stress_ref) UNION ALL
+            (TABLE stress_ref EXCEPT ALL TABLE stress_t)) x;
+    IF d > 0 THEN
+      RAISE EXCEPTION '% rows of stress_t differ from stress_ref', d;
+    END IF;
+  END
+  $$;
+}
+
+teardown
+{
+  DO $$
+  DECLARE
+    r oid := (SELECT relid FROM stress_state);
+    t regclass;
+  BEGIN
+    IF EXISTS (SELECT FROM pg_class WHERE oid = r) THEN
+      PERFORM migrate.migrate_drop(r, 4);
+    END IF;
+    FOR t IN SELECT oid FROM pg_class WHERE relname LIKE 'stress\_t\_pre\_migrate\_%' LOOP
+      EXECUTE format('DROP TABLE %s', t);
+    END LOOP;
+  END
+  $$;
+  DROP TABLE stress_t, stress_ref, stress_state;
+  DROP SEQUENCE stress_seq;
+  DROP PROCEDURE stress_migrate(text), stress_check();
+}
+
+session migrate
+step m_setup	{ CALL stress_migrate('setup'); }
+step m_copy		{ CALL stress_migrate('copy'); }
+step m_index	{ CALL stress_migrate('index'); }
+step m_apply	{ CALL stress_migrate('apply'); }
+step m_swap		{ CALL stress_migrate('swap'); }
+step m_check	{ CALL stress_check(); }
+
+session writer
+step w_ins		{ WITH n AS (INSERT INTO stress_t SELECT nextval('stress_seq'), g, 'new' FROM generate_series(1, 50) g RETURNING *) INSERT INTO stress_ref SELECT * FROM n; }
+step w_upd		{ UPDATE stress_t SET v = v + 1, pad = 'upd' WHERE id % 7 = 0; UPDATE stress_ref SET v = v + 1, pad = 'upd' WHERE id % 7 = 0; }
+step w_del		{ DELETE FROM stress_t WHERE id % 11 = 0; DELETE FROM stress_ref WHERE id % 11 = 0; }
+step w_pk		{ UPDATE stress_t SET id = id + 10000 WHERE id % 13 = 0; UPDATE stress_ref SET id = id + 10000 WHERE id % 13 = 0; }
+
+# a transaction the copy does not see, which commits in a later phase
+session old
+step o_begin	{ BEGIN; INSERT INTO stress_t VALUES (5000, 0, 'old'); INSERT INTO stress_ref VALUES (5000, 0, 'old'); UPDATE stress_t SET v = -v WHERE id = 3; UPDATE stress_ref SET v = -v WHERE id = 3; }
+step o_commit	{ COMMIT; }
+
+# changes between every two phases
+permutation m_setup w_ins m_copy w_upd m_index w_del m_apply w_pk w_ins m_swap m_check
+
+# an old transaction spanning the copy
+permutation m_setup o_begin m_copy w_upd o_commit m_index m_apply m_swap m_check
+
+# an old transaction spanning the catch-up, drained by the swap
+permutation m_setup m_copy m_index o_begin m_apply w_pk o_commit m_swap m_check
+
+# changes to rows the copy never saw: inserted, re-keyed and deleted in the log alone
+permutation m_setup m_copy w_ins w_pk w_del w_upd m_index m_swap m_check
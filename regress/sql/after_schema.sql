@@ -9,3 +9,60 @@
 \d tbl_with_dropped_column
 \d tbl_with_dropped_toast
 \d tbl_idxopts
+
+--
+-- migrate.tables gives the rows of its definition before table_metadata()
+--
+WITH old_tables AS (
+  SELECT migrate.oid2text(R.oid) AS relname,
+         R.oid AS relid,
+         R.reltoastrelid AS reltoastrelid,
+         CASE WHEN R.reltoastrelid = 0 THEN 0 ELSE (
+            SELECT indexrelid FROM pg_index
+            WHERE indrelid = R.reltoastrelid
+            AND indisvalid) END AS reltoastidxid,
+         N.nspname AS schemaname,
+         PK.indexrelid AS pkid,
+         CK.indexrelid AS ckid,
+         migrate.get_create_index_type(PK.indexrelid, 'migrate.pk_' || R.oid) AS create_pktype,
+         'CREATE TABLE migrate.log_' || R.oid || ' (id bigserial PRIMARY KEY, pk migrate.pk_' || R.oid || ', row ' || migrate.oid2text(R.oid) || ')' AS create_log,
+         migrate.get_create_trigger(R.oid, PK.indexrelid) AS create_trigger,
+         migrate.get_enable_trigger(R.oid) as enable_trigger,
+         'CREATE TABLE migrate.table_' || R.oid || ' WITH (' || migrate.get_storage_param(R.oid) || ') TABLESPACE '  AS create_table_1,
+         coalesce(quote_ident(S.spcname), 'pg_default') as tablespace_orig,
+         ' AS SELECT ' || migrate.get_columns_for_create_as(R.oid) || ' FROM ONLY ' || migrate.oid2text(R.oid) AS create_table_2,
+         'INSERT INTO migrate.table_' || R.oid || ' SELECT ' || migrate.get_columns_for_insert(R.oid) || ' FROM ONLY ' || migrate.oid2text(R.oid) AS copy_data,
+         migrate.get_alter_col_storage(R.oid) AS alter_col_storage,
+         migrate.get_drop_columns(R.oid, 'migrate.table_' || R.oid) AS drop_columns,
+         'DELETE FROM migrate.log_' || R.oid AS delete_log,
+         'LOCK TABLE ' || migrate.oid2text(R.oid) || ' IN ACCESS EXCLUSIVE MODE' AS lock_table,
+         migrate.get_order_by(CK.indexrelid, R.oid) AS ckey,
+         'SELECT * FROM migrate.log_' || R.oid || ' ORDER BY id LIMIT $1' AS sql_peek,
+         'INSERT INTO migrate.table_' || R.oid || ' VALUES ($1.*)' AS sql_insert,
+         'DELETE FROM migrate.table_' || R.oid || ' WHERE ' || migrate.get_compare_pkey(PK.indexrelid, '$1') AS sql_delete,
+         'UPDATE migrate.table_' || R.oid || ' SET ' || migrate.get_assign(R.oid, '$2') || ' WHERE ' || migrate.get_compare_pkey(PK.indexrelid, '$1') AS sql_update,
+         'DELETE FROM migrate.log_' || R.oid || ' WHERE id IN (' AS sql_pop,
+         CASE WHEN R.relispartition THEN (SELECT inhparent FROM pg_inherits WHERE inhrelid = R.oid) END AS partparent,
+         CASE WHEN R.relispartition THEN pg_get_partition_constraintdef(R.oid) END AS partcheck
+    FROM pg_class R
+         LEFT JOIN pg_class T ON R.reltoastrelid = T.oid
+         LEFT JOIN migrate.primary_keys PK
+                ON R.oid = PK.indrelid
+         LEFT JOIN (SELECT CKI.* FROM pg_index CKI, pg_class CKT
+                     WHERE CKI.indisvalid
+                       AND CKI.indexrelid = CKT.oid
+                       AND CKI.indisclustered
+                       AND CKT.relam = 403) CK
+                ON R.oid = CK.indrelid
+         LEFT JOIN pg_namespace N ON N.oid = R.relnamespace
+         LEFT JOIN pg_tablespace S ON S.oid = R.reltablespace
+   WHERE R.relkind = 'r'
+     AND R.relpersistence = 'p'
+     AND N.nspname NOT IN ('pg_catalog', 'information_schema')
+     AND N.nspname NOT LIKE E'pg\\_temp\\_%'
+)
+SELECT 'missing' AS diff, relname
+  FROM (SELECT * FROM old_tables EXCEPT SELECT * FROM migrate.tables) o
+UNION ALL
+SELECT 'extra', relname
+  FROM (SELECT * FROM migrate.tables EXCEPT SELECT * FROM old_tables) n;
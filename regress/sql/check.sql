@@ -101,7 +101,7 @@ CREATE SCHEMA test_schema2;
 CREATE TABLE test_schema2.tbl1 (id INTEGER PRIMARY KEY);
 CREATE TABLE test_schema2.tbl2 (id INTEGER PRIMARY KEY);
 -- => OK
-\! halo_migrate --execute --alter='ADD COLUMN a1 INT' --dbname=contrib_regression --table=test_schema1.tbl1
+\! halo_migrate --execute --always-copy --alter='ADD COLUMN a1 INT' --dbname=contrib_regression --table=test_schema1.tbl1
 
 
 --
@@ -120,9 +120,9 @@ CREATE TABLE parent_b(val integer primary key, i1 int NOT NULL);
 CREATE TABLE child_b_1(val integer primary key) INHERITS(parent_b);
 CREATE TABLE child_b_2(val integer primary key) INHERITS(parent_b);
 -- => OK
-\! halo_migrate --execute --alter='ADD COLUMN a1 INT' --dbname=contrib_regression --table=parent_a
+\! halo_migrate --execute --always-copy --alter='ADD COLUMN a1 INT' --dbname=contrib_regression --table=parent_a
 -- => OK
-\! halo_migrate --execute --alter='ADD COLUMN a1 TEXT' --dbname=contrib_regression --table=child_a_1
+\! halo_migrate --execute --always-copy --alter='ADD COLUMN a1 TEXT' --dbname=contrib_regression --table=child_a_1
 -- => ERROR
 -- TODO non deterministic output \! halo_migrate --execute --alter='NO INHERIT parent_a' --dbname=contrib_regression --table=child_a_2
 -- => ERROR
@@ -2,20 +2,133 @@
 -- do migration
 --
 
-\! halo_migrate --dbname=contrib_regression --table=tbl_cluster --alter='ADD COLUMN a1 INT' --execute
-\! halo_migrate --dbname=contrib_regression --table=tbl_badindex --alter='ADD COLUMN a1 INT' --execute
-\! halo_migrate --dbname=contrib_regression --table=tbl_gistkey --alter='ADD COLUMN a1 INT' --execute
+\! halo_migrate --dbname=contrib_regression --table=tbl_cluster --alter='ADD COLUMN a1 INT' --execute --always-copy
+\! halo_migrate --dbname=contrib_regression --table=tbl_badindex --alter='ADD COLUMN a1 INT' --execute --always-copy
+\! halo_migrate --dbname=contrib_regression --table=tbl_gistkey --alter='ADD COLUMN a1 INT' --execute --always-copy
 \! halo_migrate --dbname=contrib_regression --table=tbl_only_ckey --alter='ADD COLUMN a1 INT' --execute
-\! halo_migrate --dbname=contrib_regression --table=tbl_idxopts --alter='ADD COLUMN a1 INT' --execute
-\! halo_migrate --dbname=contrib_regression --table=tbl_only_pkey --alter='ADD COLUMN a1 INT' --execute
+\! halo_migrate --dbname=contrib_regression --table=tbl_idxopts --alter='ADD COLUMN a1 INT' --execute --always-copy
+\! halo_migrate --dbname=contrib_regression --table=tbl_only_pkey --alter='ADD COLUMN a1 INT' --execute --always-copy
 \! halo_migrate --dbname=contrib_regression --table=tbl_order --alter='ADD COLUMN a1 INT' --execute
-\! halo_migrate --dbname=contrib_regression --table=tbl_with_dropped_column --alter='ADD COLUMN a1 INT' --execute
-\! halo_migrate --dbname=contrib_regression --table=tbl_with_dropped_toast --alter='ADD COLUMN a1 INT' --execute
+\! halo_migrate --dbname=contrib_regression --table=tbl_with_dropped_column --alter='ADD COLUMN a1 INT' --execute --always-copy
+\! halo_migrate --dbname=contrib_regression --table=tbl_with_dropped_toast --alter='ADD COLUMN a1 INT' --execute --always-copy
 \! halo_migrate --dbname=contrib_regression --table=tbl_with_view --alter='ADD COLUMN a1 INT' --execute
 \! halo_migrate --dbname=contrib_regression --table=tbl_with_mod_column_storage --alter='ADD COLUMN a1 INT' --execute
 \! halo_migrate --dbname=contrib_regression --table=tbl_with_toast --alter='ADD COLUMN a1 INT' --execute
 
--- modify column type
+-- modify column type, which needs a rewrite and so the copy
 \! halo_migrate --dbname=contrib_regression --table=tbl_cluster --alter='ALTER COLUMN a1 TYPE bigint' --execute
 \! halo_migrate --dbname=contrib_regression --table=tbl_idxopts --alter='ALTER COLUMN a1 TYPE numeric' --execute
-\! halo_migrate --dbname=contrib_regression --table=tbl_idxopts --alter='ALTER COLUMN i TYPE numeric' --execute
\ No newline at end of file
+\! halo_migrate --dbname=contrib_regression --table=tbl_idxopts --alter='ALTER COLUMN i TYPE numeric' --execute
+
+--
+-- catalog-only change, applied in place on the same storage
+--
+SELECT relfilenode AS order_filenode FROM pg_class WHERE oid = 'tbl_order'::regclass \gset
+\! halo_migrate --dbname=contrib_regression --table=tbl_order --alter='ADD COLUMN a2 INT DEFAULT 7' --execute
+SELECT relfilenode = :order_filenode AS same_storage FROM pg_class WHERE oid = 'tbl_order'::regclass;
+SELECT count(*), sum(c), min(a2), max(a2) FROM tbl_order;
+-- a rewrite is refused in place and the table is copied instead
+\! halo_migrate --dbname=contrib_regression --table=tbl_order --alter='ALTER COLUMN a2 TYPE bigint' --execute
+SELECT relfilenode = :order_filenode AS same_storage FROM pg_class WHERE oid = 'tbl_order'::regclass;
+SELECT count(*), sum(c), min(a2), max(a2) FROM tbl_order;
+-- the run is recorded in migrate.history
+SELECT result, size_before > 0 AS size_before, size_after > 0 AS size_after,
+       index_size > 0 AS index_size, rows_copied,
+       copy_s IS NOT NULL AND index_s IS NOT NULL AND swap_hold_s IS NOT NULL AS timed
+  FROM migrate.history WHERE table_name = 'public.tbl_order' ORDER BY id DESC LIMIT 1;
+
+--
+-- partitions, swapped by a detach and an attach
+--
+CREATE TABLE tbl_part (id int, d int, PRIMARY KEY (id, d)) PARTITION BY RANGE (d);
+CREATE TABLE tbl_part_1 PARTITION OF tbl_part FOR VALUES FROM (0) TO (10);
+INSERT INTO tbl_part SELECT i, i % 10 FROM generate_series(1, 100) i;
+\! halo_migrate --dbname=contrib_regression --parent-table=tbl_part --alter='SET (fillfactor = 80)' --execute --always-copy
+SELECT relname, pg_get_expr(relpartbound, oid) AS bound, reloptions FROM pg_class
+WHERE relkind = 'r' AND relispartition AND relname ~ '^tbl_part' ORDER BY relname;
+SELECT count(*) FROM pg_constraint WHERE conname = 'migrate_partition_check';
+SELECT count(*), sum(id) FROM tbl_part;
+-- the columns of a partition must still match its parent's
+\! halo_migrate --dbname=contrib_regression --table=tbl_part_1 --alter='ADD COLUMN a1 INT' --execute --always-copy
+-- a partition referenced by foreign keys is refused before it is copied
+CREATE TABLE tbl_part_ref (id int, d int, FOREIGN KEY (id, d) REFERENCES tbl_part);
+\! halo_migrate --dbname=contrib_regression --parent-table=tbl_part --alter='SET (fillfactor = 70)' --execute --always-copy
+
+--
+-- --keep-oid: the rebuilt storage is swapped under the original table
+--
+CREATE TABLE tbl_keep (id int PRIMARY KEY, v int, t text);
+INSERT INTO tbl_keep SELECT i, i, 'row ' || i FROM generate_series(1, 100) i;
+CREATE TABLE tbl_keep_ref (id int REFERENCES tbl_keep);
+INSERT INTO tbl_keep_ref SELECT generate_series(1, 10);
+CREATE VIEW tbl_keep_view AS SELECT id, v FROM tbl_keep;
+SELECT oid AS keep_oid, relfilenode AS keep_filenode FROM pg_class WHERE oid = 'tbl_keep'::regclass \gset
+\! halo_migrate --dbname=contrib_regression --table=tbl_keep --alter='ADD COLUMN k1 INT' --execute --always-copy --keep-oid
+SELECT oid = :keep_oid AS same_oid, relfilenode <> :keep_filenode AS new_storage
+  FROM pg_class WHERE relname = 'tbl_keep';
+SELECT count(*), sum(v) FROM tbl_keep_view;
+SELECT count(*) FROM tbl_keep_ref JOIN tbl_keep USING (id);
+INSERT INTO tbl_keep_ref VALUES (1000);
+-- a layout change falls back to the rename swap
+CREATE TABLE tbl_keep2 (id int PRIMARY KEY, v int);
+INSERT INTO tbl_keep2 SELECT i, i FROM generate_series(1, 100) i;
+SELECT oid AS keep2_oid FROM pg_class WHERE oid = 'tbl_keep2'::regclass \gset
+\! halo_migrate --dbname=contrib_regression --table=tbl_keep2 --alter='ALTER COLUMN v TYPE bigint' --execute --always-copy --keep-oid
+SELECT oid <> :keep2_oid AS new_oid, count(*), sum(v)
+  FROM pg_class, tbl_keep2 WHERE relname = 'tbl_keep2' GROUP BY oid;
+-- which a table with dependent views cannot take
+\! halo_migrate --dbname=contrib_regression --table=tbl_keep --alter='ALTER COLUMN v TYPE bigint' --execute --always-copy --keep-oid
+SELECT oid = :keep_oid AS same_oid, atttypid::regtype
+  FROM pg_class JOIN pg_attribute ON attrelid = pg_class.oid
+ WHERE relname = 'tbl_keep' AND attname = 'v';
+
+--
+-- several tables in flight, sharing a pool of index workers
+--
+CREATE TABLE tbl_fly1 (id int PRIMARY KEY, v int);
+CREATE TABLE tbl_fly2 (id int PRIMARY KEY, v int);
+CREATE TABLE tbl_fly3 (id int PRIMARY KEY, v int);
+CREATE INDEX tbl_fly1_v ON tbl_fly1 (v);
+CREATE INDEX tbl_fly2_v ON tbl_fly2 (v);
+CREATE INDEX tbl_fly3_v ON tbl_fly3 (v);
+INSERT INTO tbl_fly1 SELECT i, i FROM generate_series(1, 100) i;
+INSERT INTO tbl_fly2 SELECT i, i FROM generate_series(1, 200) i;
+INSERT INTO tbl_fly3 SELECT i, i FROM generate_series(1, 300) i;
+-- the order of the tables varies, so the output is sorted
+\! halo_migrate --dbname=contrib_regression --table=tbl_fly1 --table=tbl_fly2 --table=tbl_fly3 --alter='ADD COLUMN f1 INT' --execute --always-copy --tables-in-flight=2 --jobs=2 --max-copies=1 2>&1 | sort
+SELECT c.relname, a.attname, count(*) FILTER (WHERE i.indisvalid) AS indexes
+  FROM pg_class c
+  JOIN pg_attribute a ON a.attrelid = c.oid AND a.attname = 'f1'
+  JOIN pg_index i ON i.indrelid = c.oid
+ WHERE c.relname ~ '^tbl_fly\d$'
+ GROUP BY c.relname, a.attname ORDER BY c.relname;
+SELECT 'tbl_fly1' AS relname, count(*), sum(v) FROM tbl_fly1
+UNION ALL SELECT 'tbl_fly2', count(*), sum(v) FROM tbl_fly2
+UNION ALL SELECT 'tbl_fly3', count(*), sum(v) FROM tbl_fly3;
+
+--
+-- --report and --report-events, reduced to the keys which do not vary
+--
+CREATE TABLE tbl_report (id int PRIMARY KEY, v int);
+INSERT INTO tbl_report SELECT i, i FROM generate_series(1, 100) i;
+\! halo_migrate --dbname=contrib_regression --table=tbl_report --alter='ADD COLUMN f1 INT' --execute --always-copy --report=- 2>/dev/null | grep -o '"type":"[a-z]*"\|"result":"[a-z]*"\|"phase":"[a-z ]*"'
+\! halo_migrate --dbname=contrib_regression --table=tbl_report --alter='ADD COLUMN f2 INT' --execute --always-copy --report=- --report-events 2>/dev/null | grep -o '"type":"[a-z]*"' | sort -u
+-- nothing is in flight any more
+SELECT count(*) FROM migrate.progress;
+
+--
+-- a setup over --lock-budget is rolled back and retried on the same table
+--
+CREATE TABLE tbl_budget (id int PRIMARY KEY, a int, b text);
+CREATE INDEX tbl_budget_a ON tbl_budget (a);
+CREATE INDEX tbl_budget_b ON tbl_budget (b);
+INSERT INTO tbl_budget SELECT i, i % 7, md5(i::text) FROM generate_series(1, 100) i;
+\! halo_migrate --dbname=contrib_regression --table=tbl_budget --alter='ADD COLUMN b1 INT' --execute --always-copy --lock-budget=1 2>&1 | grep -v 'held the exclusive lock'
+SELECT count(*) FROM pg_trigger WHERE tgrelid = 'tbl_budget'::regclass;
+SELECT count(*) FROM pg_attribute WHERE attrelid = 'tbl_budget'::regclass AND attname = 'b1';
+
+--
+-- microbenchmarks of the capture and the apply
+--
+SELECT operation, ops FROM migrate.bench_trigger(10);
+SELECT operation, ops FROM migrate.bench_apply(100);
@@ -11,4 +11,16 @@ CREATE ROLE nosuper WITH LOGIN;
 \! halo_migrate --execute --alter='ADD COLUMN ns2 INT' --dbname=contrib_regression --table=tbl_cluster --username=nosuper
 -- => ERROR
 \! halo_migrate --execute --alter='ADD COLUMN ns3 INT' --dbname=contrib_regression --table=tbl_cluster --username=nosuper --no-superuser-check
+-- a role granted migrate.progress reads it without pg_stat_file() rights
+GRANT USAGE ON SCHEMA migrate TO nosuper;
+GRANT SELECT ON migrate.progress TO nosuper;
+INSERT INTO migrate.progress_state
+  VALUES ('tbl_cluster'::regclass, pg_backend_pid(), 'copy', now(), now(),
+          pg_relation_filepath('tbl_cluster'), NULL, 0, 1, 0, NULL, '0', now());
+SET ROLE nosuper;
+SELECT relname, phase, blocks_copied >= 0 AS copied, log_backlog FROM migrate.progress;
+RESET ROLE;
+DELETE FROM migrate.progress_state;
+REVOKE SELECT ON migrate.progress FROM nosuper;
+REVOKE USAGE ON SCHEMA migrate FROM nosuper;
 DROP ROLE IF EXISTS nosuper;
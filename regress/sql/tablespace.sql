@@ -54,7 +54,7 @@ ORDER BY relname;
 SELECT * from testts1 order by id;
 
 -- tablespace stays where it is
-\! halo_migrate --dbname=contrib_regression --table=testts1 --alter='ADD COLUMN a2 INT' --execute
+\! halo_migrate --dbname=contrib_regression --table=testts1 --alter='ADD COLUMN a2 INT' --execute --always-copy
 
 SELECT relname, spcname
 FROM pg_class JOIN pg_tablespace ts ON ts.oid = reltablespace